@@ -0,0 +1,150 @@
+// Synthetic program generator, see ProgramGenerator.h.
+#include "ProgramGenerator.h"
+#include <vector>
+
+namespace {
+
+class Generator {
+    private:
+        const GeneratorOptions& Opts;
+        uint64_t State;
+        std::string Out;
+        std::vector<std::string> Variables; // in scope of the expression being generated
+        unsigned Callees = 0; // functions that may be called
+
+        uint64_t next() {
+            uint64_t Z = (State += 0x9e3779b97f4a7c15);
+            Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+            Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+            return Z ^ (Z >> 31);
+        }
+
+        unsigned below(unsigned N) {
+            return N ? next() % N : 0;
+        }
+
+        bool chance(double P) {
+            return (next() >> 11) * 0x1.0p-53 < P;
+        }
+
+        void literal() {
+            unsigned Value = below(1000);
+            Out += std::to_string(Value / 10);
+            Out += '.';
+            Out += std::to_string(Value % 10);
+        }
+
+        void leaf() {
+            if (Variables.empty() || chance(Opts.LiteralDensity))
+            {
+                literal();
+            } else
+            {
+                Out += Variables[below(Variables.size())];
+            }
+        }
+
+        void expression(unsigned Depth) {
+            if (Depth == 0)
+            {
+                leaf();
+                return;
+            }
+            unsigned Call = Callees ? Opts.Call : 0;
+            unsigned Pick = below(Opts.Add + Opts.Sub + Opts.Mul + Opts.Compare + Call);
+            if (Pick < Opts.Add + Opts.Sub + Opts.Mul)
+            {
+                const char* Op = Pick < Opts.Add ? " + " : Pick < Opts.Add + Opts.Sub ? " - " : " * ";
+                Out += '(';
+                expression(Depth - 1);
+                Out += Op;
+                expression(Depth - 1);
+                Out += ')';
+            } else if (Pick < Opts.Add + Opts.Sub + Opts.Mul + Opts.Compare)
+            {
+                static const char* const Comparisons[] = {" < ", " > ", " <= ", " >= ", " == "};
+                Out += "if ";
+                expression(Depth / 2);
+                Out += Comparisons[below(5)];
+                expression(Depth / 2);
+                Out += " then { ";
+                expression(Depth - 1);
+                Out += " } else { ";
+                expression(Depth - 1);
+                Out += " }";
+            } else
+            {
+                // Calls take three arguments, shallower ones keep the size in check.
+                Out += 'f';
+                Out += std::to_string(below(Callees));
+                Out += '(';
+                for (int i = 0; i < 3; i++)
+                {
+                    Out += i ? ", " : "";
+                    expression(Depth / 2);
+                }
+                Out += ')';
+            }
+        }
+
+        void function(unsigned Index) {
+            Out += "fn f" + std::to_string(Index) + "(a b c) {\n";
+            Variables = {"a", "b", "c"};
+            std::string Indent = "    ";
+            for (unsigned Loop = 0; Loop < Opts.LoopNesting; Loop++)
+            {
+                std::string Var = "i" + std::to_string(Loop);
+                Out += Indent + "for " + Var + " = 0, " + Var + " < " + std::to_string(2 + below(15)) + " in {\n";
+                Variables.push_back(Var);
+                Indent += "    ";
+            }
+            if (Opts.LoopNesting)
+            {
+                Out += Indent + "a = a + ";
+                expression(Opts.Depth);
+                Out += '\n';
+                for (unsigned Loop = Opts.LoopNesting; Loop > 0; Loop--)
+                {
+                    Variables.pop_back();
+                    Indent.resize(Indent.size() - 4);
+                    Out += Indent + "}\n";
+                }
+            }
+            Out += "    ";
+            expression(Opts.Depth);
+            Out += "\n}\n\n";
+        }
+
+    public:
+        Generator(const GeneratorOptions& Opts) : Opts(Opts), State(Opts.Seed) {}
+
+        std::string program() {
+            for (unsigned i = 0; i < Opts.Functions; i++)
+            {
+                Callees = i;
+                function(i);
+            }
+            return std::move(Out);
+        }
+
+        std::string expressions(unsigned Count) {
+            Variables = {"a", "b", "c"};
+            Callees = 10;
+            for (unsigned i = 0; i < Count; i++)
+            {
+                expression(Opts.Depth);
+                Out += ";\n";
+            }
+            return std::move(Out);
+        }
+};
+
+} // namespace
+
+std::string generateProgram(const GeneratorOptions& Opts) {
+    return Generator(Opts).program();
+}
+
+std::string generateExpressions(const GeneratorOptions& Opts, unsigned Count) {
+    return Generator(Opts).expressions(Count);
+}
@@ -0,0 +1,37 @@
+#ifndef __PROGRAMGENERATOR_CPP__
+#define __PROGRAMGENERATOR_CPP__
+
+#include <cstdint>
+#include <string>
+
+// Generates large randlang programs for randlang_bench. The output only
+// depends on the options, the random numbers come from a fixed SplitMix64
+// sequence and not from <random>, whose distributions differ between
+// standard libraries.
+//
+// Every function takes three f64 parameters, runs its loops and ends with an
+// expression:
+//     fn f12(a b c) {
+//         for i0 = 0, i0 < 8 in {
+//             a = a + <expression>
+//         }
+//         <expression>
+//     }
+// Expressions are trees of exactly Depth levels of operators. Their leaves
+// are literals or the variables in scope, the calls go to earlier functions.
+struct GeneratorOptions {
+    unsigned Functions = 1000;
+    unsigned Depth = 5; // levels of operators in an expression
+    unsigned LoopNesting = 1; // loops around the assignment in each function
+    double LiteralDensity = 0.3; // share of the leaves that are literals
+    // Operator mix as relative weights, Compare is an if on a comparison.
+    unsigned Add = 4, Sub = 2, Mul = 3, Compare = 1, Call = 1;
+    uint64_t Seed = 1;
+};
+
+std::string generateProgram(const GeneratorOptions& Opts);
+// Count expressions of the same shape separated by semicolons, using the
+// variables a, b and c and calls to f0 to f9.
+std::string generateExpressions(const GeneratorOptions& Opts, unsigned Count);
+
+#endif
@@ -0,0 +1,370 @@
+// Throughput benchmarks of the compiler on generated programs.
+//
+//   randlang_bench [--functions=N] [--depth=N] [--loops=N] [--literals=P]
+//                  [--mix=add,sub,mul,compare,call] [--seed=N] [--repeat=N]
+//                  [--dump=<file>] [-o <file>]
+//
+// Prints one JSON object (or writes it to -o) with the generator settings and
+// for every benchmark the best time out of --repeat runs and the throughput:
+//   lex               Lexer::next over the whole program, MB/s and tokens/s
+//   parse_expression  Parser::parseExpression on standalone expressions, MB/s and nodes/s
+//   parse             parsing all definitions without generating code, MB/s and nodes/s
+//   codegen           FunctionASTNode::codegen of the parsed definitions, functions/s
+//   compile           Parser::parse, which also folds, generates and optimizes, functions/s
+//   end_to_end        compile plus emitting the object file into memory
+// The compiler's diagnostics go to /dev/null while measuring, the IR dumps of
+// --print-ir stay off.
+#include "../include/Lexer.h"
+#include "../include/Parser.h"
+#include "ProgramGenerator.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/TargetParser/Host.h"
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+// Reaches into the parser to time its parts on their own.
+class ParserBenchmark {
+    public:
+        static uint64_t parseExpressions(Parser& P) {
+            uint64_t Nodes = 0;
+            P.getNextToken();
+            while (P.curTok.is_not(Token::Kind::End))
+            {
+                if (P.curTok.is(Token::Kind::Semicolon))
+                {
+                    P.getNextToken();
+                    continue;
+                }
+                auto E = P.parseExpression();
+                if (!E)
+                {
+                    break;
+                }
+                Nodes += ASTNode::countNodes(*E);
+            }
+            return Nodes;
+        }
+
+        static std::vector<std::unique_ptr<FunctionASTNode>> parseDefinitions(Parser& P) {
+            std::vector<std::unique_ptr<FunctionASTNode>> Definitions;
+            P.getNextToken();
+            while (P.curTok.is_not(Token::Kind::End))
+            {
+                if (P.curTok.lexeme() != "fn")
+                {
+                    P.getNextToken();
+                    continue;
+                }
+                auto Fn = P.parseDefinition();
+                if (!Fn)
+                {
+                    break;
+                }
+                Definitions.push_back(std::move(Fn));
+            }
+            return Definitions;
+        }
+};
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Sends stdout and stderr to /dev/null while it lives.
+class Silence {
+    private:
+        int Out, Err;
+
+        static void flush() {
+            std::cout.flush();
+            std::cerr.flush();
+            llvm::outs().flush();
+            llvm::errs().flush();
+            std::fflush(nullptr);
+        }
+
+    public:
+        Silence() {
+            flush();
+            Out = dup(STDOUT_FILENO);
+            Err = dup(STDERR_FILENO);
+            int Null = open("/dev/null", O_WRONLY);
+            dup2(Null, STDOUT_FILENO);
+            dup2(Null, STDERR_FILENO);
+            close(Null);
+        }
+        ~Silence() {
+            flush();
+            dup2(Out, STDOUT_FILENO);
+            dup2(Err, STDERR_FILENO);
+            close(Out);
+            close(Err);
+        }
+};
+
+struct Result {
+    double Seconds = 0;
+    uint64_t Units = 0; // tokens, nodes or functions, per run
+};
+
+// Best of Repeat runs. Run does its own setup and returns the time it measured.
+template <typename F> Result best(unsigned Repeat, F Run) {
+    Result Best;
+    for (unsigned i = 0; i < Repeat; i++)
+    {
+        Result R = Run();
+        if (i == 0 || R.Seconds < Best.Seconds)
+        {
+            Best = R;
+        }
+    }
+    return Best;
+}
+
+double seconds(Clock::time_point Start) {
+    return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+llvm::TargetMachine* createTargetMachine() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    std::string TargetTriple = llvm::sys::getDefaultTargetTriple();
+    std::string Error;
+    auto Target = llvm::TargetRegistry::lookupTarget(llvm::Triple(TargetTriple), Error);
+    if (!Target)
+    {
+        llvm::errs() << Error << "\n";
+        return nullptr;
+    }
+    auto CPU = "generic";
+    llvm::TargetOptions opt;
+    return Target->createTargetMachine(llvm::Triple(TargetTriple), CPU, "", opt, llvm::Reloc::PIC_);
+}
+
+bool parseUnsigned(llvm::StringRef Value, unsigned& Out, const char* Option) {
+    if (Value.getAsInteger(10, Out))
+    {
+        std::cerr << Option << " expects a number\n";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    GeneratorOptions Gen;
+    unsigned Repeat = 5;
+    std::string Dump, Output;
+    for (int i = 1; i < argc; i++)
+    {
+        llvm::StringRef Arg(argv[i]);
+        bool Ok = true;
+        if (Arg.consume_front("--functions="))
+        {
+            Ok = parseUnsigned(Arg, Gen.Functions, "--functions");
+        } else if (Arg.consume_front("--depth="))
+        {
+            Ok = parseUnsigned(Arg, Gen.Depth, "--depth");
+        } else if (Arg.consume_front("--loops="))
+        {
+            Ok = parseUnsigned(Arg, Gen.LoopNesting, "--loops");
+        } else if (Arg.consume_front("--literals="))
+        {
+            Ok = !Arg.getAsDouble(Gen.LiteralDensity) && Gen.LiteralDensity >= 0 && Gen.LiteralDensity <= 1;
+            if (!Ok)
+            {
+                std::cerr << "--literals expects a share between 0 and 1\n";
+            }
+        } else if (Arg.consume_front("--mix="))
+        {
+            unsigned* Weights[] = {&Gen.Add, &Gen.Sub, &Gen.Mul, &Gen.Compare, &Gen.Call};
+            for (unsigned* W : Weights)
+            {
+                auto Parts = Arg.split(',');
+                Ok = Ok && parseUnsigned(Parts.first, *W, "--mix");
+                Arg = Parts.second;
+            }
+            Ok = Ok && Gen.Add + Gen.Sub + Gen.Mul + Gen.Compare > 0;
+        } else if (Arg.consume_front("--seed="))
+        {
+            Ok = !Arg.getAsInteger(10, Gen.Seed);
+        } else if (Arg.consume_front("--repeat="))
+        {
+            Ok = parseUnsigned(Arg, Repeat, "--repeat") && Repeat > 0;
+        } else if (Arg.consume_front("--dump="))
+        {
+            Dump = Arg.str();
+        } else if (Arg == "-o" && i + 1 < argc)
+        {
+            Output = argv[++i];
+        } else
+        {
+            Ok = false;
+        }
+        if (!Ok)
+        {
+            std::cerr << "bad argument " << argv[i] << "\nUSAGE: randlang_bench [--functions=N] [--depth=N] [--loops=N] [--literals=P] "
+                         "[--mix=add,sub,mul,compare,call] [--seed=N] [--repeat=N] [--dump=<file>] [-o <file>]\n";
+            return 1;
+        }
+    }
+
+    const std::string Program = generateProgram(Gen);
+    const std::string Expressions = generateExpressions(Gen, Gen.Functions * 2);
+    if (!Dump.empty())
+    {
+        std::error_code EC;
+        llvm::raw_fd_ostream DumpFile(Dump, EC, llvm::sys::fs::OF_Text);
+        if (EC)
+        {
+            std::cerr << "could not open " << Dump << ": " << EC.message() << "\n";
+            return 1;
+        }
+        DumpFile << Program;
+    }
+    llvm::TargetMachine* TheTargetMachine = createTargetMachine();
+    if (!TheTargetMachine)
+    {
+        return 1;
+    }
+
+    Result Lex, ParseExpression, Parse, Codegen, Compile, EndToEnd;
+    size_t ObjectBytes = 0;
+    {
+        Silence Quiet;
+        Lex = best(Repeat, [&] {
+            auto Start = Clock::now();
+            Lexer L(Program.c_str());
+            uint64_t Tokens = 0;
+            for (Token T = L.next(); !T.is_one_of(Token::Kind::End, Token::Kind::Unexpected); T = L.next())
+            {
+                Tokens++;
+            }
+            return Result{seconds(Start), Tokens};
+        });
+        ParseExpression = best(Repeat, [&] {
+            Parser P(Expressions.c_str());
+            auto Start = Clock::now();
+            uint64_t Nodes = ParserBenchmark::parseExpressions(P);
+            return Result{seconds(Start), Nodes};
+        });
+        Parse = best(Repeat, [&] {
+            Parser P(Program.c_str());
+            auto Start = Clock::now();
+            auto Definitions = ParserBenchmark::parseDefinitions(P);
+            double Time = seconds(Start);
+            uint64_t Nodes = 0;
+            for (auto &Fn : Definitions)
+            {
+                Nodes += ASTNode::countNodes(*Fn);
+            }
+            return Result{Time, Nodes};
+        });
+        Codegen = best(Repeat, [&] {
+            Parser P(Program.c_str());
+            auto Definitions = ParserBenchmark::parseDefinitions(P);
+            for (auto &Fn : Definitions)
+            {
+                Fn->foldConstants();
+            }
+            uint64_t Functions = 0;
+            auto Start = Clock::now();
+            for (auto &Fn : Definitions)
+            {
+                Functions += Fn->codegen() != nullptr;
+            }
+            return Result{seconds(Start), Functions};
+        });
+        Compile = best(Repeat, [&] {
+            Parser P(Program.c_str());
+            auto Start = Clock::now();
+            P.parse();
+            double Time = seconds(Start);
+            uint64_t Functions = 0;
+            for (auto &F : *ASTNode::TheModule)
+            {
+                Functions += !F.isDeclaration();
+            }
+            return Result{Time, Functions};
+        });
+        EndToEnd = best(Repeat, [&] {
+            auto Start = Clock::now();
+            Parser P(Program.c_str());
+            P.parse();
+            std::string TargetTriple = TheTargetMachine->getTargetTriple().str();
+            ASTNode::TheModule->setTargetTriple(llvm::Triple(TargetTriple));
+            ASTNode::TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+            llvm::SmallVector<char, 0> Object;
+            llvm::raw_svector_ostream Dest(Object);
+            llvm::legacy::PassManager pass;
+            if (TheTargetMachine->addPassesToEmitFile(pass, Dest, nullptr, llvm::CodeGenFileType::ObjectFile))
+            {
+                return Result{};
+            }
+            pass.run(*ASTNode::TheModule);
+            ObjectBytes = Object.size();
+            return Result{seconds(Start), Gen.Functions};
+        });
+    }
+
+    if (Compile.Units != Gen.Functions || Codegen.Units != Gen.Functions)
+    {
+        std::cerr << "the generated program did not compile: " << Compile.Units << " of " << Gen.Functions << " functions\n";
+        return 1;
+    }
+
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Output.empty() ? "-" : Output, EC, llvm::sys::fs::OF_Text);
+    if (EC)
+    {
+        std::cerr << "could not open " << Output << ": " << EC.message() << "\n";
+        return 1;
+    }
+    const double MB = Program.size() / 1e6, ExpressionMB = Expressions.size() / 1e6;
+    llvm::json::OStream J(OS, 2);
+    auto Throughput = [&](const char* Name, const Result& R, double Megabytes, const char* Units) {
+        J.attributeObject(Name, [&] {
+            J.attribute("seconds", R.Seconds);
+            if (Megabytes)
+            {
+                J.attribute("mb_per_s", Megabytes / R.Seconds);
+            }
+            J.attribute(Units, (int64_t)R.Units);
+            J.attribute(std::string(Units) + "_per_s", R.Units / R.Seconds);
+        });
+    };
+    J.object([&] {
+        J.attributeObject("generator", [&] {
+            J.attribute("functions", (int64_t)Gen.Functions);
+            J.attribute("depth", (int64_t)Gen.Depth);
+            J.attribute("loops", (int64_t)Gen.LoopNesting);
+            J.attribute("literals", Gen.LiteralDensity);
+            J.attribute("mix", std::to_string(Gen.Add) + "," + std::to_string(Gen.Sub) + "," + std::to_string(Gen.Mul) + "," +
+                                   std::to_string(Gen.Compare) + "," + std::to_string(Gen.Call));
+            J.attribute("seed", (int64_t)Gen.Seed);
+            J.attribute("bytes", (int64_t)Program.size());
+            J.attribute("repeat", (int64_t)Repeat);
+        });
+        Throughput("lex", Lex, MB, "tokens");
+        Throughput("parse_expression", ParseExpression, ExpressionMB, "nodes");
+        Throughput("parse", Parse, MB, "nodes");
+        Throughput("codegen", Codegen, 0, "functions");
+        Throughput("compile", Compile, MB, "functions");
+        Throughput("end_to_end", EndToEnd, MB, "functions");
+        J.attribute("object_bytes", (int64_t)ObjectBytes);
+    });
+    OS << "\n";
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Hand-written C++ versions of the kernels in this directory, for comparison
+// with the code randlang generates. They follow the rdlg code step by step,
+// down to the loops: a rdlg for loop runs its body before it tests the
+// condition, and the condition sees the loop variable before the step.
+#include <cstdint>
+
+extern "C" double putchard(double X);
+
+namespace cpp {
+
+namespace {
+
+double printdensity(double d) {
+    if (d > 8)
+    {
+        return putchard(32);
+    } else if (d > 4)
+    {
+        return putchard(46);
+    } else if (d > 2)
+    {
+        return putchard(43);
+    }
+    return putchard(42);
+}
+
+double mandelconverger(double real, double imag, double iters, double creal, double cimag) {
+    if (iters > 255 || real * real + imag * imag > 4)
+    {
+        return iters;
+    }
+    return mandelconverger(real * real - imag * imag + creal, 2 * real * imag + cimag, iters + 1, creal, cimag);
+}
+
+double ackermann(double m, double n) {
+    if (m == 0)
+    {
+        return n + 1;
+    } else if (n == 0)
+    {
+        return ackermann(m - 1, 1);
+    }
+    return ackermann(m - 1, ackermann(m, n - 1));
+}
+
+double fib(double n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+} // namespace
+
+double mandel(double realstart, double imagstart, double realmag, double imagmag) {
+    double xmin = realstart, xmax = realstart + realmag * 78, xstep = realmag;
+    double ymin = imagstart, ymax = imagstart + imagmag * 40, ystep = imagmag;
+    for (double y = ymin;; y += ystep)
+    {
+        for (double x = xmin;; x += xstep)
+        {
+            printdensity(mandelconverger(x, y, 0, x, y));
+            if (!(x < xmax))
+            {
+                break;
+            }
+        }
+        putchard(10);
+        if (!(y < ymax))
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+double recursive(double n) {
+    return fib(n) + ackermann(2, n);
+}
+
+double loops(double n) {
+    double s = 0.0;
+    for (int64_t i = 0;; i++)
+    {
+        for (int64_t j = 0;; j++)
+        {
+            s = s + i * 0.5 - j * 0.25 + (i - j) * (i + j) * 0.125;
+            if (!(j < n))
+            {
+                break;
+            }
+        }
+        if (!(i < n))
+        {
+            break;
+        }
+    }
+    return s;
+}
+
+double operators(double n) {
+    double acc = 1.0;
+    for (int64_t i = 0;; i++)
+    {
+        double avg = (acc + i) * 0.5;
+        acc = ((avg * 0.999 + 1.0) + (0.0 - acc)) * 0.5;
+        if (!(i < n))
+        {
+            break;
+        }
+    }
+    return acc;
+}
+
+} // namespace cpp
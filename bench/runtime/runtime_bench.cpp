@@ -0,0 +1,98 @@
+// Times the kernels of this directory as compiled by randlang against their
+// C++ versions in kernels.cpp, like rdlgExamples/test.cpp calls into rdlg.
+// Built once per optimization level, RDLG_OPT_LEVEL names the level the
+// kernels were compiled at. Prints one line per kernel with the best
+// ns/iteration (one call of the kernel) out of several batches.
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+#ifndef RDLG_OPT_LEVEL
+#define RDLG_OPT_LEVEL "?"
+#endif
+
+namespace {
+
+// mandel prints its picture through putchard, which only keeps a checksum here.
+uint64_t Printed = 0;
+
+} // namespace
+
+extern "C" {
+double putchard(double X) {
+    Printed = Printed * 31 + (uint64_t)X;
+    return 0;
+}
+
+double mandel(double, double, double, double);
+double recursive(double);
+double loops(double);
+double operators(double);
+}
+
+namespace cpp {
+double mandel(double, double, double, double);
+double recursive(double);
+double loops(double);
+double operators(double);
+} // namespace cpp
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Result of one call, and the characters it printed.
+struct Outcome {
+    double Value;
+    uint64_t Printed;
+};
+
+template <typename F> Outcome once(F Kernel) {
+    Printed = 0;
+    double Value = Kernel();
+    return {Value, Printed};
+}
+
+// Best ns per call over 5 batches of at least 50 ms each.
+template <typename F> double nsPerIteration(F Kernel) {
+    uint64_t Calls = 1;
+    double Best = 0;
+    for (int Batch = 0; Batch < 5;)
+    {
+        auto Start = Clock::now();
+        for (uint64_t i = 0; i < Calls; i++)
+        {
+            Kernel();
+        }
+        double Seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+        if (Seconds < 0.05)
+        {
+            Calls *= 2;
+            continue;
+        }
+        double Ns = Seconds * 1e9 / Calls;
+        Best = Batch++ == 0 || Ns < Best ? Ns : Best;
+    }
+    return Best;
+}
+
+template <typename R, typename C> bool run(const char* Name, R Rdlg, C Cpp) {
+    Outcome A = once(Rdlg), B = once(Cpp);
+    bool Same = A.Printed == B.Printed && std::fabs(A.Value - B.Value) <= 1e-9 * std::fmax(1.0, std::fabs(B.Value));
+    double RdlgNs = nsPerIteration(Rdlg), CppNs = nsPerIteration(Cpp);
+    std::printf("%-10s %-5s %14.1f %14.1f %8.2fx%s\n", Name, RDLG_OPT_LEVEL, RdlgNs, CppNs, RdlgNs / CppNs, Same ? "" : "  results differ");
+    return Same;
+}
+
+} // namespace
+
+int main() {
+    std::printf("%-10s %-5s %14s %14s %9s\n", "kernel", "level", "rdlg ns/iter", "C++ ns/iter", "rdlg/C++");
+    bool Ok = true;
+    Ok &= run("mandel", [] { return mandel(-2.3, -1.3, 0.05, 0.07); }, [] { return cpp::mandel(-2.3, -1.3, 0.05, 0.07); });
+    Ok &= run("recursive", [] { return recursive(20); }, [] { return cpp::recursive(20); });
+    Ok &= run("loops", [] { return loops(300); }, [] { return cpp::loops(300); });
+    Ok &= run("operators", [] { return operators(100000); }, [] { return cpp::operators(100000); });
+    return Ok ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#ifndef __ASTCACHE_CPP__
+#define __ASTCACHE_CPP__
+
+#include "ASTNodes.h"
+#include "Comptime.h"
+#include "Serialize.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Parser;
+
+// A top-level item of a parsed file, in the order the parser handled them.
+// comptime blocks and consts are stored with the value they evaluated to, so
+// a file read back from the cache doesn't run them again.
+enum class ItemKind : uint32_t {
+    Definition, // fn, a Function node
+    Extern, // a Prototype node
+    TopLevel, // an expression outside of a function, a Function node
+    Const, // const NAME = ..., a Value node
+    Embed, // array of a comptime block, a Value node, made before the definition using it
+    Import, // an Import node: the name, the interface file it was found in and its hash
+};
+
+// The items of a file as the parser records them.
+class ParsedFile {
+    public:
+        ASTWriter W;
+        std::vector<std::pair<ItemKind, uint32_t>> Items;
+        bool Failed = false; // files with parse errors aren't stored
+
+        void add(ItemKind Kind, uint32_t Offset) { Items.push_back({Kind, Offset}); }
+        void addValue(ItemKind Kind, const std::string& Name, const ComptimeValue& Value);
+        void addImport(const std::string& Name, const std::string& Path);
+};
+
+// A parsed file read back from the cache.
+struct CachedItem {
+    ItemKind Kind;
+    std::unique_ptr<FunctionASTNode> Function; // Definition and TopLevel
+    std::unique_ptr<PrototypeASTNode> Proto; // Extern
+    std::string Name; // Const, Embed and Import
+    std::string Path, Hash; // Import: the interface file, which must be found again and be unchanged
+    ComptimeValue Value; // Const and Embed
+};
+
+// On-disk cache of parsed files, so a file that is compiled again with other
+// options (optimization level, target CPU, --emit) skips lexing, parsing and
+// compile-time evaluation. An entry is keyed by a hash of the source, the
+// compiler binary and the default fast-math flags, under which comptime values
+// are computed. It depends on nothing else the parser sees but the interface
+// files the source imports, whose hashes the entry keeps.
+// Entries are the binary AST of Serialize.h behind an item table:
+//     "RDLA", version
+//     item count, offset of the item table
+//     offset and size of the AST buffer
+//     item table: kind and offset of each item, relative to the AST buffer
+//     AST buffer
+// One ASTCache is shared by all files of a run, also across threads.
+class ASTCache {
+    private:
+        std::string Directory;
+        std::string Configuration; // the compiler binary and fast-math flags, goes into every key
+        uint64_t MaxSizeBytes;
+        std::atomic<unsigned> Hits{0}, Misses{0}, Stored{0};
+
+        std::string entryPath(const std::string& Key);
+        std::string key(const std::string& Source);
+        bool load(const std::string& Key, std::vector<CachedItem>& Items);
+        void store(const std::string& Key, const ParsedFile& File);
+
+    public:
+        static constexpr uint32_t Version = 6;
+        ASTCache(std::string Directory, std::string Configuration, uint64_t MaxSizeBytes);
+        // Replays the entry of Source into P, or has P parse it and stores a new entry.
+        void parse(Parser& P, const std::string& Source);
+        void prune();
+        void printStats(llvm::raw_ostream& OS);
+        // Hash of an interface file, "" if it can't be read.
+        static std::string hashFile(const std::string& Path);
+        // Reads the items of an entry, which may be mapped from a file.
+        static bool readEntry(llvm::StringRef Data, std::vector<CachedItem>& Items);
+};
+
+#endif
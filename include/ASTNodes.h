@@ -21,38 +21,97 @@
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "DebugInfo.h"
+#include "Memo.h"
 #include "Token.hpp"
+#include "Types.h"
+#include <functional>
 #include <string>
 #include <vector>
 #include <memory>
+#include <optional>
 #include <map>
+#include <set>
 
+// A value known at compile time. Only bool, i64 and f64 values are folded.
+struct Constant {
+    ValueType type;
+    double value;
+};
+using ConstantEnv = std::map<std::string, Constant>;
+
+class ASTWriter;
+struct Effects;
+
+// The state of the compilation is kept in thread local statics, each thread
+// compiles one file at a time into a context of its own.
 class ASTNode { //is named ExprAST in LLVM tutorial
     public:
         virtual ~ASTNode() = default;
         virtual llvm::Value* codegen() = 0;
-        static std::unique_ptr<llvm::LLVMContext> TheContext;
-        static std::unique_ptr<llvm::IRBuilder<>> Builder;
-        static std::unique_ptr<llvm::Module> TheModule;
-        static std::map<std::string, llvm::AllocaInst*> NamedValues;
-        static std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-        static std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-        static std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-        static std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-        static std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-        static std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-        static std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-        llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* TheFunction, llvm::StringRef VarName);
+        virtual ValueType inferType(); // sets and returns exprType, mirrors the types codegen will produce
+        // Constant folding (Simplify.cpp), runs on the AST before inferType and codegen.
+        virtual void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F); // in evaluation order
+        virtual std::unique_ptr<ASTNode> simplify(); // simplifies the children, returns a replacement for this node or nullptr
+        virtual bool evaluate(ConstantEnv& Env, Constant& Result); // false if the value isn't known at compile time
+        virtual void substitute(const std::string& Name, Constant Value); // replaces reads of Name in the children
+        virtual bool assigns(const std::string& Name);
+        static void fold(std::unique_ptr<ASTNode>& Node);
+        static unsigned countNodes(ASTNode& Node);
+        // Function cache keys (FunctionCache.cpp): appends a normalized form of the node to Out,
+        // Names collects the functions, operators and globals it refers to.
+        virtual void describe(std::string& Out, std::set<std::string>& Names);
+        // Binary AST (Serialize.cpp): writes the node after its children, returns its offset.
+        virtual uint32_t serialize(ASTWriter& W);
+        // Purity analysis (Purity.cpp): adds the side effects of the node and its children, runs after inferType.
+        virtual void collectEffects(Effects& E);
+        ValueType exprType = ValueType::F64;
+        SourceLocation Loc; // set by the parser, kept by the binary AST
+        static thread_local std::unique_ptr<llvm::LLVMContext> TheContext;
+        static thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+        static thread_local std::unique_ptr<llvm::Module> TheModule;
+        static thread_local std::map<std::string, llvm::AllocaInst*> NamedValues;
+        static thread_local std::map<std::string, TypeSlot*> NamedTypes;
+        static thread_local bool TypesChanged;
+        static thread_local llvm::CallInst* FunctionRegion; // region entered on demand at the start of the current function
+        static thread_local unsigned RegionDepth; // number of region blocks around the current insert point
+        static thread_local std::map<llvm::AllocaInst*, unsigned> BindingDepth; // RegionDepth each variable was declared at
+        static thread_local std::map<std::string, Constant> ConstValues; // scalar const definitions, substituted by foldConstants
+        static thread_local std::map<std::string, llvm::GlobalVariable*> ConstArrays; // f64[] const definitions, read-only
+        static thread_local std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+        static thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+        static thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+        static thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+        static thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+        static thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+        static thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+        static unsigned DefaultFastMath; // FastMathFlag bits of -ffast-math etc., set before any file is compiled
+        static void resetState(); // frees everything generated for the current file
+        llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* TheFunction, llvm::StringRef VarName, llvm::Type* Ty = nullptr);
         llvm::Value* vLogError(const char *str);
+        llvm::Type* llvmType(ValueType type);
+        llvm::Value* convertTo(llvm::Value* V, llvm::Type* To);
+        llvm::Value* convertTo(llvm::Value* V, ValueType To);
+        static void widen(TypeSlot& Slot, ValueType Type);
+        llvm::Value* makeArray(llvm::Value* Data, llvm::Value* Length);
+        llvm::Value* emitArrayAlloc(llvm::Value* Length);
+        void emitFunctionRegionLeave();
+        void emitLocation(); // for debug info, the instructions built next belong to this node
 };
 
 class NumberASTNode : public ASTNode {
     private:
         double val;
+        ValueType literalType;
 
     public:
-        NumberASTNode(double value);
+        NumberASTNode(double value, ValueType literalType = ValueType::F64);
         llvm::Value* codegen() override;
+        double getValue() const;
+        ValueType inferType() override;
+        bool evaluate(ConstantEnv& Env, Constant& Result) override;
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
 };
 
 class VariableASTNode : public ASTNode {
@@ -62,6 +121,10 @@ class VariableASTNode : public ASTNode {
     public:
         VariableASTNode(const std::string variableName);
         llvm::Value* codegen() override;
+        ValueType inferType() override;
+        bool evaluate(ConstantEnv& Env, Constant& Result) override;
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
         const std::string& getName() const;
 };
 
@@ -71,20 +134,59 @@ class BinaryASTNode : public ASTNode {
         std::unique_ptr<ASTNode> LHS, RHS;
         bool isSinglecharOperator;
         Token::Kind tokenkind;
+        ValueType operandType = ValueType::F64; // both operands are converted to this before a builtin operator is applied
+        bool isBuiltinOperator() const;
     
     public:
         BinaryASTNode(char Op, std::unique_ptr<ASTNode> LHS, std::unique_ptr<ASTNode> RHS, bool isSinglecharOperator, Token::Kind tokenkind);
         llvm::Value* codegen() override;
+        ValueType inferType() override;
+        void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+        std::unique_ptr<ASTNode> simplify() override;
+        bool evaluate(ConstantEnv& Env, Constant& Result) override;
+        bool assigns(const std::string& Name) override;
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
+        void collectEffects(Effects& E) override;
+};
+
+// a[i], a[lo:hi] on arrays and v[i] on vectors
+class IndexExprAST : public ASTNode {
+    private:
+        std::unique_ptr<ASTNode> Base, Index, SliceEnd;
+        llvm::Value* elementPointer(llvm::Value* Array, llvm::Value* Idx);
+
+    public:
+        IndexExprAST(std::unique_ptr<ASTNode> Base, std::unique_ptr<ASTNode> Index, std::unique_ptr<ASTNode> SliceEnd);
+        llvm::Value* codegen() override;
+        llvm::Value* codegenStore(llvm::Value* Val);
+        ValueType inferType() override;
+        void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
+        void collectEffects(Effects& E) override;
+        bool isArrayElement() const; // reads or writes memory, unlike vector lanes and slices
 };
 
 class CallASTNode : public ASTNode {
     private:
         std::string callee;
         std::vector<std::unique_ptr<ASTNode>> args;
+        bool isBuiltin() const;
+        ValueType inferBuiltin();
+        llvm::Value* codegenBuiltin();
+        llvm::Value* codegenOutput();
+        ValueType inferMath();
+        llvm::Value* codegenMath();
 
     public:
         CallASTNode(const std::string& Callee, std::vector<std::unique_ptr<ASTNode>> arguments);
         llvm::Value* codegen() override;
+        ValueType inferType() override;
+        void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
+        void collectEffects(Effects& E) override;
 };
 
 class PrototypeASTNode : public ASTNode {
@@ -93,27 +195,60 @@ class PrototypeASTNode : public ASTNode {
         std::vector<std::string> args;
         bool isOperator;
         unsigned Precedence;
+        std::vector<ValueType> argTypes;
+        ValueType returnType;
+        std::optional<unsigned> fastMath; // @fastmath of the definition
+        bool pure = false;
+        std::optional<MemoOptions> memo; // memo functions are checked like pure ones
+        unsigned effects = EffectAll; // EffectFlag bits, known once the body is generated or for pure externs
 
     public:
-        PrototypeASTNode(const std::string& Name, std::vector<std::string> arguments, bool isOperator=false, unsigned Prec=0);
+        PrototypeASTNode(const std::string& Name, std::vector<std::string> arguments, bool isOperator=false, unsigned Prec=0,
+            std::vector<ValueType> argTypes = {}, ValueType returnType = ValueType::F64);
         const std::string& getName() const;
+        const std::vector<std::string>& getArgs() const;
+        ValueType getArgType(unsigned i) const;
+        ValueType getReturnType() const;
+        void setFastMath(unsigned Flags);
+        const std::optional<unsigned>& getAnnotatedFastMath() const;
+        unsigned getFastMath() const; // the annotation, or DefaultFastMath without one
+        void setPure(bool Pure);
+        bool isPure() const;
+        void setMemo(const MemoOptions& Options);
+        const std::optional<MemoOptions>& getMemo() const;
+        void setEffects(unsigned Flags);
+        unsigned getEffects() const;
         llvm::Function* codegen() override;
         bool isUnaryOp() const;
         bool isBinaryOP() const;
         char getOperatorName() const;
         unsigned getBinaryPrecedence() const;
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
 };
 
 class FunctionASTNode : public ASTNode {
     private:
+        std::string name;
         std::unique_ptr<PrototypeASTNode> proto;
         std::vector<std::unique_ptr<ASTNode>> body;
         //std::map<char, int> BinopPrecedence;
         public:
-        static std::map<std::string, std::unique_ptr<PrototypeASTNode>> FunctionProtos;
+        static thread_local std::map<std::string, std::unique_ptr<PrototypeASTNode>> FunctionProtos;
+        static thread_local std::map<std::string, std::unique_ptr<FunctionASTNode>> OperatorBodies; // kept after codegen so constant operands can be folded
         FunctionASTNode(std::unique_ptr<PrototypeASTNode> prototype, std::vector<std::unique_ptr<ASTNode>> Body);
         llvm::Function* codegen() override;
+        void declare(); // registers the prototype only, the body comes from the function cache
+        const std::string& getName() const;
+        std::vector<std::unique_ptr<ASTNode>>& getBody();
+        void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+        unsigned foldConstants(); // returns the number of nodes removed
+        void describe(std::string& Out, std::set<std::string>& Names) override;
+        uint32_t serialize(ASTWriter& W) override;
+        static bool evaluateOperator(const std::string& Name, std::vector<Constant> Args, Constant& Result);
+        void inferTypes(PrototypeASTNode& P);
         static llvm::Function* getFunction(std::string Name);
+        static ValueType getReturnType(const std::string& Name);
 };
 
 class IfExprAST : public ASTNode
@@ -125,12 +260,19 @@ public:
     IfExprAST(std::unique_ptr<ASTNode> Cond, std::vector<std::unique_ptr<ASTNode>> Then, std::vector<std::unique_ptr<ASTNode>> Else);
     //~IfExprAST();
     llvm::Value* codegen() override;
+    ValueType inferType() override;
+    void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+    std::unique_ptr<ASTNode> simplify() override;
+    bool evaluate(ConstantEnv& Env, Constant& Result) override;
+    void describe(std::string& Out, std::set<std::string>& Names) override;
+    uint32_t serialize(ASTWriter& W) override;
 };
 
 class ForExprAST : public ASTNode
 {
 private:
     std::string VarName;
+    TypeSlot VarType;
     std::unique_ptr<ASTNode> Start, End, Step;
     std::vector<std::unique_ptr<ASTNode>> Body;
 public:
@@ -138,6 +280,13 @@ public:
         std::unique_ptr<ASTNode> End, std::unique_ptr<ASTNode> Step, std::vector<std::unique_ptr<ASTNode>> Body);
 
     llvm::Value* codegen() override;
+    ValueType inferType() override;
+    void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+    void substitute(const std::string& Name, Constant Value) override;
+    bool assigns(const std::string& Name) override;
+    void describe(std::string& Out, std::set<std::string>& Names) override;
+    uint32_t serialize(ASTWriter& W) override;
+    void collectEffects(Effects& E) override;
 };
 
 class UnaryExprAst : public ASTNode
@@ -149,16 +298,93 @@ public:
     UnaryExprAst(char Opcode, std::unique_ptr<ASTNode> Operand);
 
     llvm::Value* codegen() override;
+    ValueType inferType() override;
+    void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+    std::unique_ptr<ASTNode> simplify() override;
+    bool evaluate(ConstantEnv& Env, Constant& Result) override;
+    void describe(std::string& Out, std::set<std::string>& Names) override;
+    uint32_t serialize(ASTWriter& W) override;
+    void collectEffects(Effects& E) override;
 };
 
 class VarAstNode : public ASTNode
 {
 private:
     std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames;
+    std::vector<TypeSlot> VarTypes;
     std::unique_ptr<ASTNode> Body;
 public:
-    VarAstNode(std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames, std::unique_ptr<ASTNode> Body);
+    VarAstNode(std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames, std::vector<TypeSlot> VarTypes, std::unique_ptr<ASTNode> Body);
+    llvm::Value* codegen() override;
+    ValueType inferType() override;
+    void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+    std::unique_ptr<ASTNode> simplify() override;
+    bool evaluate(ConstantEnv& Env, Constant& Result) override;
+    void substitute(const std::string& Name, Constant Value) override;
+    bool assigns(const std::string& Name) override;
+    void describe(std::string& Out, std::set<std::string>& Names) override;
+    uint32_t serialize(ASTWriter& W) override;
+};
+
+// region { ... }
+// Arrays allocated inside the block are freed when it is left.
+class RegionExprAST : public ASTNode
+{
+private:
+    std::vector<std::unique_ptr<ASTNode>> Body;
+public:
+    RegionExprAST(std::vector<std::unique_ptr<ASTNode>> Body);
+    llvm::Value* codegen() override;
+    ValueType inferType() override;
+    void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+    uint32_t serialize(ASTWriter& W) override;
+    void collectEffects(Effects& E) override;
+};
+
+// reduce(op, i = start, end) body
+// Folds body over the half-open range [start, end) with step 1. The counter
+// is an i64 if both bounds are integers, the accumulators have the type of
+// the body (f64 for parallel reductions and user operators). The builtin
+// operators (+, *, min, max) are reassociated freely: the loop keeps
+// VectorWidth independent partial accumulators and combines them in a tree,
+// so floating point results may differ from a strictly sequential fold.
+// Bodies that are large or contain reductions themselves are emitted once,
+// in a plain loop, so nested reductions don't grow exponentially.
+// User-defined binary operators must be associative and need an explicit
+// identity, e.g. reduce(| 0, i = 0, n) ...
+// With the parallel prefix the range is split across threads by the runtime
+// (__rdlg_parallel_reduce) and the partial results are combined pairwise.
+class ReduceExprAST : public ASTNode
+{
+private:
+    static constexpr unsigned VectorWidth = 4;
+    static constexpr unsigned MaxUnrolledBodyNodes = 64; // larger bodies aren't copied into the lanes
+    std::string Op;
+    std::unique_ptr<ASTNode> Identity;
+    std::string VarName;
+    TypeSlot VarType;
+    std::unique_ptr<ASTNode> Start, End;
+    std::unique_ptr<ASTNode> Body;
+    bool Parallel;
+
+    bool isUserOperator() const;
+    bool unrollsBody();
+    llvm::Value* identityValue();
+    llvm::Value* combine(llvm::Value* L, llvm::Value* R);
+    llvm::Value* emitSerial(llvm::Value* StartVal, llvm::Value* EndVal);
+    llvm::Value* emitParallel(llvm::Value* StartVal, llvm::Value* EndVal);
+    llvm::Function* emitCombineFunction();
+public:
+    ReduceExprAST(const std::string& Op, std::unique_ptr<ASTNode> Identity, const std::string& VarName,
+        std::unique_ptr<ASTNode> Start, std::unique_ptr<ASTNode> End, std::unique_ptr<ASTNode> Body, bool Parallel);
     llvm::Value* codegen() override;
+    ValueType inferType() override;
+    void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override;
+    void substitute(const std::string& Name, Constant Value) override;
+    bool assigns(const std::string& Name) override;
+    void describe(std::string& Out, std::set<std::string>& Names) override;
+    uint32_t serialize(ASTWriter& W) override;
+    void collectEffects(Effects& E) override;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef __COMPTIME_CPP__
+#define __COMPTIME_CPP__
+
+#include "ASTNodes.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Value of a comptime block or const definition.
+struct ComptimeValue {
+    ValueType type = ValueType::F64;
+    double value = 0;
+    std::vector<double> elements; // for f64[] values
+};
+
+// Evaluates expressions while compiling. The expressions are compiled into a
+// function of ASTNode::TheModule, which is then JIT compiled in process from a
+// copy of the module, together with everything it calls.
+class ComptimeEvaluator {
+    private:
+        static thread_local unsigned Counter;
+
+    public:
+        // --perf-jit: tell perf about the code the JIT loads, through a jitdump file
+        // and /tmp/perf-<pid>.map. false if LLVM was built without the jitdump writer.
+        static bool enablePerfSupport();
+        static bool PerfSupport; // set by enablePerfSupport
+        static bool evaluate(std::vector<std::unique_ptr<ASTNode>> Body, ComptimeValue& Result);
+        // const Name = ...: later code sees Name, the value is emitted as read-only data.
+        static bool define(const std::string& Name, const ComptimeValue& Value);
+        // comptime { ... }: a literal, or a reference to a private read-only array.
+        // The AST cache restores arrays under the name they had when the file was parsed.
+        static std::unique_ptr<ASTNode> embed(const ComptimeValue& Value, std::string Name = "");
+};
+
+#endif
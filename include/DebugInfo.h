@@ -0,0 +1,57 @@
+#ifndef __DEBUGINFO_CPP__
+#define __DEBUGINFO_CPP__
+
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "Types.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Where a node starts in its source file, counted from 1. 0 for nodes the
+// compiler made up, they take the location of the node around them.
+struct SourceLocation {
+    unsigned Line = 0;
+    unsigned Col = 0;
+};
+
+enum class DebugLevel {
+    None,
+    LineTablesOnly, // -gline-tables-only: functions and line numbers, what profilers need
+    Full, // -g: also the types of functions, parameters and variables
+};
+
+// DWARF for the file being compiled. Every function gets a DISubprogram and
+// every instruction the line and column of the node it was generated for.
+// The inliner adds the inlined-at chains itself, so samples in inlined code
+// still show both the callee's line and the call's, at any -O level.
+// Functions without a subprogram, like bodies imported from interfaces and
+// the combine functions of reductions, get no locations at all.
+class DebugInfo {
+    private:
+        static thread_local std::unique_ptr<llvm::DIBuilder> DBuilder;
+        static thread_local llvm::DICompileUnit* Unit;
+        static thread_local llvm::DIFile* File;
+        static llvm::DIType* type(ValueType Type);
+
+    public:
+        static DebugLevel Level; // set before any file is compiled
+        // Right after the module is created, a no-op at DebugLevel::None.
+        static void beginFile(llvm::Module& M, const std::string& Path, llvm::StringRef TargetTriple, bool Optimized);
+        static void endFile(); // resolves what is left, before the module passes run
+        static void reset(); // drops the builder with the rest of the file's state
+        static std::string fileName(); // absolute path of the file, "" without debug info
+        // Types holds the return type and then the parameter types, empty for helpers of the compiler.
+        static llvm::DISubprogram* beginFunction(llvm::Function& F, llvm::StringRef Name, SourceLocation Loc, const std::vector<ValueType>& Types);
+        static void endFunction(llvm::Function& F);
+        // Instructions built from here on belong to Loc, nothing if the function has no subprogram.
+        static void setLocation(llvm::IRBuilderBase& B, SourceLocation Loc);
+        // Only with -g, ArgNo counts parameters from 1 and is 0 for variables.
+        static void declareVariable(llvm::IRBuilderBase& B, llvm::AllocaInst* Alloca, llvm::StringRef Name, ValueType Type,
+            SourceLocation Loc, unsigned ArgNo = 0);
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __FUNCTIONCACHE_CPP__
+#define __FUNCTIONCACHE_CPP__
+
+#include "ASTNodes.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// On-disk cache of optimized functions, shared by all runs of the compiler.
+// An entry holds the bitcode of one function after the function passes, plus
+// the internal helpers and private data it uses. It is keyed by a hash of
+//   - the function's AST after constant folding
+//   - the signatures of everything it calls and the globals it reads
+//   - the compiler binary, the LLVM version, the target and the passes
+// so an entry is only reused when generating the function again would yield
+// the same IR. The directory is kept below a size limit by dropping the least
+// recently used entries.
+// One FunctionCache is shared by all files of a run, also across threads.
+class FunctionCache {
+    private:
+        std::string Directory;
+        std::string Configuration; // everything besides the function that goes into a key
+        uint64_t MaxSizeBytes;
+        std::atomic<unsigned> Hits{0}, Misses{0}, Stored{0};
+        std::atomic<uint64_t> BytesRead{0}, BytesWritten{0};
+
+        std::string key(FunctionASTNode& Fn);
+        std::string entryPath(const std::string& Key);
+        bool load(const std::string& Key, FunctionASTNode& Fn);
+        void store(const std::string& Key, llvm::Function* F);
+
+    public:
+        FunctionCache(std::string Directory, std::string Configuration, uint64_t MaxSizeBytes);
+        // Takes the function from the cache, or generates it and adds it to the cache.
+        llvm::Function* codegen(FunctionASTNode& Fn);
+        void prune();
+        void printStats(llvm::raw_ostream& OS);
+        // Compiler binary and LLVM version, for the configuration.
+        static std::string compilerVersion(const char* Argv0);
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __INTERFACE_CPP__
+#define __INTERFACE_CPP__
+
+#include "ASTNodes.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// A function or operator exported by an interface file.
+struct ImportedSymbol {
+    std::unique_ptr<PrototypeASTNode> Proto; // with the precedence of binary operators
+    std::unique_ptr<FunctionASTNode> Body; // small operator bodies only, nullptr otherwise
+};
+
+// Interface files (.rdlgi) let a file call the functions of another one,
+// compiled separately, through import "name" without parsing its source.
+// They hold the prototypes of all functions, the precedences of the binary
+// operators and the bodies of small operators, which are folded and inlined
+// into the importing file. Everything is little endian 32 bit words and
+// offsets from the start of the file, so the file is mapped and read in place:
+//     "RDLI", version
+//     symbol count, offset of the symbol table
+//     offset and size of the AST buffer (Serialize.h)
+//     symbol table: prototype and body offset of each symbol, relative to
+//         the AST buffer, 0 for no body
+//     AST buffer
+class InterfaceFile {
+    public:
+        static constexpr uint32_t Version = 6;
+        static constexpr unsigned InlineLimit = 32; // AST nodes of the biggest operator body that is exported
+        // Output with its extension replaced by .rdlgi
+        static std::string pathFor(const std::string& Output);
+        // Exports the functions of the file being compiled.
+        static bool write(const std::string& Path);
+        static bool read(const std::string& Path, std::vector<ImportedSymbol>& Symbols, std::string& Error);
+};
+
+#endif
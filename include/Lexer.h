@@ -30,21 +30,34 @@
 
 
 #include "Token.hpp"
+#include "Timing.h"
+#include <vector>
 
 class Lexer {
  public:
-  Lexer(const char* beg) noexcept : m_beg{beg} { linenumber = 1; col = 1;}
+  Lexer(const char* beg) noexcept : m_beg{beg}, m_lineStart{beg} { linenumber = 1; tokenLine = 1; col = 1;}
 
   Token next() noexcept;
 
   int getCurrentLineNumber();
   int getCol();
+  unsigned getTokenCount() const { return tokenCount; }
+  size_t getLexemeBytes() const { return lexemeBytes; }
+  size_t getBufferBytes() const { return tokens.capacity() * sizeof(Lexed); }
   // void incrementCurrentLineNumber();
   
   private:
+  // A token and the line the lexer was on after it, for getCurrentLineNumber.
+  struct Lexed {
+    Token token;
+    int line;
+  };
+  void lexBatch() noexcept;
+  Token token() noexcept;
   Token identifier() noexcept;
   Token number() noexcept;
   Token slash_or_comment() noexcept;
+  Token string() noexcept;
   Token or_is(Token::Kind first, Token::Kind second) noexcept;
   Token equal_or_doubleequal() noexcept;
   Token greater_or_greaterorequal() noexcept;
@@ -55,13 +68,20 @@ class Lexer {
   bool is_digit(char c) noexcept;
   bool is_identifier_char(char c) noexcept;
   int linenumber;
+  int tokenLine; // line and column of the last token
   int col;
+  unsigned tokenCount = 0;
+  size_t lexemeBytes = 0;
+  std::vector<Lexed> tokens; // the current batch
+  size_t nextToken = 0;
+  int lexLine = 1; // line lexing continues on, linenumber follows the tokens handed out
   char peek() const noexcept { return *m_beg; }
   char get() noexcept { return *m_beg++; }
   
   // static int currentLineNumber; //TODO: Fix this mess
 
   const char* m_beg = nullptr;
+  const char* m_lineStart = nullptr; // columns are counted from here
 };
 
 #endif
\ No newline at end of file
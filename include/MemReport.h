@@ -0,0 +1,32 @@
+#ifndef __MEMREPORT_CPP__
+#define __MEMREPORT_CPP__
+
+#include "ASTNodes.h"
+#include "Timing.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstddef>
+#include <string>
+
+// Where the compiler's memory goes, printed by --mem-report:
+//   - allocations with new, by the phase of Timing.h they were made in: count,
+//     bytes and the most bytes alive at once. The global operator new is
+//     replaced to count them, LLVM's own slab allocators use malloc and only
+//     show up in the RSS.
+//   - how much each phase raised the RSS high-water mark
+//   - the AST nodes by class as they were parsed, the tokens and their lexemes
+//   - per file, the entries of the symbol tables and the basic blocks and
+//     instructions of every function handed to the backend
+// With --mem-report=<file> the numbers are also written as JSON.
+class MemReport {
+    public:
+        static bool Enabled; // by start()
+        static void start(); // before any file is compiled
+        static void countAST(ASTNode& Node); // a top-level item right after parsing
+        static void countTokens(unsigned Tokens, size_t LexemeBytes, size_t BufferBytes); // BufferBytes: held by the lexer
+        static void countFile(const std::string& File); // the module of the current thread, before the backend
+        static void phaseEnded(Phase P); // called by TimeScope
+        static void print(llvm::raw_ostream& OS);
+        static bool writeJSON(const std::string& Path);
+};
+
+#endif
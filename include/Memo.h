@@ -0,0 +1,32 @@
+#ifndef __MEMO_CPP__
+#define __MEMO_CPP__
+
+#include "../runtime/rdlg_runtime.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include <cstdint>
+
+// memo(capacity=N, evict=replace|keep, shards=N) fn ...
+// Options of the memo table behind a memo function, see rdlg_memo in rdlg_runtime.h.
+struct MemoOptions {
+    uint64_t Capacity = 4096; // entries, rounded up to a power of two
+    uint32_t Policy = RDLG_MEMO_REPLACE;
+    uint32_t Shards = 0; // 0: one lock during parallel reduce, rounded up to a power of two otherwise
+};
+
+// The table of a function and the arguments of the current call as a key.
+struct MemoKey {
+    llvm::GlobalVariable* Memo;
+    llvm::Value* Key;
+};
+
+// Memo functions look their arguments up first and return the stored result
+// on a hit. The arguments and the result are stored as their bits, so they
+// have to be scalars. Emitted after the arguments are stored, continues in
+// the block of a miss.
+MemoKey emitMemoLookup(llvm::IRBuilder<>& B, llvm::Function& F, const MemoOptions& Options);
+// Stores the result of the body, right before it is returned.
+void emitMemoStore(llvm::IRBuilder<>& B, const MemoKey& Key, llvm::Value* Result);
+
+#endif
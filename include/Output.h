@@ -0,0 +1,22 @@
+#ifndef __OUTPUT_CPP__
+#define __OUTPUT_CPP__
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+// The buffered output functions of the runtime (rdlg_runtime.h) behind the
+// putc, putn, newline and flush builtins. They are declared as touching only
+// memory the program can't see, so calls to them don't keep LLVM from
+// optimizing the code around them.
+// Name is one of __rdlg_putc, __rdlg_write, __rdlg_puti, __rdlg_putf and __rdlg_flush.
+llvm::Function* declareOutputFunction(llvm::Module& M, llvm::StringRef Name);
+
+// Runs after the optimization passes, right before the module is written.
+// Runs of __rdlg_putc calls with constant characters in a block become one
+// __rdlg_write of a constant string, and the remaining __rdlg_putc calls
+// store into the thread's buffer inline, only calling the runtime when it is
+// full. The output functions and their callers then lose their memory
+// attributes. Returns the number of calls that were batched or inlined.
+unsigned lowerOutputCalls(llvm::Module& M);
+
+#endif
@@ -5,16 +5,29 @@
 #include "Lexer.h"
 #include <iostream>
 #include "ASTNodes.h"
+#include "ASTCache.h"
+#include "FunctionCache.h"
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
 
 class Parser
 {
+friend class ParserBenchmark; // bench/randlang_bench.cpp times the parser's parts on their own
 private:
     Token curTok;
     Token getNextToken();
     Lexer lex;
     std::map<char, int> BinopPrecedence;
     std::map<Token::Kind, int> BinopPrecedenceMultiChar;
+    unsigned NodesFolded = 0; // AST nodes removed by constant folding
+    FunctionCache* Cache; // optional, definitions are looked up here before generating them
+    std::string SourceDirectory; // imports are looked up here after the ImportPaths
+    std::set<std::string> Imported; // interface files already read
+    ParsedFile* Record = nullptr; // optional, the items are written here for the AST cache
 
     std::unique_ptr<ASTNode> logError(const char* str, int linenumber);
     std::unique_ptr<PrototypeASTNode> pLogError(const char* str, int linenumber);
@@ -26,24 +39,55 @@ private:
     std::unique_ptr<ASTNode> parseExpression();
     std::unique_ptr<ASTNode> parseBinOpRHS(int exprPrec, std::unique_ptr<ASTNode> LHS);
     std::unique_ptr<PrototypeASTNode> parsePrototype();
-    std::unique_ptr<FunctionASTNode> parseDefinition();
-    std::unique_ptr<PrototypeASTNode> parseExtern();
+    std::unique_ptr<FunctionASTNode> parseDefinition(bool Pure = false, const std::optional<MemoOptions>& Memo = std::nullopt);
+    std::unique_ptr<PrototypeASTNode> parseExtern(bool Pure = false);
     std::unique_ptr<FunctionASTNode> parseTopLevelExpr();
     std::unique_ptr<ASTNode> ParseIfExpr();
     std::unique_ptr<ASTNode> ParseForExpr();
     std::unique_ptr<ASTNode> parseUnary();
     std::unique_ptr<ASTNode> ParseVarExpr();
+    std::unique_ptr<ASTNode> ParseReduceExpr();
+    std::unique_ptr<ASTNode> ParseRegionExpr();
+    std::unique_ptr<ASTNode> ParseComptimeExpr();
+    std::unique_ptr<ASTNode> parseIndexExpr(std::unique_ptr<ASTNode> Base);
+    bool parseTypeAnnotation(ValueType& type, int64_t* fixedLength = nullptr);
+    bool parseAnnotation(std::optional<unsigned>& FastMath);
+    bool parseMemoOptions(MemoOptions& Options);
     //std::vector<std::unique_ptr<ASTNode>> parseBody();
     llvm::ExitOnError ExitOnErr;
     void InitializeModulesAndManagers();
-    void HandleDefinition();
-    void HandleExtern();
+    void HandleDefinition(bool Pure = false, const std::optional<MemoOptions>& Memo = std::nullopt);
+    void HandleExtern(bool Pure = false);
     void HandleTopLevelExpression();
+    void HandleConst();
+    void HandleImport();
+    // What is done with a top-level item after parsing it, also when it comes from the AST cache
+    void defineFunction(std::unique_ptr<FunctionASTNode> FnAST);
+    void declareExtern(std::unique_ptr<PrototypeASTNode> FnAST);
+    void defineTopLevel(std::unique_ptr<FunctionASTNode> FnAST);
+    bool defineConst(const std::string& Name, const ComptimeValue& Value);
+    std::string importInterface(const std::string& Name);
+    std::string findInterface(const std::string& Name);
+    void reportFolding(); // at the end of the file
 
     int getTokenPrecedence();
+    SourceLocation location() const { return {curTok.line(), curTok.col()}; } // of the current token
+    // Returns Node after setting its location, the token it was parsed from.
+    template <typename T>
+    static std::unique_ptr<T> at(SourceLocation Loc, std::unique_ptr<T> Node) {
+        Node->Loc = Loc;
+        return Node;
+    }
 public:
-    Parser(const char* beg);
+    Parser(const char* beg, FunctionCache* Cache = nullptr, std::string SourceDirectory = "");
+    static std::mutex OutputLock; // files compiled in parallel print their IR one function at a time
+    static unsigned OptLevel; // -O0 to -O3, set before any file is compiled
+    static bool PrintIR; // --print-ir: print the IR of every function as it is generated
+    static const char* functionPasses(); // the function pass pipeline at OptLevel, part of the function cache key
+    static std::vector<std::string> ImportPaths; // -I directories, searched for interface files
     void parse();
+    void record(ParsedFile* File) { Record = File; }
+    bool replay(std::vector<CachedItem>& Items); // false if the items are out of date
     ~Parser();
 };
 
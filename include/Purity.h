@@ -0,0 +1,37 @@
+#ifndef __PURITY_CPP__
+#define __PURITY_CPP__
+
+#include "Types.h"
+#include "llvm/IR/Function.h"
+#include <string>
+
+// Purity analysis (Purity.cpp). Functions are generated callees first, so the
+// effects of a body follow from its own nodes and the attributes of the
+// functions it calls, which the analysis set on them before. The result goes
+// onto the llvm::Function as attributes:
+//     no effects         memory(none)
+//     only EffectReads   memory(read)
+//     no EffectMayUnwind nounwind
+//     no EffectMayNotReturn willreturn
+// so LLVM can CSE calls and hoist them out of loops, also in other files that
+// import the function.
+struct Effects {
+    unsigned Flags = 0; // EffectFlag bits
+    std::string Reason; // what first made the function impure, reported for pure functions
+    std::string Self; // calls to the function itself are recursion
+
+    void add(unsigned More, const std::string& Why);
+    void call(const std::string& Callee); // adds the effects of a call to a function
+};
+
+// EffectWrites and EffectOther rule out a pure function, reads of its array parameters are allowed.
+constexpr unsigned ImpureEffects = EffectWrites | EffectOther;
+
+unsigned effectsOf(const llvm::Function& F);
+void applyEffects(llvm::Function& F, unsigned Flags);
+// Memo functions have the effects of their body, but also write their table
+// through the runtime: memory(inaccessiblemem: readwrite, argmem: read), plus
+// read if the body reads arrays. Calls to them count as EffectOther.
+void applyMemoEffects(llvm::Function& F, unsigned Flags);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __REMARKS_CPP__
+#define __REMARKS_CPP__
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include <memory>
+#include <string>
+
+// Optimization remarks of LLVM's passes, for finding out why a loop wasn't
+// vectorized or a call wasn't inlined.
+//   -Rpass=<regex>          print what the passes matching <regex> did
+//   -Rpass-missed=<regex>   print what they tried and couldn't do
+//   -Rpass-analysis=<regex> print why, as far as they tell
+//   --opt-record[=<file>]   write every remark to a YAML file, <output>.opt.yaml by default
+// The regular expressions match pass names like inline, loop-vectorize, licm
+// and gvn. Remarks name the rdlg function they are about, and the line once
+// the module has debug info. Functions taken from the function cache weren't
+// optimized in this run and have no remarks.
+struct RemarkOptions {
+    std::string Passed, Missed, Analysis; // off if empty
+    bool Record = false;
+    std::string RecordFile; // <output>.opt.yaml if empty
+
+    bool printing() const { return !Passed.empty() || !Missed.empty() || !Analysis.empty(); }
+};
+
+bool isValidRemarkFilter(const std::string& Regex, std::string& Error);
+
+// The remarks of one file. Set up right after the file's context is created,
+// so the function passes run while parsing report too, and kept until the
+// output is written.
+class FileRemarks {
+    private:
+        llvm::LLVMContext* Context = nullptr;
+        std::unique_ptr<llvm::ToolOutputFile> Record;
+
+    public:
+        FileRemarks() = default;
+        FileRemarks(const FileRemarks&) = delete;
+        FileRemarks& operator=(const FileRemarks&) = delete;
+        ~FileRemarks(); // completes the record
+        bool begin(llvm::LLVMContext& Ctx, const RemarkOptions& Options, const std::string& Source, const std::string& Output);
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef __SERIALIZE_CPP__
+#define __SERIALIZE_CPP__
+
+#include "ASTNodes.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary form of the AST, written by the serialize methods of the nodes
+// (Serialize.cpp). It is position independent: nodes are written children
+// first and refer to their children by offset from the start of the buffer,
+// so a buffer can be mapped from a file and walked in place. Every node is
+// a header word, its child offsets and then its payload, all little endian
+// 32 bit words:
+//     kind (8 bits) | child count (24 bits)
+//     payload word count
+//     source line and column, 0 if unknown
+//     child offsets, 0 for a missing optional child
+//     payload: numbers, types, names as length + bytes padded to a word
+// Offset 0 holds no node, so it can mark missing children.
+enum class NodeKind : uint8_t {
+    None,
+    Number,
+    Variable,
+    Binary,
+    Index,
+    Call,
+    Prototype,
+    Function,
+    If,
+    For,
+    Unary,
+    Var,
+    Region,
+    Reduce,
+    // Not expressions, the top-level items of an AST cache entry (ASTCache.h)
+    Value,
+    Import,
+};
+
+class ASTWriter {
+    private:
+        std::string Buffer;
+        size_t Start = 0; // of the node being written
+        bool Failed = false;
+
+    public:
+        ASTWriter();
+        // A node that can't be written (e.g. a comptime result) marks the whole buffer as failed.
+        void fail() { Failed = true; }
+        bool failed() const { return Failed; }
+        void begin(NodeKind Kind, const std::vector<uint32_t>& Children, SourceLocation Loc = {});
+        void word(uint32_t Value);
+        void word64(uint64_t Value); // two words, low first
+        void number(double Value);
+        void type(ValueType Type);
+        void slot(const TypeSlot& Slot);
+        void name(const std::string& Name);
+        uint32_t end(); // returns the offset of the node
+        const std::string& buffer() const { return Buffer; }
+};
+
+// Reads nodes from a buffer written by ASTWriter. Only the nodes that are
+// asked for are turned back into AST nodes, and every offset is checked
+// against the buffer, so a damaged file yields nullptr instead of a crash.
+class ASTReader {
+    private:
+        llvm::StringRef Data;
+        uint32_t wordAt(uint32_t Offset) const;
+
+    public:
+        // A view of one node in the buffer.
+        struct Node {
+            NodeKind Kind = NodeKind::None;
+            uint32_t Offset = 0;
+            std::vector<uint32_t> Children;
+            SourceLocation Loc;
+            uint32_t Payload = 0, PayloadEnd = 0; // byte range of the payload
+        };
+        // Reads the payload of a node front to back.
+        class Cursor {
+            private:
+                const ASTReader& R;
+                uint32_t Pos, End;
+                bool Ok = true;
+
+            public:
+                Cursor(const ASTReader& R, const Node& N) : R(R), Pos(N.Payload), End(N.PayloadEnd) {}
+                uint32_t word();
+                uint64_t word64();
+                double number();
+                ValueType type();
+                TypeSlot slot();
+                std::string name();
+                bool ok() const { return Ok; }
+        };
+
+        ASTReader(llvm::StringRef Data) : Data(Data) {}
+        bool node(uint32_t Offset, Node& N) const;
+        std::unique_ptr<ASTNode> read(uint32_t Offset) const;
+        std::unique_ptr<PrototypeASTNode> readPrototype(uint32_t Offset) const;
+        std::unique_ptr<FunctionASTNode> readFunction(uint32_t Offset) const;
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __SERVER_CPP__
+#define __SERVER_CPP__
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Compile server. `randlang --server` stays resident on a Unix domain socket
+// with the targets already initialized, and `randlang --connect` (or any
+// randlang started with RANDLANG_SERVER set) hands its command line to it
+// instead of compiling itself.
+// Every request is compiled in a forked copy of the server: requests run
+// concurrently, start from the warm state and can't affect each other or the
+// server. The client's working directory, stdout and stderr are passed along,
+// so output, written files and exit status are the same as without a server.
+using CompileFunction = std::function<int(const std::vector<std::string>& Args)>;
+
+std::string defaultSocketPath();
+int runServer(const std::string& SocketPath, const CompileFunction& Compile);
+// Returns false if no server is listening at SocketPath.
+bool runClient(const std::string& SocketPath, const std::vector<std::string>& Args, int& ExitCode);
+
+#endif
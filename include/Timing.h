@@ -0,0 +1,49 @@
+#ifndef __TIMING_CPP__
+#define __TIMING_CPP__
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+
+// Where the compile time goes.
+//   --time-trace=<file>  Chrome trace event JSON (chrome://tracing, Perfetto)
+//                        of nested spans on every thread, recorded with
+//                        llvm::TimeTraceProfiler. LLVM adds spans for each of
+//                        its passes and for the code generation of each function.
+//   --time-report        the time of each phase summed over all threads, and
+//                        the functions that took longest to generate.
+// A TimeScope is one span of the trace and counts towards the report. The
+// report uses exclusive times, the batches of tokens lexed while parsing only
+// count as lexing. The innermost scope is also the phase --mem-report
+// (MemReport.h) charges allocations to. With all of them off a TimeScope
+// costs three flag checks.
+enum class Phase { Load, Lex, Parse, Fold, Comptime, Codegen, Optimize, Backend, Count };
+const char* phaseName(Phase P);
+
+class TimeScope {
+    private:
+        Phase P;
+        llvm::StringRef Detail; // must outlive the scope
+        bool Tracing;
+        bool Reporting;
+        TimeScope* Parent = nullptr;
+        std::chrono::steady_clock::time_point Start;
+        std::chrono::steady_clock::duration Nested{0}; // spent in scopes inside this one
+
+    public:
+        TimeScope(Phase P, llvm::StringRef Detail = "");
+        ~TimeScope();
+        TimeScope(const TimeScope&) = delete;
+        TimeScope& operator=(const TimeScope&) = delete;
+        // Phase of the innermost scope on this thread, Phase::Count outside of all.
+        static Phase current();
+};
+
+class TimeReport {
+    public:
+        static bool Enabled; // set before any file is compiled
+        // Wall is the time of the whole run, for comparison with the summed phases.
+        static void print(llvm::raw_ostream& OS, std::chrono::steady_clock::duration Wall);
+};
+
+#endif
@@ -63,11 +63,13 @@ class Token {
     Semicolon,
     SingleQuote,
     DoubleQuote,
+    String, // "...", the lexeme is what is between the quotes
     Comment,
     Pipe,
     Tilda,
     Exclamation,
     NotEqual,
+    At, // @, starts an annotation
     End,
     Unexpected,
   };
@@ -86,32 +88,23 @@ class Token {
     Unary,
     Binary,
     Var,
+    Reduce,
+    Parallel,
+    Region,
+    Const,
+    Comptime,
+    Import,
+    Pure,
+    Memo,
   };
 
   Token(Kind kind) noexcept : m_kind{kind}, m_type(KeywordType::None) {}
 
   Token(Kind kind, const char* beg, std::size_t len) noexcept
-      : m_kind{kind}, m_lexeme(beg, len) {
-        constructKeywordMap();
-        if (kind == Kind::Keyword)
-        {
-          m_type = keywordTypeMap[m_lexeme];
-        } else {
-          m_type = keywordTypeMap["None"];
-        }
-        
-      }
+      : m_kind{kind}, m_type{keywordType(kind, std::string_view(beg, len))}, m_lexeme(beg, len) {}
 
   Token(Kind kind, const char* beg, const char* end) noexcept
-      : m_kind{kind}, m_lexeme(beg, std::distance(beg, end)) {
-        constructKeywordMap();
-        if (kind == Kind::Keyword)
-        {
-          m_type = keywordTypeMap[m_lexeme];
-        } else {
-          m_type = keywordTypeMap["None"];
-        }
-      }
+      : Token(kind, beg, std::distance(beg, end)) {}
 
   Kind kind() const noexcept { return m_kind; }
 
@@ -136,6 +129,14 @@ class Token {
 
   std::string_view lexeme() const noexcept { return m_lexeme; }
 
+  // Where the token starts, both counted from 1. Set by the lexer.
+  unsigned line() const noexcept { return m_line; }
+  unsigned col() const noexcept { return m_col; }
+  void location(unsigned line, unsigned col) noexcept {
+    m_line = line;
+    m_col = col;
+  }
+
   void lexeme(std::string_view lexeme) noexcept {
     m_lexeme = std::move(lexeme);
   }
@@ -156,23 +157,27 @@ class Token {
  private:
   Kind             m_kind{};
   KeywordType m_type{};
-  std::map<std::string_view, KeywordType> keywordTypeMap;
   std::string_view m_lexeme{};
-
-  void constructKeywordMap() {
-    keywordTypeMap["None"] = KeywordType::None;
-    keywordTypeMap["for"] = KeywordType::For;
-    keywordTypeMap["while"] = KeywordType::While;
-    keywordTypeMap["if"] = KeywordType::If;
-    keywordTypeMap["then"] = KeywordType::Then;
-    keywordTypeMap["else"] = KeywordType::Else;
-    keywordTypeMap["return"] = KeywordType::Return;
-    keywordTypeMap["extern"] = KeywordType::Extern;
-    keywordTypeMap["fn "] = KeywordType::Fn;
-    keywordTypeMap["in"] = KeywordType::In;
-    keywordTypeMap["unary"] = KeywordType::Unary;
-    keywordTypeMap["binary"] = KeywordType::Binary;
-    keywordTypeMap["var"] = KeywordType::Var;
+  unsigned m_line = 0;
+  unsigned m_col = 0;
+
+  // One table for all tokens, a Token is only its fields.
+  static KeywordType keywordType(Kind kind, std::string_view lexeme) noexcept {
+    static const std::map<std::string_view, KeywordType> keywordTypeMap{
+        {"for", KeywordType::For},           {"while", KeywordType::While},
+        {"if", KeywordType::If},             {"then", KeywordType::Then},
+        {"else", KeywordType::Else},         {"return", KeywordType::Return},
+        {"extern", KeywordType::Extern},     {"fn ", KeywordType::Fn},
+        {"in", KeywordType::In},             {"unary", KeywordType::Unary},
+        {"binary", KeywordType::Binary},     {"var", KeywordType::Var},
+        {"reduce", KeywordType::Reduce},     {"parallel", KeywordType::Parallel},
+        {"region", KeywordType::Region},     {"const", KeywordType::Const},
+        {"comptime", KeywordType::Comptime}, {"import", KeywordType::Import},
+        {"pure", KeywordType::Pure},         {"memo", KeywordType::Memo},
+    };
+    if (kind != Kind::Keyword) return KeywordType::None;
+    auto it = keywordTypeMap.find(lexeme);
+    return it == keywordTypeMap.end() ? KeywordType::None : it->second;
   }
 };
 
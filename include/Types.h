@@ -0,0 +1,93 @@
+#ifndef __TYPES_CPP__
+#define __TYPES_CPP__
+
+#include "llvm/IR/FMF.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Type.h"
+#include <string_view>
+
+// Element kinds, ordered: joining two kinds yields the larger one.
+enum class ScalarType {
+    Bool,
+    I64,
+    F32,
+    F64,
+};
+
+// Value types of the language. Prototypes default to f64, the types of local
+// variables and expressions are found by FunctionASTNode::inferTypes.
+// Vectors (vec2, vec4, vec8) hold f32 or f64 elements and lower to LLVM
+// vector types. Parameters and return values are limited to
+// MaxParameterVectorBits: the target CPU is generic (x86-64 without AVX),
+// where those match __attribute__((vector_size(16))) in C and C++, while C
+// passes wider vectors in memory and LLVM splits them across registers.
+// Arrays (f64[]) are passed around as { double* data, i64 length } and point
+// into memory owned by a region of the runtime library.
+struct ValueType {
+    ScalarType scalar;
+    unsigned lanes; // 0 for scalars, otherwise the number of vector elements
+    bool array = false;
+
+    static const ValueType Bool;
+    static const ValueType I64;
+    static const ValueType F32;
+    static const ValueType F64;
+    static const ValueType Array;
+
+    bool isVector() const { return lanes != 0; }
+    bool isArray() const { return array; }
+    bool isFloat() const { return scalar == ScalarType::F32 || scalar == ScalarType::F64; }
+    unsigned vectorBits() const { return lanes * (scalar == ScalarType::F32 ? 32 : 64); }
+    static constexpr unsigned MaxParameterVectorBits = 128;
+    ValueType element() const { return ValueType{scalar, 0}; }
+};
+
+inline constexpr ValueType ValueType::Bool{ScalarType::Bool, 0};
+inline constexpr ValueType ValueType::I64{ScalarType::I64, 0};
+inline constexpr ValueType ValueType::F32{ScalarType::F32, 0};
+inline constexpr ValueType ValueType::F64{ScalarType::F64, 0};
+inline constexpr ValueType ValueType::Array{ScalarType::F64, 0, true};
+
+inline bool operator==(ValueType a, ValueType b) { return a.scalar == b.scalar && a.lanes == b.lanes && a.array == b.array; }
+inline bool operator!=(ValueType a, ValueType b) { return !(a == b); }
+
+// Type of a variable binding. Annotated bindings keep their type, all others
+// start at Bool and are widened until every value assigned to them fits.
+struct TypeSlot {
+    ValueType type = ValueType::Bool;
+    bool annotated = false;
+};
+
+ValueType joinTypes(ValueType a, ValueType b); // scalars are broadcast when joined with a vector
+ValueType arithmeticType(ValueType a, ValueType b); // like joinTypes, but bool operands are promoted to i64
+ValueType fromLLVMType(llvm::Type* type);
+llvm::Type* toLLVMType(ValueType type, llvm::LLVMContext& context);
+bool parseTypeName(std::string_view name, ValueType& type); // vecN names yield f64 elements
+
+// Fast-math flags as a bit set, the form they take in the binary AST and in
+// function cache keys.
+enum FastMathFlag : unsigned {
+    FMReassoc = 1,
+    FMContract = 2,
+    FMNoNaNs = 4,
+    FMNoInfs = 8,
+    FMNoSignedZeros = 16,
+    FMAllowReciprocal = 32,
+    FMApproxFunc = 64,
+    FMAll = 127,
+};
+bool parseFastMathFlag(std::string_view name, unsigned& flag); // LLVM's names: reassoc, contract, nnan, ninf, nsz, arcp, afn
+llvm::FastMathFlags toFastMathFlags(unsigned flags);
+
+// Side effects of a function as a bit set, found by the purity analysis
+// (Purity.h) and stored with prototypes.
+enum EffectFlag : unsigned {
+    EffectReads = 1, // reads array elements
+    EffectWrites = 2, // writes array elements
+    EffectOther = 4, // output, allocation, calls to externs not declared pure
+    EffectMayUnwind = 8,
+    EffectMayNotReturn = 16, // loops that aren't bounded, recursion
+    EffectAll = 31,
+};
+
+#endif
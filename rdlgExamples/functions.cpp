@@ -1,4 +1,4 @@
-#include <iostream>
+#include "../runtime/rdlg_runtime.h"
 
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
@@ -6,12 +6,13 @@
 #define DLLEXPORT
 #endif
 
+// Both go through the runtime's output buffer, link with librdlgrt.a.
 extern "C" DLLEXPORT double println() {
-    std::cout << "Hello World" << std::endl;
+    __rdlg_write("Hello World\n", 12);
     return 0.0;
 }
 
 extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
+  __rdlg_putc((char)X);
   return 0;
-}
\ No newline at end of file
+}
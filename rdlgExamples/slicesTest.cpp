@@ -0,0 +1,33 @@
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../runtime/rdlg_runtime.h"
+
+extern "C" {
+    int64_t slicelen(rdlg_array, int64_t, int64_t);
+}
+
+// Runs the slice in a child, out of bounds it has to die of the trap.
+static bool traps(int64_t lo, int64_t hi) {
+    double data[8] = {};
+    pid_t child = fork();
+    if (child == 0)
+    {
+        slicelen({data, 8}, lo, hi);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    return WIFSIGNALED(status);
+}
+
+int main() {
+    double data[8] = {};
+    bool ok = slicelen({data, 8}, 2, 6) == 4 && slicelen({data, 8}, 8, 8) == 0 && !traps(0, 8);
+    ok = ok && traps(6, 2) && traps(4, 9) && traps(-1, 4);
+    std::cout << (ok ? "slice checks passed" : "slice checks FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
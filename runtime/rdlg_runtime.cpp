@@ -0,0 +1,407 @@
+// Runtime support library for code emitted by randlang. Link the generated
+// object files against librdlgrt.a.
+#include "rdlg_runtime.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using ReduceChunkFn = double (*)(void* env, double lo, double hi);
+using ReduceCombineFn = double (*)(double, double);
+
+// Ranges shorter than this are not worth starting threads for.
+constexpr double kMinIterationsPerThread = 4096;
+
+// Number of parallel reductions with worker threads running, see memoShard.
+std::atomic<unsigned> parallelReductions{0};
+
+unsigned workerCount() {
+  if (const char* env = std::getenv("RDLG_NUM_THREADS")) {
+    int n = std::atoi(env);
+    if (n > 0) return n;
+  }
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+// Region allocator: a per-thread bump allocator over a list of chunks.
+// Leaving a region only resets the bump pointer, chunks are kept for reuse.
+constexpr std::size_t kArrayAlignment = 64;
+constexpr std::size_t kChunkSize = 1 << 20;
+
+struct Chunk {
+  Chunk* next;
+  std::size_t size;
+  char* begin() { return reinterpret_cast<char*>(this) + kArrayAlignment; }
+  char* end() { return begin() + size; }
+};
+
+struct RegionMark {
+  Chunk* chunk;
+  char* cur;
+};
+
+class Arena {
+ public:
+  ~Arena() {
+    for (Chunk* c = first_; c;) {
+      Chunk* next = c->next;
+      std::free(c);
+      c = next;
+    }
+  }
+
+  void* allocate(std::size_t bytes) {
+    bytes = (bytes + kArrayAlignment - 1) & ~(kArrayAlignment - 1);
+    if (!chunk_ || static_cast<std::size_t>(chunk_->end() - cur_) < bytes) {
+      grow(bytes);
+    }
+    void* p = cur_;
+    cur_ += bytes;
+    return p;
+  }
+
+  RegionMark mark() const { return RegionMark{chunk_, cur_}; }
+
+  void reset(const RegionMark& m) {
+    chunk_ = m.chunk;
+    cur_ = m.cur;
+  }
+
+ private:
+  // Moves to the next chunk that fits, reusing chunks left behind by earlier
+  // regions, or links a new one in after the current chunk.
+  void grow(std::size_t bytes) {
+    Chunk* next = chunk_ ? chunk_->next : first_;
+    if (!next || next->size < bytes) {
+      std::size_t size = std::max(bytes, kChunkSize);
+      auto* fresh = static_cast<Chunk*>(std::aligned_alloc(kArrayAlignment, kArrayAlignment + size));
+      if (!fresh) std::abort();
+      fresh->size = size;
+      fresh->next = next;
+      if (chunk_) {
+        chunk_->next = fresh;
+      } else {
+        first_ = fresh;
+      }
+      next = fresh;
+    }
+    chunk_ = next;
+    cur_ = next->begin();
+  }
+
+  Chunk* first_ = nullptr;
+  Chunk* chunk_ = nullptr;
+  char* cur_ = nullptr;
+};
+
+thread_local Arena arena;
+
+// Buffered output. The buffer is allocated on the first write of a thread,
+// threads that never print don't pay for it.
+constexpr std::size_t kOutputBufferSize = 1 << 16;
+
+// Buffers of different threads are written out whole, never interleaved.
+std::mutex outputLock;
+
+void writeOut(const char* data, std::size_t length) {
+  std::lock_guard<std::mutex> lock(outputLock);
+  while (length > 0) {
+    ssize_t written = ::write(STDOUT_FILENO, data, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += written;
+    length -= static_cast<std::size_t>(written);
+  }
+}
+
+struct ThreadOutput {
+  std::unique_ptr<char[]> data;
+
+  // Runs when the thread ends, and for the main thread at exit.
+  ~ThreadOutput() {
+    __rdlg_flush();
+    __rdlg_out = rdlg_output{nullptr, nullptr};
+  }
+
+  void ensure() {
+    if (!data) {
+      data.reset(new char[kOutputBufferSize]);
+      __rdlg_out = rdlg_output{data.get(), data.get() + kOutputBufferSize};
+    }
+  }
+};
+
+thread_local ThreadOutput threadOutput;
+
+// Memo tables. An entry is the arity key words, the result and a word that is
+// set once the entry is used. Nothing is ever removed, so a probe can stop at
+// the first unused slot.
+constexpr uint64_t kMemoProbes = 8;
+
+struct MemoShard {
+  std::mutex lock;
+  std::unique_ptr<uint64_t[]> slots;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t entries = 0;
+};
+
+// Keeps what the statistics need of the rdlg_memo, which may be gone by the
+// time they are read.
+struct MemoTable {
+  std::string name;
+  uint64_t mask;  // entries per shard - 1
+  uint32_t stride;
+  uint32_t shardCount;
+  std::unique_ptr<MemoShard[]> shards;
+};
+
+// Guards the creation of tables and memoTables.
+std::mutex memoLock;
+std::vector<MemoTable*> memoTables;
+
+struct MemoReport {
+  ~MemoReport() {
+    const char* env = std::getenv("RDLG_MEMO_STATS");
+    if (!env || std::atoi(env) == 0) return;
+    rdlg_memo_stats stats[64];
+    int64_t count = rdlg_memo_stats_get(stats, 64);
+    for (int64_t i = 0; i < std::min<int64_t>(count, 64); ++i) {
+      std::fprintf(stderr, "memo %s: %llu hits, %llu misses, %llu evictions, %llu of %llu entries\n", stats[i].name,
+                   (unsigned long long)stats[i].hits, (unsigned long long)stats[i].misses,
+                   (unsigned long long)stats[i].evictions, (unsigned long long)stats[i].entries,
+                   (unsigned long long)stats[i].capacity);
+    }
+  }
+} memoReport;
+
+uint64_t memoHash(const uint64_t* key, uint32_t arity) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ arity;
+  for (uint32_t i = 0; i < arity; ++i) {
+    h = (h ^ key[i]) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+MemoTable* memoTable(rdlg_memo* memo) {
+  auto* table = static_cast<MemoTable*>(__atomic_load_n(&memo->table, __ATOMIC_ACQUIRE));
+  if (table) return table;
+  std::lock_guard<std::mutex> lock(memoLock);
+  table = static_cast<MemoTable*>(memo->table);
+  if (table) return table;
+
+  table = new MemoTable;
+  table->name = memo->name;
+  table->shardCount = memo->shards ? memo->shards : 1;
+  uint64_t perShard = std::max(memo->capacity / table->shardCount, kMemoProbes);
+  table->mask = perShard - 1;
+  table->stride = memo->arity + 2;
+  table->shards.reset(new MemoShard[table->shardCount]);
+  for (uint32_t i = 0; i < table->shardCount; ++i) {
+    table->shards[i].slots.reset(new uint64_t[perShard * table->stride]());
+  }
+  memoTables.push_back(table);
+  __atomic_store_n(&memo->table, table, __ATOMIC_RELEASE);
+  return table;
+}
+
+// The shard of a key, locked if the table is shared between threads. Tables
+// without shards are locked as a whole while worker threads of a parallel
+// reduction may call into them. The count is raised before the workers start
+// and lowered after they are joined, so it can't drop to 0 under them.
+MemoShard& memoShard(rdlg_memo* memo, MemoTable* table, uint64_t hash, std::unique_lock<std::mutex>& lock) {
+  MemoShard& shard = table->shards[(hash >> 48) & (table->shardCount - 1)];
+  if (memo->shards || parallelReductions.load(std::memory_order_relaxed)) lock = std::unique_lock<std::mutex>(shard.lock);
+  return shard;
+}
+
+}  // namespace
+
+// C linkage from the declaration in rdlg_runtime.h
+thread_local rdlg_output __rdlg_out = {nullptr, nullptr};
+
+extern "C" void __rdlg_flush(void) {
+  if (threadOutput.data && __rdlg_out.cur != threadOutput.data.get()) {
+    writeOut(threadOutput.data.get(), __rdlg_out.cur - threadOutput.data.get());
+    __rdlg_out.cur = threadOutput.data.get();
+  }
+}
+
+extern "C" void __rdlg_putc(int32_t c) {
+  threadOutput.ensure();
+  if (__rdlg_out.cur == __rdlg_out.end) __rdlg_flush();
+  *__rdlg_out.cur++ = static_cast<char>(c);
+}
+
+extern "C" void __rdlg_write(const char* data, int64_t length) {
+  if (length <= 0) return;
+  threadOutput.ensure();
+  std::size_t n = static_cast<std::size_t>(length);
+  if (n > static_cast<std::size_t>(__rdlg_out.end - __rdlg_out.cur)) {
+    __rdlg_flush();
+    if (n >= kOutputBufferSize) {
+      writeOut(data, n);
+      return;
+    }
+  }
+  std::memcpy(__rdlg_out.cur, data, n);
+  __rdlg_out.cur += n;
+}
+
+extern "C" void __rdlg_puti(int64_t value) {
+  char text[24];
+  auto result = std::to_chars(text, text + sizeof(text), value);
+  __rdlg_write(text, result.ptr - text);
+}
+
+extern "C" void __rdlg_putf(double value) {
+  char text[32];
+  auto result = std::to_chars(text, text + sizeof(text), value);
+  __rdlg_write(text, result.ptr - text);
+}
+
+// The mark is stored in the arena itself, so entering a region never calls
+// malloc once the first chunk exists.
+extern "C" void* __rdlg_region_enter(void) {
+  RegionMark m = arena.mark();
+  auto* saved = static_cast<RegionMark*>(arena.allocate(sizeof(RegionMark)));
+  *saved = m;
+  return saved;
+}
+
+extern "C" void __rdlg_region_leave(void* mark) {
+  arena.reset(*static_cast<RegionMark*>(mark));
+}
+
+extern "C" double* __rdlg_region_alloc(int64_t count) {
+  std::size_t bytes = count > 0 ? static_cast<std::size_t>(count) * sizeof(double) : 0;
+  void* p = arena.allocate(bytes);
+  std::memset(p, 0, bytes);
+  return static_cast<double*>(p);
+}
+
+// Splits [lo, hi) into one contiguous chunk per worker, runs chunk() on each
+// and combines the partial results pairwise in a fixed tree order, so the
+// result only depends on the number of workers, not on thread scheduling.
+extern "C" double __rdlg_parallel_reduce(ReduceChunkFn chunk, void* env,
+                                         double lo, double hi, double identity,
+                                         ReduceCombineFn combine) {
+  double iterations = std::ceil(hi - lo);
+  if (!(iterations > 0)) return identity;
+
+  unsigned workers = std::min<double>(
+      workerCount(), std::max(1.0, std::floor(iterations / kMinIterationsPerThread)));
+  if (workers <= 1) return chunk(env, lo, hi);
+
+  auto bound = [&](unsigned t) {
+    return t == workers ? hi : lo + std::floor(iterations * t / workers);
+  };
+
+  std::vector<double> partials(workers, identity);
+  std::vector<std::thread> threads;
+  threads.reserve(workers - 1);
+  parallelReductions.fetch_add(1, std::memory_order_relaxed);
+  for (unsigned t = 1; t < workers; ++t) {
+    threads.emplace_back([&, t] { partials[t] = chunk(env, bound(t), bound(t + 1)); });
+  }
+  partials[0] = chunk(env, bound(0), bound(1));
+  for (auto& thread : threads) thread.join();
+  parallelReductions.fetch_sub(1, std::memory_order_relaxed);
+
+  for (unsigned stride = 1; stride < workers; stride *= 2) {
+    for (unsigned i = 0; i + stride < workers; i += 2 * stride) {
+      partials[i] = combine(partials[i], partials[i + stride]);
+    }
+  }
+  return partials[0];
+}
+
+extern "C" int32_t __rdlg_memo_lookup(rdlg_memo* memo, const uint64_t* key, uint64_t* result) {
+  MemoTable* table = memoTable(memo);
+  uint64_t hash = memoHash(key, memo->arity);
+  std::unique_lock<std::mutex> lock;
+  MemoShard& shard = memoShard(memo, table, hash, lock);
+  for (uint64_t p = 0; p < kMemoProbes; ++p) {
+    uint64_t* entry = &shard.slots[((hash + p) & table->mask) * table->stride];
+    if (!entry[memo->arity + 1]) break;
+    if (std::memcmp(entry, key, memo->arity * sizeof(uint64_t)) == 0) {
+      ++shard.hits;
+      *result = entry[memo->arity];
+      return 1;
+    }
+  }
+  ++shard.misses;
+  return 0;
+}
+
+extern "C" void __rdlg_memo_store(rdlg_memo* memo, const uint64_t* key, uint64_t result) {
+  MemoTable* table = memoTable(memo);
+  uint64_t hash = memoHash(key, memo->arity);
+  std::unique_lock<std::mutex> lock;
+  MemoShard& shard = memoShard(memo, table, hash, lock);
+  uint64_t* entry = nullptr;
+  for (uint64_t p = 0; p < kMemoProbes && !entry; ++p) {
+    uint64_t* slot = &shard.slots[((hash + p) & table->mask) * table->stride];
+    if (!slot[memo->arity + 1]) {
+      ++shard.entries;
+      entry = slot;
+    } else if (std::memcmp(slot, key, memo->arity * sizeof(uint64_t)) == 0) {
+      entry = slot;  // stored by another thread in the meantime
+    }
+  }
+  if (!entry) {
+    ++shard.evictions;
+    if (memo->policy == RDLG_MEMO_KEEP) return;
+    entry = &shard.slots[(hash & table->mask) * table->stride];
+  }
+  std::memcpy(entry, key, memo->arity * sizeof(uint64_t));
+  entry[memo->arity] = result;
+  entry[memo->arity + 1] = 1;
+}
+
+extern "C" void __rdlg_memo_release(rdlg_memo* memo) {
+  std::lock_guard<std::mutex> lock(memoLock);
+  auto* table = static_cast<MemoTable*>(memo->table);
+  if (!table) return;
+  memoTables.erase(std::remove(memoTables.begin(), memoTables.end(), table), memoTables.end());
+  delete table;
+  memo->table = nullptr;
+}
+
+extern "C" int64_t rdlg_memo_stats_get(rdlg_memo_stats* stats, int64_t max) {
+  std::lock_guard<std::mutex> lock(memoLock);
+  int64_t count = static_cast<int64_t>(memoTables.size());
+  for (int64_t i = 0; i < std::min(count, max); ++i) {
+    const MemoTable* table = memoTables[i];
+    rdlg_memo_stats& out = stats[i];
+    out = rdlg_memo_stats{table->name.c_str(), 0, 0, 0, 0, (table->mask + 1) * table->shardCount};
+    for (uint32_t s = 0; s < table->shardCount; ++s) {
+      MemoShard& shard = table->shards[s];
+      std::lock_guard<std::mutex> shardLock(shard.lock);
+      out.hits += shard.hits;
+      out.misses += shard.misses;
+      out.evictions += shard.evictions;
+      out.entries += shard.entries;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,94 @@
+// Declarations for C and C++ code that calls into, or is called by, code
+// emitted by randlang.
+#ifndef __RDLG_RUNTIME_H__
+#define __RDLG_RUNTIME_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Layout of an f64[] value. Passed by value, in two registers on x86-64.
+typedef struct rdlg_array {
+  double* data;
+  int64_t length;
+} rdlg_array;
+
+// Regions own the memory of arrays. Everything allocated after
+// __rdlg_region_enter is released at once by the matching
+// __rdlg_region_leave. Regions are per thread and must be left in reverse
+// order of entering.
+void* __rdlg_region_enter(void);
+void __rdlg_region_leave(void* mark);
+// Zero-initialised, 64 byte aligned storage for count doubles.
+double* __rdlg_region_alloc(int64_t count);
+
+// Runs a parallel reduce over [lo, hi), see rdlg_runtime.cpp.
+double __rdlg_parallel_reduce(double (*chunk)(void* env, double lo, double hi), void* env,
+                              double lo, double hi, double identity,
+                              double (*combine)(double, double));
+
+// Buffered output to stdout, used by the putc, putn, newline and flush
+// builtins. Every thread writes into a buffer of its own, which is written out
+// whole when it is full, on __rdlg_flush, when the thread ends and at exit.
+// Generated code stores characters into the current thread's buffer itself
+// while cur < end and only calls __rdlg_putc when it is full.
+typedef struct rdlg_output {
+  char* cur;
+  char* end;
+} rdlg_output;
+#ifdef __cplusplus
+extern thread_local rdlg_output __rdlg_out;
+#else
+extern _Thread_local rdlg_output __rdlg_out;
+#endif
+void __rdlg_putc(int32_t c);
+void __rdlg_write(const char* data, int64_t length);
+void __rdlg_puti(int64_t value);
+void __rdlg_putf(double value); // shortest form that reads back the same
+void __rdlg_flush(void);
+
+// Memo tables of memo functions. The compiler emits one rdlg_memo per
+// function, the runtime allocates its table on the first call. A table is an
+// open-addressing hash of capacity entries keyed on the bits of the
+// arguments, probed linearly over at most 8 slots. policy says what a store
+// does when those are all taken: RDLG_MEMO_REPLACE overwrites the entry in the
+// first slot, RDLG_MEMO_KEEP drops the new result. With shards == 0 the table
+// is only locked as a whole while __rdlg_parallel_reduce runs worker threads,
+// otherwise it is split into that many separately locked shards.
+enum { RDLG_MEMO_REPLACE = 0, RDLG_MEMO_KEEP = 1 };
+typedef struct rdlg_memo {
+  void* table;
+  const char* name;
+  uint64_t capacity; // a power of two
+  uint32_t arity;
+  uint32_t policy;
+  uint32_t shards; // 0 or a power of two
+  uint32_t reserved;
+} rdlg_memo;
+// key points to arity words. Returns 1 and sets *result on a hit.
+int32_t __rdlg_memo_lookup(rdlg_memo* memo, const uint64_t* key, uint64_t* result);
+void __rdlg_memo_store(rdlg_memo* memo, const uint64_t* key, uint64_t result);
+// Frees the table of memo and drops it from the statistics, for memo
+// functions in code that is unloaded, like the compiler's comptime code.
+void __rdlg_memo_release(rdlg_memo* memo);
+
+// Counters of the memo tables used so far. Fills up to max entries of stats
+// and returns the number of tables. Setting RDLG_MEMO_STATS=1 prints them to
+// stderr at exit.
+typedef struct rdlg_memo_stats {
+  const char* name;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions; // entries overwritten, or results dropped with RDLG_MEMO_KEEP
+  uint64_t entries;
+  uint64_t capacity;
+} rdlg_memo_stats;
+int64_t rdlg_memo_stats_get(rdlg_memo_stats* stats, int64_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
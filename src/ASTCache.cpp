@@ -0,0 +1,247 @@
+// Persistent cache of parsed files, see ASTCache.h.
+#include "../include/ASTCache.h"
+#include "../include/Parser.h"
+#include "../include/Timing.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA256.h"
+#include <chrono>
+#include <cstring>
+
+namespace {
+
+constexpr char Magic[4] = {'R', 'D', 'L', 'A'};
+constexpr uint32_t HeaderSize = 24;
+
+void appendWord(std::string& Out, uint32_t Value) {
+    char Bytes[4];
+    llvm::support::endian::write32le(Bytes, Value);
+    Out.append(Bytes, 4);
+}
+
+std::string hash(llvm::StringRef Data) {
+    auto Hash = llvm::SHA256::hash(llvm::ArrayRef<uint8_t>((const uint8_t*)Data.data(), Data.size()));
+    return llvm::toHex(Hash, true);
+}
+
+bool readValue(const ASTReader& Reader, uint32_t Offset, CachedItem& Item) {
+    ASTReader::Node N;
+    if (!Reader.node(Offset, N) || N.Kind != NodeKind::Value)
+    {
+        return false;
+    }
+    ASTReader::Cursor C(Reader, N);
+    Item.Name = C.name();
+    Item.Value.type = C.type();
+    Item.Value.value = C.number();
+    uint32_t Count = C.word();
+    for (uint32_t i = 0; i < Count && C.ok(); i++)
+    {
+        Item.Value.elements.push_back(C.number());
+    }
+    return C.ok();
+}
+
+bool readImport(const ASTReader& Reader, uint32_t Offset, CachedItem& Item) {
+    ASTReader::Node N;
+    if (!Reader.node(Offset, N) || N.Kind != NodeKind::Import)
+    {
+        return false;
+    }
+    ASTReader::Cursor C(Reader, N);
+    Item.Name = C.name();
+    Item.Path = C.name();
+    Item.Hash = C.name();
+    return C.ok();
+}
+
+} // namespace
+
+void ParsedFile::addValue(ItemKind Kind, const std::string& Name, const ComptimeValue& Value) {
+    W.begin(NodeKind::Value, {});
+    W.name(Name);
+    W.type(Value.type);
+    W.number(Value.value);
+    W.word(Value.elements.size());
+    for (double Element : Value.elements)
+    {
+        W.number(Element);
+    }
+    add(Kind, W.end());
+}
+
+void ParsedFile::addImport(const std::string& Name, const std::string& Path) {
+    W.begin(NodeKind::Import, {});
+    W.name(Name);
+    W.name(Path);
+    W.name(ASTCache::hashFile(Path));
+    add(ItemKind::Import, W.end());
+}
+
+ASTCache::ASTCache(std::string Directory, std::string Configuration, uint64_t MaxSizeBytes)
+    : Directory(std::move(Directory)), Configuration(std::move(Configuration)), MaxSizeBytes(MaxSizeBytes) {
+    if (std::error_code EC = llvm::sys::fs::create_directories(this->Directory))
+    {
+        llvm::errs() << "AST cache: could not create " << this->Directory << ": " << EC.message() << "\n";
+    }
+}
+
+std::string ASTCache::key(const std::string& Source) {
+    return hash(Configuration + "\n" + Source);
+}
+
+std::string ASTCache::entryPath(const std::string& Key) {
+    llvm::SmallString<128> Path(Directory);
+    // pruneCache only ever removes files with this prefix.
+    llvm::sys::path::append(Path, "llvmcache-" + Key);
+    return std::string(Path);
+}
+
+std::string ASTCache::hashFile(const std::string& Path) {
+    auto File = llvm::MemoryBuffer::getFile(Path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+    return File ? hash((*File)->getBuffer()) : "";
+}
+
+bool ASTCache::readEntry(llvm::StringRef Data, std::vector<CachedItem>& Items) {
+    auto wordAt = [&](uint64_t Offset) { return llvm::support::endian::read32le(Data.data() + Offset); };
+    if (Data.size() < HeaderSize || std::memcmp(Data.data(), Magic, 4) != 0 || wordAt(4) != Version)
+    {
+        return false;
+    }
+    uint64_t Count = wordAt(8), Table = wordAt(12), AST = wordAt(16), ASTSize = wordAt(20);
+    if (Table + 8 * Count > Data.size() || AST + ASTSize > Data.size() || AST % 4)
+    {
+        return false;
+    }
+
+    // Everything is read before any of it is used, a damaged entry is just a miss.
+    ASTReader Reader(Data.substr(AST, ASTSize));
+    for (uint64_t i = 0; i < Count; i++)
+    {
+        CachedItem Item;
+        Item.Kind = (ItemKind)wordAt(Table + 8 * i);
+        uint32_t Offset = wordAt(Table + 8 * i + 4);
+        bool Ok = false;
+        switch (Item.Kind)
+        {
+            case ItemKind::Definition:
+            case ItemKind::TopLevel:
+                Item.Function = Reader.readFunction(Offset);
+                Ok = Item.Function != nullptr;
+                break;
+            case ItemKind::Extern:
+                Item.Proto = Reader.readPrototype(Offset);
+                Ok = Item.Proto != nullptr;
+                break;
+            case ItemKind::Const:
+            case ItemKind::Embed:
+                Ok = readValue(Reader, Offset, Item);
+                break;
+            case ItemKind::Import:
+                Ok = readImport(Reader, Offset, Item);
+                break;
+        }
+        if (!Ok)
+        {
+            return false;
+        }
+        Items.push_back(std::move(Item));
+    }
+    return true;
+}
+
+bool ASTCache::load(const std::string& Key, std::vector<CachedItem>& Items) {
+    std::string Path = entryPath(Key);
+    int FD;
+    if (llvm::sys::fs::openFileForRead(Path, FD))
+    {
+        return false;
+    }
+    // Mapped rather than copied if the entry is big enough.
+    auto Buffer = llvm::MemoryBuffer::getOpenFile(llvm::sys::fs::convertFDToNativeFile(FD), Path, -1, /*RequiresNullTerminator*/ false);
+    // Entries are dropped least recently used first.
+    llvm::sys::fs::setLastAccessAndModificationTime(FD, std::chrono::system_clock::now());
+    llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+    return Buffer && readEntry((*Buffer)->getBuffer(), Items);
+}
+
+void ASTCache::store(const std::string& Key, const ParsedFile& File) {
+    if (File.Failed || File.W.failed())
+    {
+        return;
+    }
+    std::string Out(Magic, 4);
+    appendWord(Out, Version);
+    appendWord(Out, File.Items.size());
+    appendWord(Out, HeaderSize);
+    appendWord(Out, HeaderSize + 8 * File.Items.size());
+    appendWord(Out, File.W.buffer().size());
+    for (auto &[Kind, Offset] : File.Items)
+    {
+        appendWord(Out, (uint32_t)Kind);
+        appendWord(Out, Offset);
+    }
+    Out += File.W.buffer();
+
+    // Written under a temporary name first, concurrent compilers never see half an entry.
+    int FD;
+    llvm::SmallString<128> TempPath;
+    if (llvm::sys::fs::createUniqueFile(Directory + "/tmp-%%%%%%%%", FD, TempPath))
+    {
+        return;
+    }
+    {
+        llvm::raw_fd_ostream OS(FD, true);
+        OS << Out;
+        if (OS.has_error())
+        {
+            OS.clear_error();
+            llvm::sys::fs::remove(TempPath);
+            return;
+        }
+    }
+    if (llvm::sys::fs::rename(TempPath, entryPath(Key)))
+    {
+        llvm::sys::fs::remove(TempPath);
+        return;
+    }
+    Stored++;
+}
+
+void ASTCache::parse(Parser& P, const std::string& Source) {
+    std::string Key = key(Source);
+    std::vector<CachedItem> Items;
+    bool Loaded;
+    {
+        TimeScope Scope(Phase::Load, "AST cache");
+        Loaded = load(Key, Items);
+    }
+    if (Loaded && P.replay(Items))
+    {
+        Hits++;
+        return;
+    }
+    Misses++;
+    ParsedFile File;
+    P.record(&File);
+    P.parse();
+    P.record(nullptr);
+    store(Key, File);
+}
+
+void ASTCache::prune() {
+    llvm::CachePruningPolicy Policy;
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.Expiration = std::chrono::seconds(0);
+    Policy.MaxSizePercentageOfAvailableSpace = 0;
+    Policy.MaxSizeBytes = MaxSizeBytes;
+    llvm::pruneCache(Directory, Policy);
+}
+
+void ASTCache::printStats(llvm::raw_ostream& OS) {
+    OS << "AST cache: " << Hits.load() << " files read, " << Misses.load() << " files parsed, " << Stored.load() << " stored\n";
+}
@@ -5,33 +5,197 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "../include/ASTNodes.h"
+#include "../include/DebugInfo.h"
+#include "../include/Output.h"
+#include "../include/Purity.h"
+#include "../include/Timing.h"
+#include <algorithm>
+#include <cmath>
 #include <memory>
 
-std::unique_ptr<llvm::LLVMContext> ASTNode::TheContext = nullptr;
-std::unique_ptr<llvm::IRBuilder<>> ASTNode::Builder = nullptr;
-std::unique_ptr<llvm::Module> ASTNode::TheModule = nullptr;
-std::map<std::string, llvm::AllocaInst *> ASTNode::NamedValues;
-std::map<std::string, std::unique_ptr<PrototypeASTNode>> FunctionASTNode::FunctionProtos;
-
-std::unique_ptr<llvm::FunctionPassManager> ASTNode::TheFPM = nullptr;
-std::unique_ptr<llvm::LoopAnalysisManager> ASTNode::TheLAM = nullptr;
-std::unique_ptr<llvm::FunctionAnalysisManager> ASTNode::TheFAM = nullptr;
-std::unique_ptr<llvm::CGSCCAnalysisManager> ASTNode::TheCGAM = nullptr;
-std::unique_ptr<llvm::ModuleAnalysisManager> ASTNode::TheMAM = nullptr;
-std::unique_ptr<llvm::PassInstrumentationCallbacks> ASTNode::ThePIC = nullptr;
-std::unique_ptr<llvm::StandardInstrumentations> ASTNode::TheSI = nullptr;
-
-llvm::AllocaInst* ASTNode::CreateEntryBlockAlloca(llvm::Function* TheFunction, llvm::StringRef VarName) {
+thread_local std::unique_ptr<llvm::LLVMContext> ASTNode::TheContext = nullptr;
+thread_local std::unique_ptr<llvm::IRBuilder<>> ASTNode::Builder = nullptr;
+thread_local std::unique_ptr<llvm::Module> ASTNode::TheModule = nullptr;
+thread_local std::map<std::string, llvm::AllocaInst *> ASTNode::NamedValues;
+thread_local std::map<std::string, TypeSlot*> ASTNode::NamedTypes;
+thread_local bool ASTNode::TypesChanged = false;
+thread_local llvm::CallInst* ASTNode::FunctionRegion = nullptr;
+thread_local std::map<std::string, Constant> ASTNode::ConstValues;
+thread_local std::map<std::string, llvm::GlobalVariable*> ASTNode::ConstArrays;
+thread_local unsigned ASTNode::RegionDepth = 0;
+thread_local std::map<llvm::AllocaInst*, unsigned> ASTNode::BindingDepth;
+unsigned ASTNode::DefaultFastMath = 0;
+thread_local std::map<std::string, std::unique_ptr<PrototypeASTNode>> FunctionASTNode::FunctionProtos;
+thread_local std::map<std::string, std::unique_ptr<FunctionASTNode>> FunctionASTNode::OperatorBodies;
+
+thread_local std::unique_ptr<llvm::FunctionPassManager> ASTNode::TheFPM = nullptr;
+thread_local std::unique_ptr<llvm::LoopAnalysisManager> ASTNode::TheLAM = nullptr;
+thread_local std::unique_ptr<llvm::FunctionAnalysisManager> ASTNode::TheFAM = nullptr;
+thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> ASTNode::TheCGAM = nullptr;
+thread_local std::unique_ptr<llvm::ModuleAnalysisManager> ASTNode::TheMAM = nullptr;
+thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ASTNode::ThePIC = nullptr;
+thread_local std::unique_ptr<llvm::StandardInstrumentations> ASTNode::TheSI = nullptr;
+
+// Everything that refers to the context goes first.
+void ASTNode::resetState() {
+    DebugInfo::reset();
+    TheSI.reset();
+    ThePIC.reset();
+    TheMAM.reset();
+    TheCGAM.reset();
+    TheFAM.reset();
+    TheLAM.reset();
+    TheFPM.reset();
+    NamedValues.clear();
+    NamedTypes.clear();
+    FunctionRegion = nullptr;
+    RegionDepth = 0;
+    BindingDepth.clear();
+    ConstValues.clear();
+    ConstArrays.clear();
+    FunctionASTNode::FunctionProtos.clear();
+    FunctionASTNode::OperatorBodies.clear();
+    Builder.reset();
+    TheModule.reset();
+    TheContext.reset();
+}
+
+llvm::AllocaInst* ASTNode::CreateEntryBlockAlloca(llvm::Function* TheFunction, llvm::StringRef VarName, llvm::Type* Ty) {
     llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*TheContext), nullptr, VarName);
+    if (!Ty)
+    {
+        Ty = llvm::Type::getDoubleTy(*TheContext);
+    }
+    llvm::AllocaInst* Alloca = TmpB.CreateAlloca(Ty, nullptr, VarName);
+    BindingDepth[Alloca] = RegionDepth;
+    return Alloca;
+}
+
+llvm::Type* ASTNode::llvmType(ValueType type) {
+    return toLLVMType(type, *TheContext);
+}
+
+llvm::Value* ASTNode::convertTo(llvm::Value* V, llvm::Type* To) {
+    if (!V || V->getType() == To)
+    {
+        return V;
+    }
+
+    llvm::Type* From = V->getType();
+    if (From->isStructTy() || To->isStructTy())
+    {
+        return vLogError("Arrays can't be converted to or from other types");
+    }
+    if (auto* VecTo = llvm::dyn_cast<llvm::FixedVectorType>(To))
+    {
+        if (!From->isVectorTy())
+        {
+            // Scalars are broadcast to all lanes.
+            return Builder->CreateVectorSplat(VecTo->getNumElements(), convertTo(V, VecTo->getElementType()), "splat");
+        } else if (llvm::cast<llvm::FixedVectorType>(From)->getNumElements() != VecTo->getNumElements())
+        {
+            return vLogError("Vector widths don't match");
+        }
+    } else if (From->isVectorTy())
+    {
+        return vLogError("Can't use a vector where a scalar is expected");
+    }
+
+    // The casts below work lane-wise on vectors.
+    llvm::Type* FromElem = From->getScalarType();
+    llvm::Type* ToElem = To->getScalarType();
+    if (ToElem->isIntegerTy(1))
+    {
+        if (FromElem->isFloatingPointTy())
+        {
+            return Builder->CreateFCmpONE(V, llvm::ConstantFP::get(From, 0.0), "tobool");
+        }
+        return Builder->CreateICmpNE(V, llvm::ConstantInt::get(From, 0), "tobool");
+    } else if (ToElem->isIntegerTy())
+    {
+        if (FromElem->isFloatingPointTy())
+        {
+            return Builder->CreateFPToSI(V, To, "toint");
+        }
+        return Builder->CreateIntCast(V, To, !FromElem->isIntegerTy(1), "toint");
+    } else if (ToElem->isFloatingPointTy())
+    {
+        if (FromElem->isIntegerTy(1))
+        {
+            return Builder->CreateUIToFP(V, To, "tofp"); // Convert bool 0/1 to double 0.0 or 1.0
+        } else if (FromElem->isIntegerTy())
+        {
+            return Builder->CreateSIToFP(V, To, "tofp");
+        }
+        return Builder->CreateFPCast(V, To, "tofp");
+    }
+    return vLogError("Invalid type conversion");
+}
+
+llvm::Value* ASTNode::convertTo(llvm::Value* V, ValueType To) {
+    return convertTo(V, llvmType(To));
+}
+
+void ASTNode::widen(TypeSlot& Slot, ValueType Type) {
+    if (Slot.annotated)
+    {
+        return;
+    }
+    ValueType Joined = joinTypes(Slot.type, Type);
+    if (Joined != Slot.type)
+    {
+        Slot.type = Joined;
+        TypesChanged = true;
+    }
+}
+
+ValueType ASTNode::inferType() {
+    return exprType;
+}
+
+llvm::Value* ASTNode::makeArray(llvm::Value* Data, llvm::Value* Length) {
+    llvm::Value* A = llvm::PoisonValue::get(llvmType(ValueType::Array));
+    A = Builder->CreateInsertValue(A, Data, 0);
+    return Builder->CreateInsertValue(A, Length, 1, "array");
+}
+
+// Arrays outside any region block live until the function returns. The
+// function's region is only entered once something actually needs it.
+llvm::Value* ASTNode::emitArrayAlloc(llvm::Value* Length) {
+    llvm::Type* PtrTy = llvm::PointerType::getUnqual(*TheContext);
+    if (RegionDepth == 0 && !FunctionRegion)
+    {
+        llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
+        llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+        llvm::FunctionCallee Enter = TheModule->getOrInsertFunction("__rdlg_region_enter", llvm::FunctionType::get(PtrTy, false));
+        FunctionRegion = TmpB.CreateCall(Enter, {}, "region");
+    }
+    llvm::FunctionCallee Alloc = TheModule->getOrInsertFunction("__rdlg_region_alloc", PtrTy, llvm::Type::getInt64Ty(*TheContext));
+    return Builder->CreateCall(Alloc, {Length}, "arraydata");
+}
+
+void ASTNode::emitFunctionRegionLeave() {
+    if (FunctionRegion)
+    {
+        llvm::Type* PtrTy = llvm::PointerType::getUnqual(*TheContext);
+        llvm::FunctionCallee Leave = TheModule->getOrInsertFunction("__rdlg_region_leave", llvm::Type::getVoidTy(*TheContext), PtrTy);
+        Builder->CreateCall(Leave, {FunctionRegion});
+    }
+    FunctionRegion = nullptr;
+    RegionDepth = 0;
 }
 
-NumberASTNode::NumberASTNode(double value) : val(value) {}
+void ASTNode::emitLocation() {
+    DebugInfo::setLocation(*Builder, Loc);
+}
+
+NumberASTNode::NumberASTNode(double value, ValueType literalType) : val(value), literalType(literalType) {}
 
 VariableASTNode::VariableASTNode(const std::string variableName) : varName(variableName){}
 const std::string& VariableASTNode::getName() const {
@@ -40,14 +204,65 @@ const std::string& VariableASTNode::getName() const {
 
 BinaryASTNode::BinaryASTNode(char Op, std::unique_ptr<ASTNode> LHS, std::unique_ptr<ASTNode> RHS, bool isSinglecharOperator, Token::Kind tokenkind) : op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)), isSinglecharOperator(isSinglecharOperator), tokenkind(tokenkind){}
 
+IndexExprAST::IndexExprAST(std::unique_ptr<ASTNode> Base, std::unique_ptr<ASTNode> Index, std::unique_ptr<ASTNode> SliceEnd) : Base(std::move(Base)), Index(std::move(Index)), SliceEnd(std::move(SliceEnd)) {}
+
 CallASTNode::CallASTNode(const std::string& Callee, std::vector<std::unique_ptr<ASTNode>> arguments) : callee(Callee), args(std::move(arguments)) {}
 
-PrototypeASTNode:: PrototypeASTNode(const std::string& Name, std::vector<std::string> arguments, bool isOperator, unsigned Prec) : name(Name), args(std::move(arguments)), isOperator(isOperator), Precedence(Prec) {}
+PrototypeASTNode:: PrototypeASTNode(const std::string& Name, std::vector<std::string> arguments, bool isOperator, unsigned Prec,
+    std::vector<ValueType> argTypes, ValueType returnType) : name(Name), args(std::move(arguments)), isOperator(isOperator), Precedence(Prec), argTypes(std::move(argTypes)), returnType(returnType) {}
 
 const std::string& PrototypeASTNode::getName() const {
     return name;
 };
 
+const std::vector<std::string>& PrototypeASTNode::getArgs() const {
+    return args;
+}
+
+ValueType PrototypeASTNode::getArgType(unsigned i) const {
+    return i < argTypes.size() ? argTypes[i] : ValueType::F64;
+}
+
+ValueType PrototypeASTNode::getReturnType() const {
+    return returnType;
+}
+
+void PrototypeASTNode::setFastMath(unsigned Flags) {
+    fastMath = Flags;
+}
+
+const std::optional<unsigned>& PrototypeASTNode::getAnnotatedFastMath() const {
+    return fastMath;
+}
+
+unsigned PrototypeASTNode::getFastMath() const {
+    return fastMath.value_or(DefaultFastMath);
+}
+
+void PrototypeASTNode::setPure(bool Pure) {
+    pure = Pure;
+}
+
+bool PrototypeASTNode::isPure() const {
+    return pure;
+}
+
+void PrototypeASTNode::setMemo(const MemoOptions& Options) {
+    memo = Options;
+}
+
+const std::optional<MemoOptions>& PrototypeASTNode::getMemo() const {
+    return memo;
+}
+
+void PrototypeASTNode::setEffects(unsigned Flags) {
+    effects = Flags;
+}
+
+unsigned PrototypeASTNode::getEffects() const {
+    return effects;
+}
+
 bool PrototypeASTNode::isUnaryOp() const {
     return isOperator && args.size() == 1;
 }
@@ -65,13 +280,40 @@ unsigned PrototypeASTNode::getBinaryPrecedence() const {
     return Precedence;
 }
 
-FunctionASTNode:: FunctionASTNode(std::unique_ptr<PrototypeASTNode> prototype, std::vector<std::unique_ptr<ASTNode>> Body) : proto(std::move(prototype)), body(std::move(Body)) {}
+FunctionASTNode:: FunctionASTNode(std::unique_ptr<PrototypeASTNode> prototype, std::vector<std::unique_ptr<ASTNode>> Body) : name(prototype->getName()), proto(std::move(prototype)), body(std::move(Body)) {}
+
+const std::string& FunctionASTNode::getName() const {
+    return name;
+}
+
+std::vector<std::unique_ptr<ASTNode>>& FunctionASTNode::getBody() {
+    return body;
+}
+
+void FunctionASTNode::declare() {
+    FunctionProtos[proto->getName()] = std::move(proto);
+}
 
 
 IfExprAST::IfExprAST(std::unique_ptr<ASTNode> Cond, std::vector<std::unique_ptr<ASTNode>> Then, std::vector<std::unique_ptr<ASTNode>> Else) : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
 
 llvm::Value* NumberASTNode::codegen() {
-    return llvm::ConstantFP::get(*TheContext, llvm::APFloat(val));
+    if (literalType == ValueType::Bool)
+    {
+        return llvm::ConstantInt::getBool(*TheContext, val != 0);
+    } else if (literalType == ValueType::I64)
+    {
+        return llvm::ConstantInt::get(llvm::Type::getInt64Ty(*TheContext), (int64_t)val, true);
+    }
+    return llvm::ConstantFP::get(llvmType(literalType), val);
+}
+
+double NumberASTNode::getValue() const {
+    return val;
+}
+
+ValueType NumberASTNode::inferType() {
+    return exprType = literalType;
 }
 
 ForExprAST::ForExprAST(const std::string &VarName, std::unique_ptr<ASTNode> Start,
@@ -83,28 +325,56 @@ UnaryExprAst::UnaryExprAst(char Opcode, std::unique_ptr<ASTNode> Operand) : Opco
 {
 }
 
-VarAstNode::VarAstNode(std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames, std::unique_ptr<ASTNode> Body) : VarNames(std::move(VarNames)), Body(std::move(Body))
+VarAstNode::VarAstNode(std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames, std::vector<TypeSlot> VarTypes, std::unique_ptr<ASTNode> Body) : VarNames(std::move(VarNames)), VarTypes(std::move(VarTypes)), Body(std::move(Body))
+{
+}
+
+RegionExprAST::RegionExprAST(std::vector<std::unique_ptr<ASTNode>> Body) : Body(std::move(Body)) {}
+
+ReduceExprAST::ReduceExprAST(const std::string& Op, std::unique_ptr<ASTNode> Identity, const std::string& VarName,
+    std::unique_ptr<ASTNode> Start, std::unique_ptr<ASTNode> End, std::unique_ptr<ASTNode> Body, bool Parallel) : Op(Op), Identity(std::move(Identity)), VarName(VarName), Start(std::move(Start)), End(std::move(End)), Body(std::move(Body)), Parallel(Parallel)
 {
 }
 
 llvm::Value* VariableASTNode::codegen() {
+    emitLocation();
     std::string variableName = varName;
     llvm::AllocaInst* V = NamedValues[variableName];
     if (!V)
     {
-        vLogError("Unknown variable name");
+        auto Const = ConstArrays.find(variableName);
+        if (Const != ConstArrays.end())
+        {
+            uint64_t Length = Const->second->getValueType()->getArrayNumElements();
+            return makeArray(Const->second, llvm::ConstantInt::get(llvm::Type::getInt64Ty(*TheContext), Length));
+        }
+        return vLogError("Unknown variable name");
     }
     return Builder->CreateLoad(V->getAllocatedType(), V, varName.c_str());
 }
 
-llvm::Value* BinaryASTNode::codegen() {
+ValueType VariableASTNode::inferType() {
+    auto Slot = NamedTypes.find(varName);
+    if (Slot == NamedTypes.end() || !Slot->second)
+    {
+        return exprType = ConstArrays.count(varName) ? ValueType::Array : ValueType::F64;
+    }
+    return exprType = Slot->second->type;
+}
 
+llvm::Value* BinaryASTNode::codegen() {
+    emitLocation();
     if (op == '=')
     {
-        VariableASTNode* LHSE = static_cast<VariableASTNode*>(LHS.get());
+        if (auto* LHSI = dynamic_cast<IndexExprAST*>(LHS.get()))
+        {
+            return LHSI->codegenStore(RHS->codegen());
+        }
+
+        VariableASTNode* LHSE = dynamic_cast<VariableASTNode*>(LHS.get());
         if (!LHSE)
         {
-            return vLogError("destination of '=' must be a variable");
+            return vLogError("destination of '=' must be a variable or an element");
         }
         
         llvm::Value* Val = RHS->codegen();
@@ -113,12 +383,19 @@ llvm::Value* BinaryASTNode::codegen() {
             return nullptr;
         }
         
-        llvm::Value* Variable = NamedValues[LHSE->getName()];
+        llvm::AllocaInst* Variable = NamedValues[LHSE->getName()];
         if (!Variable)
         {
             return vLogError("Unknown variable Name");
         }
+        // The array may live in a region block the variable outlives.
+        if (Val->getType()->isStructTy() && BindingDepth[Variable] < RegionDepth)
+        {
+            return vLogError("Arrays can't be assigned to variables declared outside the region block");
+        }
         
+        emitLocation();
+        Val = convertTo(Val, Variable->getAllocatedType());
         Builder->CreateStore(Val, Variable);
         return Val;
     }
@@ -130,26 +407,42 @@ llvm::Value* BinaryASTNode::codegen() {
     {
        return nullptr;
     }
+
+    // The operands may have moved the location, the operation belongs to the operator.
+    emitLocation();
+    bool isFloat = operandType.isFloat();
+    if (isBuiltinOperator())
+    {
+        L = convertTo(L, operandType);
+        R = convertTo(R, operandType);
+        if (!L || !R)
+        {
+            return nullptr;
+        }
+        if (operandType.isVector() && exprType == ValueType::Bool)
+        {
+            return vLogError("Comparisons are not defined on vectors");
+        }
+    }
+
     if (isSinglecharOperator)
     {
         
         switch (op)
         {
         case '+':
-            return ASTNode::Builder->CreateFAdd(L, R, "addtmp");
+            return isFloat ? ASTNode::Builder->CreateFAdd(L, R, "addtmp") : ASTNode::Builder->CreateAdd(L, R, "addtmp");
     
         case '-':
-            return ASTNode::Builder->CreateFSub(L, R, "subtmp");
+            return isFloat ? ASTNode::Builder->CreateFSub(L, R, "subtmp") : ASTNode::Builder->CreateSub(L, R, "subtmp");
     
         case '*':
-            return ASTNode::Builder->CreateFMul(L, R, "multmp");
+            return isFloat ? ASTNode::Builder->CreateFMul(L, R, "multmp") : ASTNode::Builder->CreateMul(L, R, "multmp");
     
         case '<':
-            L = ASTNode::Builder->CreateFCmpULT(L, R, "cmptmpl");
-            return ASTNode::Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmpl"); // Convert bool 0/1 to double 0.0 or 1.0
+            return isFloat ? ASTNode::Builder->CreateFCmpULT(L, R, "cmptmpl") : ASTNode::Builder->CreateICmpSLT(L, R, "cmptmpl");
         case '>':
-            L = ASTNode::Builder->CreateFCmpUGT(L, R, "cmptmpr");
-            return ASTNode::Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmpr"); // Convert bool 0/1 to double 0.0 or 1.0 
+            return isFloat ? ASTNode::Builder->CreateFCmpUGT(L, R, "cmptmpr") : ASTNode::Builder->CreateICmpSGT(L, R, "cmptmpr");
         
         default:
             break;;
@@ -158,17 +451,13 @@ llvm::Value* BinaryASTNode::codegen() {
         switch (tokenkind)
         {
         case Token::Kind::DoubleEqual:
-            L = ASTNode::Builder->CreateFCmpUEQ(L, R);
-            return ASTNode::Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmpe"); // Convert bool 0/1 to double 0.0 or 1.0
+            return isFloat ? ASTNode::Builder->CreateFCmpUEQ(L, R, "cmptmpe") : ASTNode::Builder->CreateICmpEQ(L, R, "cmptmpe");
         case Token::Kind::GreaterOrEqual:
-            L = ASTNode::Builder->CreateFCmpUGE(L, R, "cmptmpre");
-            return ASTNode::Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmpre"); // Convert bool 0/1 to double 0.0 or 1.0
+            return isFloat ? ASTNode::Builder->CreateFCmpUGE(L, R, "cmptmpre") : ASTNode::Builder->CreateICmpSGE(L, R, "cmptmpre");
         case Token::Kind::LessOrEqual:
-            L = ASTNode::Builder->CreateFCmpULE(L, R, "cmptmple");
-            return ASTNode::Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmple"); // Convert bool 0/1 to double 0.0 or 1.0
+            return isFloat ? ASTNode::Builder->CreateFCmpULE(L, R, "cmptmple") : ASTNode::Builder->CreateICmpSLE(L, R, "cmptmple");
         case Token::Kind::NotEqual:
-            L = ASTNode::Builder->CreateFCmpUNE(L, R);
-            return ASTNode::Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmpne"); // Convert bool 0/1 to double 0.0 or 1.0
+            return isFloat ? ASTNode::Builder->CreateFCmpUNE(L, R, "cmptmpne") : ASTNode::Builder->CreateICmpNE(L, R, "cmptmpne");
         default:
             break;
         }
@@ -178,14 +467,64 @@ llvm::Value* BinaryASTNode::codegen() {
     llvm::Function* F = FunctionASTNode::getFunction(std::string("binary") + op);
     assert(F && "binary operator not found!");
 
-    llvm::Value* Ops[2] = {L, R};
+    llvm::Value* Ops[2] = {convertTo(L, F->getArg(0)->getType()), convertTo(R, F->getArg(1)->getType())};
     return Builder->CreateCall(F, Ops, "binop");
 }
 
+ValueType BinaryASTNode::inferType() {
+    ValueType R = RHS->inferType();
+    if (op == '=')
+    {
+        if (dynamic_cast<IndexExprAST*>(LHS.get()))
+        {
+            return exprType = LHS->inferType();
+        }
+        VariableASTNode* LHSE = dynamic_cast<VariableASTNode*>(LHS.get());
+        auto Slot = LHSE ? NamedTypes.find(LHSE->getName()) : NamedTypes.end();
+        if (Slot == NamedTypes.end() || !Slot->second)
+        {
+            return exprType = R;
+        }
+        widen(*Slot->second, R);
+        return exprType = Slot->second->type;
+    }
+
+    ValueType L = LHS->inferType();
+    // Float literals take the precision of the other operand, so x * 0.5
+    // stays f32 when x is f32.
+    if (dynamic_cast<NumberASTNode*>(RHS.get()) && L.scalar == ScalarType::F32 && R == ValueType::F64)
+    {
+        R = ValueType::F32;
+    } else if (dynamic_cast<NumberASTNode*>(LHS.get()) && R.scalar == ScalarType::F32 && L == ValueType::F64)
+    {
+        L = ValueType::F32;
+    }
+    operandType = arithmeticType(L, R);
+
+    if (!isBuiltinOperator())
+    {
+        return exprType = FunctionASTNode::getReturnType(std::string("binary") + op);
+    } else if (!isSinglecharOperator || op == '<' || op == '>')
+    {
+        return exprType = ValueType::Bool;
+    }
+    return exprType = operandType;
+}
+
+bool BinaryASTNode::isBuiltinOperator() const {
+    return !isSinglecharOperator || op == '+' || op == '-' || op == '*' || op == '<' || op == '>';
+}
+
 llvm::Value* CallASTNode::codegen() {
-    llvm::Function* CalleeF = TheModule->getFunction(callee);
+    emitLocation();
+    // Imported functions are only declared in the module once they are called.
+    llvm::Function* CalleeF = FunctionASTNode::getFunction(callee);
     if (!CalleeF)
     {
+        if (isBuiltin())
+        {
+            return codegenBuiltin();
+        }
         return vLogError("unknown function referenced");
     }
 
@@ -197,7 +536,7 @@ llvm::Value* CallASTNode::codegen() {
     std::vector<llvm::Value*> argsV;
     for (unsigned i = 0, e = args.size(); i != e; i++)
     {
-        argsV.push_back(args[i]->codegen());
+        argsV.push_back(convertTo(args[i]->codegen(), CalleeF->getArg(i)->getType()));
         if (!argsV.back())
         {
             return nullptr;
@@ -205,20 +544,404 @@ llvm::Value* CallASTNode::codegen() {
         
     }
     
+    emitLocation();
     return Builder->CreateCall(CalleeF, argsV, "calltmp");
 }
 
+ValueType CallASTNode::inferType() {
+    for (auto &arg : args)
+    {
+        arg->inferType();
+    }
+    if (isBuiltin())
+    {
+        return exprType = inferBuiltin();
+    }
+    return exprType = FunctionASTNode::getReturnType(callee);
+}
+
+namespace {
+
+struct MathBuiltin {
+    const char* Name;
+    unsigned Arity;
+    llvm::Intrinsic::ID Float;
+    llvm::Intrinsic::ID Int; // not_intrinsic: integers are converted to f64
+};
+
+const MathBuiltin* findMath(const std::string& Name) {
+    static const MathBuiltin Math[] = {
+        {"sqrt", 1, llvm::Intrinsic::sqrt, llvm::Intrinsic::not_intrinsic},
+        {"sin", 1, llvm::Intrinsic::sin, llvm::Intrinsic::not_intrinsic},
+        {"cos", 1, llvm::Intrinsic::cos, llvm::Intrinsic::not_intrinsic},
+        {"exp", 1, llvm::Intrinsic::exp, llvm::Intrinsic::not_intrinsic},
+        {"log", 1, llvm::Intrinsic::log, llvm::Intrinsic::not_intrinsic},
+        {"pow", 2, llvm::Intrinsic::pow, llvm::Intrinsic::not_intrinsic},
+        {"fabs", 1, llvm::Intrinsic::fabs, llvm::Intrinsic::not_intrinsic},
+        {"floor", 1, llvm::Intrinsic::floor, llvm::Intrinsic::not_intrinsic},
+        {"fma", 3, llvm::Intrinsic::fma, llvm::Intrinsic::not_intrinsic},
+        {"min", 2, llvm::Intrinsic::minnum, llvm::Intrinsic::smin},
+        {"max", 2, llvm::Intrinsic::maxnum, llvm::Intrinsic::smax},
+    };
+    for (auto &M : Math)
+    {
+        if (Name == M.Name)
+        {
+            return &M;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+// Vector builtins. A function with the same name takes precedence.
+//   vec2/vec4/vec8(x) or vecN(x0, ..., xN-1)  construct (f32 lanes if all non-literal values are f32)
+//   extract(v, i), insert(v, i, x)           read or replace lane i
+//   shuffle(v, i...), shuffle(v, w, i...)    lanes picked by constant indices, w's lanes start at v's width
+//   hsum, hprod, hmin, hmax(v)               horizontal reductions
+// the array builtins
+//   array(n)                                 n zeroed f64 values in the innermost region
+//   len(a)                                   number of elements as i64
+// the math builtins, lowered to LLVM intrinsics so they are folded, hoisted
+// and vectorized like arithmetic (they don't set errno)
+//   sqrt, sin, cos, exp, log, fabs, floor(x)
+//   pow(x, y), fma(a, b, c)                  fma rounds once
+//   min, max(a, b)                           on i64 if both are integers, otherwise minnum/maxnum
+// and the output builtins, buffered by the runtime (rdlg_runtime.h)
+//   putc(c)                                  writes the byte c to stdout
+//   putn(x)                                  writes x as a number, integers without a fraction
+//   newline(), flush()                       write '\n', write out the buffer
+bool CallASTNode::isBuiltin() const {
+    static const char* const Builtins[] = {"vec2", "vec4", "vec8", "extract", "insert", "shuffle", "hsum", "hprod", "hmin", "hmax", "array", "len", "putc", "putn", "newline", "flush",
+        "sqrt", "sin", "cos", "exp", "log", "pow", "fabs", "floor", "fma", "min", "max"};
+    if (TheModule->getFunction(callee) || FunctionASTNode::FunctionProtos.count(callee))
+    {
+        return false;
+    }
+    return std::find(std::begin(Builtins), std::end(Builtins), callee) != std::end(Builtins);
+}
+
+ValueType CallASTNode::inferBuiltin() {
+    if (callee == "vec2" || callee == "vec4" || callee == "vec8")
+    {
+        ValueType Elem = ValueType::Bool;
+        for (auto &arg : args)
+        {
+            if (!dynamic_cast<NumberASTNode*>(arg.get()))
+            {
+                Elem = joinTypes(Elem, arg->exprType.element());
+            }
+        }
+        return ValueType{Elem == ValueType::F32 ? ScalarType::F32 : ScalarType::F64, (unsigned)(callee[3] - '0')};
+    } else if (callee == "array")
+    {
+        return ValueType::Array;
+    } else if (callee == "len")
+    {
+        return ValueType::I64;
+    } else if (callee == "putc" || callee == "putn" || callee == "newline" || callee == "flush")
+    {
+        return ValueType::F64;
+    } else if (findMath(callee))
+    {
+        return inferMath();
+    }
+
+    if (args.empty())
+    {
+        return ValueType::F64;
+    }
+    ValueType V = args[0]->exprType;
+    if (callee == "insert")
+    {
+        return V;
+    } else if (callee == "shuffle")
+    {
+        unsigned First = (args.size() > 1 && !dynamic_cast<NumberASTNode*>(args[1].get())) ? 2 : 1;
+        return ValueType{V.scalar, (unsigned)args.size() - First};
+    }
+    return V.element();
+}
+
+llvm::Value* CallASTNode::codegenBuiltin() {
+    llvm::Type* ResultTy = llvmType(exprType);
+    if (callee == "vec2" || callee == "vec4" || callee == "vec8")
+    {
+        if (args.size() == 1)
+        {
+            return convertTo(args[0]->codegen(), ResultTy);
+        } else if (args.size() != exprType.lanes)
+        {
+            return vLogError("Vector constructors take one value or one value per lane");
+        }
+
+        llvm::Value* Result = llvm::PoisonValue::get(ResultTy);
+        for (unsigned i = 0, e = args.size(); i != e; i++)
+        {
+            llvm::Value* V = convertTo(args[i]->codegen(), ResultTy->getScalarType());
+            if (!V)
+            {
+                return nullptr;
+            }
+            Result = Builder->CreateInsertElement(Result, V, (uint64_t)i);
+        }
+        return Result;
+    } else if (callee == "putc" || callee == "putn" || callee == "newline" || callee == "flush")
+    {
+        return codegenOutput();
+    } else if (findMath(callee))
+    {
+        return codegenMath();
+    }
+
+    if (args.empty())
+    {
+        return vLogError("Incorrect number of arguments");
+    }
+
+    if (callee == "array" || callee == "len")
+    {
+        if (args.size() != 1)
+        {
+            return vLogError("Incorrect number of arguments");
+        }
+        llvm::Value* A = args[0]->codegen();
+        if (!A)
+        {
+            return nullptr;
+        }
+        if (callee == "len")
+        {
+            if (!A->getType()->isStructTy())
+            {
+                return vLogError("len expects an array");
+            }
+            return Builder->CreateExtractValue(A, 1, "len");
+        }
+        llvm::Value* Length = convertTo(A, ValueType::I64);
+        if (!Length)
+        {
+            return nullptr;
+        }
+        return makeArray(emitArrayAlloc(Length), Length);
+    }
+
+    llvm::Value* V = args[0]->codegen();
+    if (!V)
+    {
+        return nullptr;
+    }
+    if (!V->getType()->isVectorTy())
+    {
+        return vLogError("Expected a vector argument");
+    }
+
+    if (callee == "extract" || callee == "insert")
+    {
+        if (args.size() != (callee == "extract" ? 2u : 3u))
+        {
+            return vLogError("Incorrect number of arguments");
+        }
+        llvm::Value* Idx = convertTo(args[1]->codegen(), ValueType::I64);
+        if (!Idx)
+        {
+            return nullptr;
+        }
+        if (callee == "extract")
+        {
+            return Builder->CreateExtractElement(V, Idx, "lane");
+        }
+        llvm::Value* X = convertTo(args[2]->codegen(), ResultTy->getScalarType());
+        if (!X)
+        {
+            return nullptr;
+        }
+        return Builder->CreateInsertElement(V, X, Idx, "withlane");
+    }
+
+    if (callee == "shuffle")
+    {
+        unsigned First = 1;
+        llvm::Value* W = nullptr;
+        if (args.size() > 1 && !dynamic_cast<NumberASTNode*>(args[1].get()))
+        {
+            W = convertTo(args[1]->codegen(), V->getType());
+            if (!W)
+            {
+                return nullptr;
+            }
+            First = 2;
+        }
+
+        int Limit = llvm::cast<llvm::FixedVectorType>(V->getType())->getNumElements() * (W ? 2 : 1);
+        std::vector<int> Mask;
+        for (unsigned i = First, e = args.size(); i != e; i++)
+        {
+            auto* Lit = dynamic_cast<NumberASTNode*>(args[i].get());
+            if (!Lit)
+            {
+                return vLogError("shuffle indices must be integer literals");
+            }
+            int Idx = (int)Lit->getValue();
+            if (Idx < 0 || Idx >= Limit)
+            {
+                return vLogError("shuffle index out of range");
+            }
+            Mask.push_back(Idx);
+        }
+        if (Mask.empty())
+        {
+            return vLogError("shuffle needs at least one index");
+        }
+        return W ? Builder->CreateShuffleVector(V, W, Mask, "shuffle") : Builder->CreateShuffleVector(V, Mask, "shuffle");
+    }
+
+    if (args.size() != 1)
+    {
+        return vLogError("Incorrect number of arguments");
+    }
+
+    // hsum and hprod may add up the lanes in any order, like reduce does.
+    llvm::IRBuilderBase::FastMathFlagGuard Guard(*Builder);
+    llvm::FastMathFlags FMF = Builder->getFastMathFlags();
+    FMF.setAllowReassoc();
+    Builder->setFastMathFlags(FMF);
+    if (callee == "hsum")
+    {
+        return Builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(ResultTy), V);
+    } else if (callee == "hprod")
+    {
+        return Builder->CreateFMulReduce(llvm::ConstantFP::get(ResultTy, 1.0), V);
+    } else if (callee == "hmin")
+    {
+        return Builder->CreateFPMinReduce(V);
+    }
+    return Builder->CreateFPMaxReduce(V);
+}
+
+llvm::Value* CallASTNode::codegenOutput() {
+    bool TakesValue = callee == "putc" || callee == "putn";
+    if (args.size() != (TakesValue ? 1u : 0u))
+    {
+        return vLogError("Incorrect number of arguments");
+    }
+    llvm::Module& M = *TheModule;
+    if (callee == "newline")
+    {
+        Builder->CreateCall(declareOutputFunction(M, "__rdlg_putc"), {Builder->getInt32('\n')});
+    } else if (callee == "flush")
+    {
+        Builder->CreateCall(declareOutputFunction(M, "__rdlg_flush"), {});
+    } else
+    {
+        ValueType T = args[0]->exprType;
+        if (T.isVector() || T.isArray())
+        {
+            return vLogError("Expected a scalar argument");
+        }
+        llvm::Value* V = args[0]->codegen();
+        if (!V)
+        {
+            return nullptr;
+        }
+        const char* Name = callee == "putc" ? "__rdlg_putc" : T.isFloat() ? "__rdlg_putf" : "__rdlg_puti";
+        V = convertTo(V, T.isFloat() && callee == "putn" ? ValueType::F64 : ValueType::I64);
+        if (!V)
+        {
+            return nullptr;
+        }
+        emitLocation();
+        if (callee == "putc")
+        {
+            V = Builder->CreateTrunc(V, Builder->getInt32Ty());
+        }
+        Builder->CreateCall(declareOutputFunction(M, Name), {V});
+    }
+    return llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
+}
+
+// Like the operators, literals take the precision of the other arguments, so
+// sqrt(x + 1.0) stays f32 when x is f32.
+ValueType CallASTNode::inferMath() {
+    ValueType T = ValueType::Bool;
+    bool AllLiterals = true;
+    for (auto &arg : args)
+    {
+        if (!dynamic_cast<NumberASTNode*>(arg.get()))
+        {
+            T = joinTypes(T, arg->exprType);
+            AllLiterals = false;
+        }
+    }
+    for (auto &arg : args)
+    {
+        if (AllLiterals || (dynamic_cast<NumberASTNode*>(arg.get()) && !T.isFloat()))
+        {
+            T = joinTypes(T, arg->exprType);
+        }
+    }
+    if (!T.isFloat() && findMath(callee)->Int != llvm::Intrinsic::not_intrinsic)
+    {
+        return ValueType{ScalarType::I64, T.lanes};
+    }
+    return ValueType{T.isFloat() ? T.scalar : ScalarType::F64, T.lanes};
+}
+
+llvm::Value* CallASTNode::codegenMath() {
+    const MathBuiltin* Math = findMath(callee);
+    if (args.size() != Math->Arity)
+    {
+        return vLogError("Incorrect number of arguments");
+    }
+    for (auto &arg : args)
+    {
+        if (arg->exprType.isArray())
+        {
+            return vLogError("Expected a number or a vector argument");
+        }
+    }
+
+    llvm::Type* Ty = llvmType(exprType);
+    std::vector<llvm::Value*> Operands;
+    for (auto &arg : args)
+    {
+        Operands.push_back(convertTo(arg->codegen(), Ty));
+        if (!Operands.back())
+        {
+            return nullptr;
+        }
+    }
+    llvm::Intrinsic::ID ID = exprType.isFloat() ? Math->Float : Math->Int;
+    emitLocation();
+    return Builder->CreateIntrinsic(ID, {Ty}, Operands, nullptr, callee);
+}
+
 
 llvm::Function* PrototypeASTNode::codegen() {
-    std::vector<llvm::Type*> Doubles(args.size(), llvm::Type::getDoubleTy(*TheContext));
+    std::vector<llvm::Type*> ArgTypes;
+    for (unsigned i = 0, e = args.size(); i != e; i++)
+    {
+        ArgTypes.push_back(llvmType(getArgType(i)));
+    }
 
-    llvm::FunctionType* FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
+    llvm::FunctionType* FT = llvm::FunctionType::get(llvmType(returnType), ArgTypes, false);
     llvm::Function* F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, TheModule.get());
 
     unsigned Idx = 0;
     for (auto& Arg : F->args()) {
+        // C and C++ pass bool as a zero extended byte.
+        if (Arg.getType()->isIntegerTy(1))
+        {
+            Arg.addAttr(llvm::Attribute::ZExt);
+        }
         Arg.setName(args[Idx++]);
     }
+    if (returnType == ValueType::Bool)
+    {
+        F->addRetAttr(llvm::Attribute::ZExt);
+    }
+    applyEffects(*F, effects);
 
     return F;
 }
@@ -244,17 +967,74 @@ llvm::Function* FunctionASTNode::codegen() {
     {
         return nullptr;
     }
+
+    inferTypes(P);
+
+    Effects E;
+    E.Self = P.getName();
+    for (auto &expr : body)
+    {
+        expr->collectEffects(E);
+    }
+    const char* Kind = P.getMemo() ? "memo function " : "pure function ";
+    if ((P.isPure() || P.getMemo()) && (E.Flags & ImpureEffects))
+    {
+        TheFunction->eraseFromParent();
+        return (llvm::Function*)vLogError((Kind + P.getName() + " " + E.Reason).c_str());
+    }
+    bool Scalars = !P.getReturnType().isVector() && !P.getReturnType().isArray();
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; i++)
+    {
+        Scalars &= !P.getArgType(i).isVector() && !P.getArgType(i).isArray();
+    }
+    if (P.getMemo() && !Scalars)
+    {
+        TheFunction->eraseFromParent();
+        return (llvm::Function*)vLogError((Kind + P.getName() + " must take and return scalars").c_str());
+    }
+
+    FunctionRegion = nullptr;
+    RegionDepth = 0;
+    BindingDepth.clear();
     
     llvm::BasicBlock* BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
     Builder->SetInsertPoint(BB);
+    std::vector<ValueType> Types = {P.getReturnType()};
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; i++)
+    {
+        Types.push_back(P.getArgType(i));
+    }
+    DebugInfo::beginFunction(*TheFunction, P.getName().empty() ? "__anon_expr" : P.getName(), P.Loc, Types);
+    DebugInfo::setLocation(*Builder, P.Loc);
+
+    // The flags go on every floating point operation of the body, the
+    // attributes tell the backend the same about the whole function.
+    unsigned FastMath = P.getFastMath();
+    llvm::IRBuilderBase::FastMathFlagGuard FastMathGuard(*Builder);
+    Builder->setFastMathFlags(toFastMathFlags(FastMath));
+    const std::pair<unsigned, const char*> FastMathAttributes[] = {{FMNoNaNs, "no-nans-fp-math"}, {FMNoInfs, "no-infs-fp-math"},
+        {FMNoSignedZeros, "no-signed-zeros-fp-math"}, {FMApproxFunc, "approx-func-fp-math"}, {FMAll, "unsafe-fp-math"}};
+    for (auto &[Flags, Attribute] : FastMathAttributes)
+    {
+        if ((FastMath & Flags) == Flags)
+        {
+            TheFunction->addFnAttr(Attribute, "true");
+        }
+    }
 
     NamedValues.clear();
     for(auto& Arg : TheFunction->args()) {
         // NamedValues[std::string(Arg.getName())] = &Arg;// Before Kaleidoscope Chapter 7 only
-        llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+        llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
+        DebugInfo::declareVariable(*Builder, Alloca, Arg.getName(), P.getArgType(Arg.getArgNo()), P.Loc, Arg.getArgNo() + 1);
         Builder->CreateStore(&Arg, Alloca);
         NamedValues[std::string(Arg.getName())] = Alloca;
     }
+    MemoKey Memo{};
+    if (P.getMemo())
+    {
+        Memo = emitMemoLookup(*Builder, *TheFunction, *P.getMemo());
+    }
 
     llvm::Value* lastValue;
     for (auto &expr : body)
@@ -262,15 +1042,44 @@ llvm::Function* FunctionASTNode::codegen() {
         lastValue = expr->codegen();
         if (!lastValue)
         {
+            FunctionRegion = nullptr;
+            DebugInfo::endFunction(*TheFunction);
             TheFunction->eraseFromParent();
             return nullptr;
         }
         
     }
     
-    Builder->CreateRet(lastValue);
+    llvm::Value* RetVal = convertTo(lastValue, TheFunction->getReturnType());
+    if (!RetVal)
+    {
+        FunctionRegion = nullptr;
+        DebugInfo::endFunction(*TheFunction);
+        TheFunction->eraseFromParent();
+        return nullptr;
+    }
+    emitFunctionRegionLeave();
+    if (P.getMemo())
+    {
+        emitMemoStore(*Builder, Memo, RetVal);
+    }
+    Builder->CreateRet(RetVal);
+
+    if (P.getMemo())
+    {
+        applyMemoEffects(*TheFunction, E.Flags);
+        P.setEffects(effectsOf(*TheFunction));
+    } else
+    {
+        P.setEffects(E.Flags);
+        applyEffects(*TheFunction, E.Flags);
+    }
+    DebugInfo::endFunction(*TheFunction);
     llvm::verifyFunction(*TheFunction);
-    TheFPM->run(*TheFunction, *TheFAM);
+    {
+        TimeScope Scope(Phase::Optimize, P.getName());
+        TheFPM->run(*TheFunction, *TheFAM);
+    }
     return TheFunction;
 
     // if(llvm::Value *RetVal = body->codegen()) {
@@ -285,14 +1094,71 @@ llvm::Function* FunctionASTNode::codegen() {
     
 }
 
-llvm::Value* IfExprAST::codegen() {
+void FunctionASTNode::inferTypes(PrototypeASTNode& P) {
+    std::vector<TypeSlot> Params;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; i++)
+    {
+        Params.push_back(TypeSlot{P.getArgType(i), true});
+    }
+
+    // Variables only ever get wider, so this settles after a few rounds.
+    do
+    {
+        TypesChanged = false;
+        NamedTypes.clear();
+        for (unsigned i = 0, e = Params.size(); i != e; i++)
+        {
+            NamedTypes[P.getArgs()[i]] = &Params[i];
+        }
+        for (auto &expr : body)
+        {
+            expr->inferType();
+        }
+    } while (TypesChanged);
+    NamedTypes.clear();
+}
+
+ValueType FunctionASTNode::getReturnType(const std::string& Name) {
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+    {
+        return FI->second->getReturnType();
+    }
+    if (auto *F = TheModule->getFunction(Name))
+    {
+        return fromLLVMType(F->getReturnType());
+    }
+    return ValueType::F64;
+}
+
+llvm::Value* IfExprAST::codegen() {
+    emitLocation();
+    // Literal conditions are left by the folding, only the taken arm is emitted.
+    ConstantEnv Env;
+    Constant C;
+    if (dynamic_cast<NumberASTNode*>(Cond.get()) && Cond->evaluate(Env, C))
+    {
+        auto &Taken = C.value != 0 && !std::isnan(C.value) ? Then : Else;
+        llvm::Value* lastValue = Taken.empty() ? llvm::Constant::getNullValue(llvmType(exprType)) : nullptr;
+        for (auto &expr : Taken)
+        {
+            lastValue = expr->codegen();
+            if (!lastValue)
+            {
+                return nullptr;
+            }
+        }
+        return convertTo(lastValue, llvmType(exprType));
+    }
+
     llvm::Value* CondV = Cond->codegen();
     if (!CondV)
     {
         return nullptr;
     }
 
-    CondV = Builder->CreateFCmpONE(CondV, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "ifcond");
+    CondV = convertTo(CondV, ValueType::Bool);
+    llvm::Type* ResultTy = llvmType(exprType);
 
     llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
 
@@ -300,6 +1166,7 @@ llvm::Value* IfExprAST::codegen() {
     llvm::BasicBlock* ElseBB = llvm::BasicBlock::Create(*TheContext, "else");
     llvm::BasicBlock* MergeBB = llvm::BasicBlock::Create(*TheContext, "ifcont");
 
+    emitLocation();
     Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
     Builder->SetInsertPoint(ThenBB);
@@ -314,6 +1181,7 @@ llvm::Value* IfExprAST::codegen() {
         }
         
     }
+    lastValueThen = convertTo(lastValueThen, ResultTy);
     
     Builder->CreateBr(MergeBB);
 
@@ -331,29 +1199,48 @@ llvm::Value* IfExprAST::codegen() {
             return nullptr;
         } 
     }
+    lastValueElse = convertTo(lastValueElse, ResultTy);
     
     Builder->CreateBr(MergeBB);
     ElseBB = Builder->GetInsertBlock();
 
     TheFunction->insert(TheFunction->end(), MergeBB);
     Builder->SetInsertPoint(MergeBB);
-    llvm::PHINode* PN = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, "iftmp");
+    llvm::PHINode* PN = Builder->CreatePHI(ResultTy, 2, "iftmp");
 
     PN->addIncoming(lastValueThen, ThenBB);
     PN->addIncoming(lastValueElse, ElseBB);
     return PN;
 }
 
+ValueType IfExprAST::inferType() {
+    Cond->inferType();
+    ValueType ThenType = ValueType::F64, ElseType = ValueType::F64;
+    for (auto &expr : Then)
+    {
+        ThenType = expr->inferType();
+    }
+    for (auto &expr : Else)
+    {
+        ElseType = expr->inferType();
+    }
+    return exprType = joinTypes(ThenType, ElseType);
+}
+
 llvm::Value* ForExprAST::codegen() {
+    emitLocation();
     llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
-    llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    llvm::Type* VarTy = llvmType(VarType.type);
+    llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    DebugInfo::declareVariable(*Builder, Alloca, VarName, VarType.type, Loc);
 
-    llvm::Value* StartVal = Start->codegen();
+    llvm::Value* StartVal = convertTo(Start->codegen(), VarTy);
     if (!StartVal)
     {
         return nullptr;
     }
 
+    emitLocation();
     Builder->CreateStore(StartVal, Alloca);
     
     // llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent(); // Before Kaleidoscope Chapter 7 only
@@ -391,15 +1278,18 @@ llvm::Value* ForExprAST::codegen() {
     llvm::Value* StepVal = nullptr;
     if (Step)
     {
-        StepVal = Step->codegen();
+        StepVal = convertTo(Step->codegen(), VarTy);
         if (!StepVal)
         {
             return nullptr;
         }
         
-    } else
+    } else if (VarTy->isFloatingPointTy())
     {
         StepVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
+    } else
+    {
+        StepVal = llvm::ConstantInt::get(VarTy, 1);
     }
     
     //llvm::Value* NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");// Before Kaleidoscope Chapter 7 only
@@ -410,11 +1300,13 @@ llvm::Value* ForExprAST::codegen() {
         return nullptr;
     }
 
+    // The increment and the test belong to the loop header.
+    emitLocation();
     llvm::Value* CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-    llvm::Value* NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    llvm::Value* NextVar = VarTy->isFloatingPointTy() ? Builder->CreateFAdd(CurVar, StepVal, "nextvar") : Builder->CreateAdd(CurVar, StepVal, "nextvar");
     Builder->CreateStore(NextVar, Alloca);
     
-    EndCond = Builder->CreateFCmpONE(EndCond, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "loopcond");
+    EndCond = convertTo(EndCond, ValueType::Bool);
 
     // llvm::BasicBlock* LoopEndBB = Builder->GetInsertBlock(); // Before Kaleidoscope Chapter 7 only
     llvm::BasicBlock* AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
@@ -436,7 +1328,23 @@ llvm::Value* ForExprAST::codegen() {
     return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*TheContext));
 }
 
+ValueType ForExprAST::inferType() {
+    widen(VarType, Start->inferType());
+
+    TypeSlot* OldType = NamedTypes[VarName];
+    NamedTypes[VarName] = &VarType;
+    widen(VarType, Step ? Step->inferType() : ValueType::I64);
+    End->inferType();
+    for (auto &expr : Body)
+    {
+        expr->inferType();
+    }
+    NamedTypes[VarName] = OldType;
+    return exprType = ValueType::F64;
+}
+
 llvm::Value* UnaryExprAst::codegen() {
+    emitLocation();
     llvm::Value* OperandV = Operand->codegen();
     if (!OperandV)
     {
@@ -449,7 +1357,13 @@ llvm::Value* UnaryExprAst::codegen() {
         return vLogError("Unknown unary operator");
     }
     
-    return Builder->CreateCall(F, OperandV, "unop");
+    emitLocation();
+    return Builder->CreateCall(F, convertTo(OperandV, F->getArg(0)->getType()), "unop");
+}
+
+ValueType UnaryExprAst::inferType() {
+    Operand->inferType();
+    return exprType = FunctionASTNode::getReturnType(std::string("unary") + Opcode);
 }
 
 
@@ -474,6 +1388,7 @@ llvm::Function* FunctionASTNode::getFunction(std::string Name) {
 }
 
 llvm::Value* VarAstNode::codegen() {
+    emitLocation();
     std::vector<llvm::AllocaInst*> OldBindings;
 
     llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
@@ -481,21 +1396,24 @@ llvm::Value* VarAstNode::codegen() {
     {
         const std::string& VarName = VarNames[i].first;
         ASTNode* Init = VarNames[i].second.get();
+        llvm::Type* VarTy = llvmType(VarTypes[i].type);
 
         llvm::Value* InitVal;
         if (Init)
         {
-            InitVal = Init->codegen();
+            InitVal = convertTo(Init->codegen(), VarTy);
             if (!InitVal)
             {
                 return nullptr;
             }
             
         } else {
-            InitVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
+            InitVal = llvm::Constant::getNullValue(VarTy);
         }
         
-        llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+        llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+        emitLocation();
+        DebugInfo::declareVariable(*Builder, Alloca, VarName, VarTypes[i].type, Loc);
         Builder->CreateStore(InitVal, Alloca);
 
         OldBindings.push_back(NamedValues[VarName]);
@@ -514,4 +1432,605 @@ llvm::Value* VarAstNode::codegen() {
         NamedValues[VarNames[i].first] = OldBindings[i];
     }
     return BodyVal;
-}
\ No newline at end of file
+}
+
+ValueType VarAstNode::inferType() {
+    std::vector<TypeSlot*> OldBindings;
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        if (ASTNode* Init = VarNames[i].second.get())
+        {
+            widen(VarTypes[i], Init->inferType());
+        }
+        OldBindings.push_back(NamedTypes[VarNames[i].first]);
+        NamedTypes[VarNames[i].first] = &VarTypes[i];
+    }
+
+    ValueType BodyType = Body->inferType();
+
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        NamedTypes[VarNames[i].first] = OldBindings[i];
+    }
+    return exprType = BodyType;
+}
+
+bool ReduceExprAST::isUserOperator() const {
+    return Op != "+" && Op != "*" && Op != "min" && Op != "max";
+}
+
+llvm::Value* ReduceExprAST::identityValue() {
+    llvm::Type* ElemTy = llvmType(exprType);
+    if (Identity)
+    {
+        return convertTo(Identity->codegen(), ElemTy);
+    }
+
+    bool isFloat = ElemTy->isFloatingPointTy();
+    if (Op == "+")
+    {
+        return llvm::Constant::getNullValue(ElemTy);
+    } else if (Op == "*")
+    {
+        return isFloat ? llvm::ConstantFP::get(ElemTy, 1.0) : llvm::ConstantInt::get(ElemTy, 1);
+    } else if (Op == "min")
+    {
+        return isFloat ? llvm::ConstantFP::getInfinity(ElemTy, false) : llvm::ConstantInt::get(ElemTy, INT64_MAX, true);
+    } else if (Op == "max")
+    {
+        return isFloat ? llvm::ConstantFP::getInfinity(ElemTy, true) : llvm::ConstantInt::get(ElemTy, INT64_MIN, true);
+    }
+    return vLogError("user-defined reduction operator needs an identity value");
+}
+
+llvm::Value* ReduceExprAST::combine(llvm::Value* L, llvm::Value* R) {
+    bool isFloat = L->getType()->isFPOrFPVectorTy();
+    if (Op == "+")
+    {
+        return isFloat ? Builder->CreateFAdd(L, R, "redadd") : Builder->CreateAdd(L, R, "redadd");
+    } else if (Op == "*")
+    {
+        return isFloat ? Builder->CreateFMul(L, R, "redmul") : Builder->CreateMul(L, R, "redmul");
+    } else if (Op == "min")
+    {
+        return isFloat ? Builder->CreateMinNum(L, R) : Builder->CreateBinaryIntrinsic(llvm::Intrinsic::smin, L, R);
+    } else if (Op == "max")
+    {
+        return isFloat ? Builder->CreateMaxNum(L, R) : Builder->CreateBinaryIntrinsic(llvm::Intrinsic::smax, L, R);
+    }
+
+    llvm::Function* F = FunctionASTNode::getFunction(std::string("binary") + Op);
+    if (!F)
+    {
+        return vLogError("Unknown reduction operator");
+    }
+    llvm::Value* Ops[2] = {convertTo(L, F->getArg(0)->getType()), convertTo(R, F->getArg(1)->getType())};
+    return convertTo(Builder->CreateCall(F, Ops, "redop"), L->getType());
+}
+
+bool ReduceExprAST::unrollsBody() {
+    if (ASTNode::countNodes(*Body) > MaxUnrolledBodyNodes)
+    {
+        return false;
+    }
+    bool Nested = false;
+    std::function<void(std::unique_ptr<ASTNode>&)> Visit = [&](std::unique_ptr<ASTNode>& Node) {
+        Nested = Nested || dynamic_cast<ReduceExprAST*>(Node.get());
+        Node->forEachChild(Visit);
+    };
+    Visit(Body);
+    return !Nested;
+}
+
+llvm::Value* ReduceExprAST::emitSerial(llvm::Value* StartVal, llvm::Value* EndVal) {
+    llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    llvm::Type* CounterTy = llvmType(VarType.type);
+    llvm::Type* ElemTy = llvmType(exprType);
+    llvm::FixedVectorType* VecTy = llvm::FixedVectorType::get(ElemTy, VectorWidth);
+    bool FloatCounter = CounterTy->isFloatingPointTy();
+    auto counterConstant = [&](unsigned k) -> llvm::Value* {
+        return FloatCounter ? llvm::ConstantFP::get(CounterTy, (double)k) : llvm::ConstantInt::get(CounterTy, k);
+    };
+    auto advance = [&](llvm::Value* I, unsigned k) {
+        return FloatCounter ? Builder->CreateFAdd(I, counterConstant(k)) : Builder->CreateAdd(I, counterConstant(k));
+    };
+    // Builtin operators are combined lane-wise with one vector operation,
+    // user-defined operators get one scalar accumulator per lane.
+    bool Vectorized = !isUserOperator();
+    auto combineReassoc = [&](llvm::Value* L, llvm::Value* R) {
+        llvm::IRBuilderBase::FastMathFlagGuard Guard(*Builder);
+        if (Vectorized && L->getType()->isFPOrFPVectorTy())
+        {
+            llvm::FastMathFlags FMF = Builder->getFastMathFlags();
+            FMF.setAllowReassoc();
+            Builder->setFastMathFlags(FMF);
+        }
+        return combine(L, R);
+    };
+
+    emitLocation();
+    StartVal = convertTo(StartVal, CounterTy);
+    EndVal = convertTo(EndVal, CounterTy);
+    llvm::Value* IdentityVal = identityValue();
+    if (!IdentityVal)
+    {
+        return nullptr;
+    }
+
+    // The body is copied into every lane of the main loop, so only small
+    // bodies without nested reductions are. Others only get the scalar loop,
+    // which keeps the code linear in the size of the source.
+    bool Unrolled = unrollsBody();
+    std::vector<llvm::AllocaInst*> Partials;
+    if (Unrolled && Vectorized)
+    {
+        Partials.push_back(CreateEntryBlockAlloca(TheFunction, "reduce.acc", VecTy));
+        Builder->CreateStore(Builder->CreateVectorSplat(VectorWidth, IdentityVal), Partials[0]);
+    } else if (Unrolled) {
+        for (unsigned k = 0; k != VectorWidth; k++)
+        {
+            Partials.push_back(CreateEntryBlockAlloca(TheFunction, "reduce.acc", ElemTy));
+            Builder->CreateStore(IdentityVal, Partials[k]);
+        }
+    }
+    llvm::AllocaInst* Tail = CreateEntryBlockAlloca(TheFunction, "reduce.tail", ElemTy);
+    Builder->CreateStore(IdentityVal, Tail);
+    llvm::AllocaInst* Counter = CreateEntryBlockAlloca(TheFunction, "reduce.i", CounterTy);
+    Builder->CreateStore(StartVal, Counter);
+    llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName, CounterTy);
+    DebugInfo::declareVariable(*Builder, Alloca, VarName, VarType.type, Loc);
+
+    llvm::AllocaInst* oldVal = NamedValues[VarName];
+    NamedValues[VarName] = Alloca;
+
+    llvm::BasicBlock* TailCondBB = llvm::BasicBlock::Create(*TheContext, "reduce.tcond", TheFunction);
+    llvm::BasicBlock* TailBodyBB = llvm::BasicBlock::Create(*TheContext, "reduce.tbody", TheFunction);
+    llvm::BasicBlock* AfterBB = llvm::BasicBlock::Create(*TheContext, "reduce.end", TheFunction);
+
+    if (Unrolled)
+    {
+        // Main loop: VectorWidth iterations at a time into independent lanes.
+        llvm::BasicBlock* VecCondBB = llvm::BasicBlock::Create(*TheContext, "reduce.vcond", TheFunction, TailCondBB);
+        llvm::BasicBlock* VecBodyBB = llvm::BasicBlock::Create(*TheContext, "reduce.vbody", TheFunction, TailCondBB);
+        Builder->CreateBr(VecCondBB);
+        Builder->SetInsertPoint(VecCondBB);
+        llvm::Value* I = Builder->CreateLoad(CounterTy, Counter, "i");
+        llvm::Value* Next = advance(I, VectorWidth);
+        llvm::Value* VecCond = FloatCounter ? Builder->CreateFCmpOLE(Next, EndVal, "veccond") : Builder->CreateICmpSLE(Next, EndVal, "veccond");
+        Builder->CreateCondBr(VecCond, VecBodyBB, TailCondBB);
+
+        Builder->SetInsertPoint(VecBodyBB);
+        llvm::Value* Lanes = llvm::PoisonValue::get(VecTy);
+        for (unsigned k = 0; k != VectorWidth; k++)
+        {
+            Builder->CreateStore(k == 0 ? I : advance(I, k), Alloca);
+            llvm::Value* V = convertTo(Body->codegen(), ElemTy);
+            if (!V)
+            {
+                return nullptr;
+            }
+
+            emitLocation();
+            if (Vectorized)
+            {
+                Lanes = Builder->CreateInsertElement(Lanes, V, (uint64_t)k);
+            } else {
+                llvm::Value* Acc = combine(Builder->CreateLoad(ElemTy, Partials[k]), V);
+                if (!Acc)
+                {
+                    return nullptr;
+                }
+                Builder->CreateStore(Acc, Partials[k]);
+            }
+        }
+        if (Vectorized)
+        {
+            Builder->CreateStore(combineReassoc(Builder->CreateLoad(VecTy, Partials[0]), Lanes), Partials[0]);
+        }
+        Builder->CreateStore(Next, Counter);
+        Builder->CreateBr(VecCondBB);
+    } else {
+        Builder->CreateBr(TailCondBB);
+    }
+
+    // Scalar loop for the last (end - start) % VectorWidth iterations, or all
+    // of them if the body isn't unrolled. Builtin operators may reassociate,
+    // which lets the loop vectorizer of -O2 widen it.
+    Builder->SetInsertPoint(TailCondBB);
+    llvm::Value* I = Builder->CreateLoad(CounterTy, Counter, "i");
+    llvm::Value* TailCond = FloatCounter ? Builder->CreateFCmpOLT(I, EndVal, "tailcond") : Builder->CreateICmpSLT(I, EndVal, "tailcond");
+    Builder->CreateCondBr(TailCond, TailBodyBB, AfterBB);
+
+    Builder->SetInsertPoint(TailBodyBB);
+    Builder->CreateStore(I, Alloca);
+    llvm::Value* V = convertTo(Body->codegen(), ElemTy);
+    if (!V)
+    {
+        return nullptr;
+    }
+    emitLocation();
+    llvm::Value* TailAcc = combineReassoc(Builder->CreateLoad(ElemTy, Tail), V);
+    if (!TailAcc)
+    {
+        return nullptr;
+    }
+    Builder->CreateStore(TailAcc, Tail);
+    Builder->CreateStore(advance(I, 1), Counter);
+    Builder->CreateBr(TailCondBB);
+
+    Builder->SetInsertPoint(AfterBB);
+    if (oldVal)
+    {
+        NamedValues[VarName] = oldVal;
+    } else
+    {
+        NamedValues.erase(VarName);
+    }
+
+    llvm::Value* TailVal = Builder->CreateLoad(ElemTy, Tail);
+    if (!Unrolled)
+    {
+        return TailVal;
+    }
+    if (Vectorized)
+    {
+        // The reassociation contract allows a tree shaped horizontal reduction.
+        llvm::IRBuilderBase::FastMathFlagGuard Guard(*Builder);
+        llvm::FastMathFlags FMF = Builder->getFastMathFlags();
+        FMF.setAllowReassoc();
+        Builder->setFastMathFlags(FMF);
+
+        llvm::Value* Acc = Builder->CreateLoad(VecTy, Partials[0]);
+        bool isFloat = ElemTy->isFloatingPointTy();
+        if (Op == "+")
+        {
+            return isFloat ? Builder->CreateFAddReduce(TailVal, Acc) : combine(Builder->CreateAddReduce(Acc), TailVal);
+        } else if (Op == "*")
+        {
+            return isFloat ? Builder->CreateFMulReduce(TailVal, Acc) : combine(Builder->CreateMulReduce(Acc), TailVal);
+        } else if (Op == "min")
+        {
+            return combine(isFloat ? Builder->CreateFPMinReduce(Acc) : Builder->CreateIntMinReduce(Acc, true), TailVal);
+        }
+        return combine(isFloat ? Builder->CreateFPMaxReduce(Acc) : Builder->CreateIntMaxReduce(Acc, true), TailVal);
+    }
+
+    // Pairwise tree over the lanes, then the tail.
+    std::vector<llvm::Value*> Level;
+    for (unsigned k = 0; k != VectorWidth; k++)
+    {
+        Level.push_back(Builder->CreateLoad(ElemTy, Partials[k]));
+    }
+    while (Level.size() > 1)
+    {
+        std::vector<llvm::Value*> Combined;
+        for (size_t k = 0; k + 1 < Level.size(); k += 2)
+        {
+            Combined.push_back(combine(Level[k], Level[k + 1]));
+            if (!Combined.back())
+            {
+                return nullptr;
+            }
+        }
+        if (Level.size() % 2)
+        {
+            Combined.push_back(Level.back());
+        }
+        Level = std::move(Combined);
+    }
+    return combine(Level[0], TailVal);
+}
+
+llvm::Function* ReduceExprAST::emitCombineFunction() {
+    std::string Name = "reduce.combine.";
+    Name += (Op == "+") ? "add" : (Op == "*") ? "mul" : Op;
+    if (llvm::Function* F = TheModule->getFunction(Name))
+    {
+        return F;
+    }
+
+    llvm::Type* DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+    llvm::FunctionType* FT = llvm::FunctionType::get(DoubleTy, {DoubleTy, DoubleTy}, false);
+    llvm::Function* F = llvm::Function::Create(FT, llvm::Function::InternalLinkage, Name, TheModule.get());
+
+    llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+    Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", F));
+    Builder->SetCurrentDebugLocation(llvm::DebugLoc()); // shared by all reductions, it has no place in the source
+    Builder->CreateRet(combine(F->getArg(0), F->getArg(1)));
+    return F;
+}
+
+llvm::Value* ReduceExprAST::emitParallel(llvm::Value* StartVal, llvm::Value* EndVal) {
+    llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
+    llvm::Type* DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+    llvm::Type* PtrTy = llvm::PointerType::getUnqual(*TheContext);
+
+    // The body may use any variable in scope, so all of them are copied into
+    // an environment that the outlined chunk function reads them back from.
+    // Assignments would only change the copy of one chunk and get lost.
+    std::vector<std::pair<std::string, llvm::AllocaInst*>> Captures;
+    std::vector<llvm::Type*> CaptureTypes;
+    for (auto &Named : NamedValues)
+    {
+        if (Named.second && Named.first != VarName)
+        {
+            if (Body->assigns(Named.first))
+            {
+                return vLogError(("parallel reduce can't assign to the variable " + Named.first + " of the enclosing scope").c_str());
+            }
+            Captures.push_back(Named);
+            CaptureTypes.push_back(Named.second->getAllocatedType());
+        }
+    }
+    llvm::StructType* EnvTy = llvm::StructType::get(*TheContext, CaptureTypes);
+    llvm::AllocaInst* Env = CreateEntryBlockAlloca(TheFunction, "reduce.env", EnvTy);
+    for (unsigned i = 0, e = Captures.size(); i != e; i++)
+    {
+        llvm::Value* V = Builder->CreateLoad(CaptureTypes[i], Captures[i].second, Captures[i].first);
+        Builder->CreateStore(V, Builder->CreateStructGEP(EnvTy, Env, i));
+    }
+
+    llvm::Value* IdentityVal = identityValue();
+    if (!IdentityVal)
+    {
+        return nullptr;
+    }
+    llvm::Function* CombineF = isUserOperator() ? FunctionASTNode::getFunction(std::string("binary") + Op) : emitCombineFunction();
+    if (!CombineF)
+    {
+        return vLogError("Unknown reduction operator");
+    }
+    if (CombineF->getFunctionType() != llvm::FunctionType::get(DoubleTy, {DoubleTy, DoubleTy}, false))
+    {
+        return vLogError("parallel reductions need an operator on f64 values");
+    }
+
+    llvm::FunctionType* ChunkTy = llvm::FunctionType::get(DoubleTy, {PtrTy, DoubleTy, DoubleTy}, false);
+    // Named after the enclosing function, so optimization remarks can name that one.
+    llvm::Function* ChunkF = llvm::Function::Create(ChunkTy, llvm::Function::InternalLinkage, TheFunction->getName() + ".reduce.chunk",
+        TheModule.get());
+    DebugInfo::beginFunction(*ChunkF, ChunkF->getName(), Loc, {});
+    {
+        llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+        std::map<std::string, llvm::AllocaInst*> OuterValues = std::move(NamedValues);
+        NamedValues.clear();
+        // Chunks run on other threads, so they get regions of their own.
+        llvm::CallInst* OuterRegion = FunctionRegion;
+        unsigned OuterDepth = RegionDepth;
+        FunctionRegion = nullptr;
+        RegionDepth = 0;
+
+        Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", ChunkF));
+        emitLocation();
+        for (unsigned i = 0, e = Captures.size(); i != e; i++)
+        {
+            llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(ChunkF, Captures[i].first, CaptureTypes[i]);
+            DebugInfo::declareVariable(*Builder, Alloca, Captures[i].first, fromLLVMType(CaptureTypes[i]), Loc);
+            llvm::Value* V = Builder->CreateLoad(CaptureTypes[i], Builder->CreateStructGEP(EnvTy, ChunkF->getArg(0), i));
+            Builder->CreateStore(V, Alloca);
+            NamedValues[Captures[i].first] = Alloca;
+        }
+
+        llvm::Value* Partial = emitSerial(ChunkF->getArg(1), ChunkF->getArg(2));
+        NamedValues = std::move(OuterValues);
+        if (!Partial)
+        {
+            FunctionRegion = OuterRegion;
+            RegionDepth = OuterDepth;
+            ChunkF->eraseFromParent();
+            return nullptr;
+        }
+        emitFunctionRegionLeave();
+        FunctionRegion = OuterRegion;
+        RegionDepth = OuterDepth;
+        Builder->CreateRet(Partial);
+        DebugInfo::endFunction(*ChunkF);
+        llvm::verifyFunction(*ChunkF);
+        TimeScope Scope(Phase::Optimize, ChunkF->getName());
+        TheFPM->run(*ChunkF, *TheFAM);
+    }
+
+    llvm::FunctionType* RuntimeTy = llvm::FunctionType::get(DoubleTy, {PtrTy, PtrTy, DoubleTy, DoubleTy, DoubleTy, PtrTy}, false);
+    llvm::FunctionCallee Runtime = TheModule->getOrInsertFunction("__rdlg_parallel_reduce", RuntimeTy);
+    emitLocation();
+    return Builder->CreateCall(Runtime, {ChunkF, Env, convertTo(StartVal, DoubleTy), convertTo(EndVal, DoubleTy), IdentityVal, CombineF}, "preduce");
+}
+
+llvm::Value* ReduceExprAST::codegen() {
+    emitLocation();
+    if (exprType.isVector())
+    {
+        return vLogError("reduce needs a scalar body, use hsum/hmin/hmax on vectors");
+    }
+
+    llvm::Value* StartVal = Start->codegen();
+    if (!StartVal)
+    {
+        return nullptr;
+    }
+
+    llvm::Value* EndVal = End->codegen();
+    if (!EndVal)
+    {
+        return nullptr;
+    }
+
+    if (Parallel)
+    {
+        return emitParallel(StartVal, EndVal);
+    }
+    return emitSerial(StartVal, EndVal);
+}
+
+ValueType ReduceExprAST::inferType() {
+    ValueType StartType = Start->inferType();
+    ValueType EndType = End->inferType();
+    ValueType IdentityType = Identity ? Identity->inferType() : ValueType::Bool;
+
+    // The counter follows the bounds, the body can't widen it.
+    VarType.type = Parallel ? ValueType::F64 : arithmeticType(StartType, EndType);
+    VarType.annotated = true;
+
+    TypeSlot* OldType = NamedTypes[VarName];
+    NamedTypes[VarName] = &VarType;
+    ValueType BodyType = Body->inferType();
+    NamedTypes[VarName] = OldType;
+
+    if (Parallel || isUserOperator())
+    {
+        return exprType = ValueType::F64;
+    }
+    return exprType = arithmeticType(BodyType, IdentityType);
+}
+
+llvm::Value* IndexExprAST::elementPointer(llvm::Value* Array, llvm::Value* Idx) {
+    llvm::Value* Data = Builder->CreateExtractValue(Array, 0, "data");
+    return Builder->CreateInBoundsGEP(llvm::Type::getDoubleTy(*TheContext), Data, Idx, "elem");
+}
+
+llvm::Value* IndexExprAST::codegen() {
+    emitLocation();
+    llvm::Value* B = Base->codegen();
+    llvm::Value* Idx = convertTo(Index->codegen(), ValueType::I64);
+    if (!B || !Idx)
+    {
+        return nullptr;
+    }
+    emitLocation();
+
+    if (SliceEnd)
+    {
+        // A slice shares the storage of the array it was taken from.
+        if (!B->getType()->isStructTy())
+        {
+            return vLogError("Only arrays can be sliced");
+        }
+        llvm::Value* Hi = convertTo(SliceEnd->codegen(), ValueType::I64);
+        if (!Hi)
+        {
+            return nullptr;
+        }
+        emitLocation();
+        // Reversed bounds would give a negative length and ones past the end reach
+        // into other arrays. Compared unsigned, negative bounds fail as well.
+        llvm::Value* Len = Builder->CreateExtractValue(B, 1, "len");
+        llvm::Value* InBounds = Builder->CreateAnd(Builder->CreateICmpULE(Idx, Hi), Builder->CreateICmpULE(Hi, Len), "inbounds");
+        llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
+        llvm::BasicBlock* TrapBB = llvm::BasicBlock::Create(*TheContext, "slice.trap", TheFunction);
+        llvm::BasicBlock* SliceBB = llvm::BasicBlock::Create(*TheContext, "slice", TheFunction);
+        Builder->CreateCondBr(InBounds, SliceBB, TrapBB);
+        Builder->SetInsertPoint(TrapBB);
+        Builder->CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+        Builder->CreateUnreachable();
+        Builder->SetInsertPoint(SliceBB);
+        return makeArray(elementPointer(B, Idx), Builder->CreateSub(Hi, Idx, "slicelen"));
+    }
+
+    if (B->getType()->isVectorTy())
+    {
+        return Builder->CreateExtractElement(B, Idx, "lane");
+    } else if (B->getType()->isStructTy())
+    {
+        return Builder->CreateLoad(llvm::Type::getDoubleTy(*TheContext), elementPointer(B, Idx), "elemval");
+    }
+    return vLogError("Only arrays and vectors can be indexed");
+}
+
+llvm::Value* IndexExprAST::codegenStore(llvm::Value* Val) {
+    if (!Val || SliceEnd)
+    {
+        return SliceEnd ? vLogError("Can't assign to a slice") : nullptr;
+    }
+
+    if (Base->exprType.isVector())
+    {
+        // Vectors are values, so the lane is replaced in the variable holding it.
+        VariableASTNode* BaseVar = dynamic_cast<VariableASTNode*>(Base.get());
+        llvm::AllocaInst* Variable = BaseVar ? NamedValues[BaseVar->getName()] : nullptr;
+        if (!Variable)
+        {
+            return vLogError("Only vector variables can have lanes assigned");
+        }
+        llvm::Value* Idx = convertTo(Index->codegen(), ValueType::I64);
+        Val = convertTo(Val, exprType);
+        if (!Idx || !Val)
+        {
+            return nullptr;
+        }
+        emitLocation();
+        llvm::Value* V = Builder->CreateLoad(Variable->getAllocatedType(), Variable, BaseVar->getName());
+        Builder->CreateStore(Builder->CreateInsertElement(V, Val, Idx, "withlane"), Variable);
+        return Val;
+    }
+
+    VariableASTNode* BaseVar = dynamic_cast<VariableASTNode*>(Base.get());
+    if (BaseVar && !NamedValues[BaseVar->getName()] && ConstArrays.count(BaseVar->getName()))
+    {
+        return vLogError("const arrays are read-only");
+    }
+
+    llvm::Value* B = Base->codegen();
+    llvm::Value* Idx = convertTo(Index->codegen(), ValueType::I64);
+    Val = convertTo(Val, ValueType::F64);
+    if (!B || !Idx || !Val)
+    {
+        return nullptr;
+    }
+    if (!B->getType()->isStructTy())
+    {
+        return vLogError("Only arrays and vectors can be indexed");
+    }
+    emitLocation();
+    Builder->CreateStore(Val, elementPointer(B, Idx));
+    return Val;
+}
+
+ValueType IndexExprAST::inferType() {
+    ValueType BaseType = Base->inferType();
+    Index->inferType();
+    if (SliceEnd)
+    {
+        SliceEnd->inferType();
+        return exprType = ValueType::Array;
+    }
+    return exprType = BaseType.isVector() ? BaseType.element() : ValueType::F64;
+}
+
+llvm::Value* RegionExprAST::codegen() {
+    llvm::Type* PtrTy = llvm::PointerType::getUnqual(*TheContext);
+    llvm::FunctionCallee Enter = TheModule->getOrInsertFunction("__rdlg_region_enter", llvm::FunctionType::get(PtrTy, false));
+    llvm::FunctionCallee Leave = TheModule->getOrInsertFunction("__rdlg_region_leave", llvm::Type::getVoidTy(*TheContext), PtrTy);
+
+    emitLocation();
+    llvm::Value* Mark = Builder->CreateCall(Enter, {}, "region");
+    RegionDepth++;
+    llvm::Value* Last = nullptr;
+    for (auto &expr : Body)
+    {
+        Last = expr->codegen();
+        if (!Last)
+        {
+            RegionDepth--;
+            return nullptr;
+        }
+    }
+    RegionDepth--;
+
+    if (!Last)
+    {
+        return vLogError("Empty region");
+    } else if (Last->getType()->isStructTy())
+    {
+        return vLogError("Arrays can't outlive the region they were allocated in");
+    }
+    Builder->CreateCall(Leave, {Mark});
+    return Last;
+}
+
+ValueType RegionExprAST::inferType() {
+    for (auto &expr : Body)
+    {
+        exprType = expr->inferType();
+    }
+    return exprType;
+}
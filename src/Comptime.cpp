@@ -0,0 +1,460 @@
+#include "../include/Comptime.h"
+#include "../include/Timing.h"
+#include "../runtime/rdlg_runtime.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include <iostream>
+#include <mutex>
+#include <set>
+
+thread_local unsigned ComptimeEvaluator::Counter = 0;
+bool ComptimeEvaluator::PerfSupport = false;
+
+namespace {
+
+// The evaluated code reports its value through one of these, on the thread
+// that runs the evaluation.
+thread_local ComptimeValue* CurrentResult = nullptr;
+thread_local bool ResultReported = false;
+thread_local std::string ResultError; // why the reported value can't be used
+
+void reportBool(int64_t V) {
+    *CurrentResult = ComptimeValue{ValueType::Bool, (double)(V != 0), {}};
+    ResultReported = true;
+}
+
+// Values are kept as doubles like i64 literals, the constant folder also
+// stops at 2^53.
+void reportI64(int64_t V) {
+    constexpr int64_t MaxExact = int64_t(1) << 53;
+    if (V > MaxExact || V < -MaxExact)
+    {
+        ResultError = "the i64 result " + std::to_string(V) + " is too large to be represented exactly";
+    }
+    *CurrentResult = ComptimeValue{ValueType::I64, (double)V, {}};
+    ResultReported = true;
+}
+
+void reportF64(double V) {
+    *CurrentResult = ComptimeValue{ValueType::F64, V, {}};
+    ResultReported = true;
+}
+
+void reportArray(double* Data, int64_t Length) {
+    *CurrentResult = ComptimeValue{ValueType::Array, 0, std::vector<double>(Data, Data + std::max<int64_t>(Length, 0))};
+    ResultReported = true;
+}
+
+// Functions of the compiler itself that the evaluated code may call. Their
+// addresses are put straight into the IR, so they don't have to be exported.
+struct HostFunction {
+    const char* Name;
+    void* Address;
+};
+
+const HostFunction HostFunctions[] = {
+    {"__rdlg_comptime_bool", (void*)&reportBool},
+    {"__rdlg_comptime_i64", (void*)&reportI64},
+    {"__rdlg_comptime_f64", (void*)&reportF64},
+    {"__rdlg_comptime_array", (void*)&reportArray},
+    {"__rdlg_region_enter", (void*)&__rdlg_region_enter},
+    {"__rdlg_region_leave", (void*)&__rdlg_region_leave},
+    {"__rdlg_region_alloc", (void*)&__rdlg_region_alloc},
+    {"__rdlg_parallel_reduce", (void*)&__rdlg_parallel_reduce},
+    {"__rdlg_putc", (void*)&__rdlg_putc},
+    {"__rdlg_write", (void*)&__rdlg_write},
+    {"__rdlg_puti", (void*)&__rdlg_puti},
+    {"__rdlg_putf", (void*)&__rdlg_putf},
+    {"__rdlg_flush", (void*)&__rdlg_flush},
+    {"__rdlg_memo_lookup", (void*)&__rdlg_memo_lookup},
+    {"__rdlg_memo_store", (void*)&__rdlg_memo_store},
+};
+
+bool comptimeError(const std::string& Message) {
+    std::cout << "Comptime error: " << Message << std::endl;
+    return false;
+}
+
+// Wraps the last expression of a comptime block and hands its value to the
+// matching report function.
+class ComptimeResultAST : public ASTNode {
+    private:
+        std::unique_ptr<ASTNode> Value;
+
+    public:
+        ComptimeResultAST(std::unique_ptr<ASTNode> Value) : Value(std::move(Value)) {}
+
+        llvm::Value* codegen() override {
+            llvm::Value* V = Value->codegen();
+            if (!V)
+            {
+                return nullptr;
+            }
+
+            const char* Report;
+            std::vector<llvm::Value*> Args;
+            if (V->getType()->isStructTy())
+            {
+                Report = "__rdlg_comptime_array";
+                Args = {Builder->CreateExtractValue(V, 0), Builder->CreateExtractValue(V, 1)};
+            } else if (V->getType()->isIntegerTy())
+            {
+                Report = V->getType()->isIntegerTy(1) ? "__rdlg_comptime_bool" : "__rdlg_comptime_i64";
+                Args = {convertTo(V, ValueType::I64)};
+            } else if (V->getType()->isDoubleTy())
+            {
+                Report = "__rdlg_comptime_f64";
+                Args = {V};
+            } else
+            {
+                return vLogError("comptime values must be bool, i64, f64 or f64[]");
+            }
+
+            std::vector<llvm::Type*> ArgTypes;
+            for (auto* Arg : Args)
+            {
+                ArgTypes.push_back(Arg->getType());
+            }
+            llvm::FunctionType* ReportTy = llvm::FunctionType::get(llvm::Type::getVoidTy(*TheContext), ArgTypes, false);
+            Builder->CreateCall(TheModule->getOrInsertFunction(Report, ReportTy), Args);
+            return llvm::ConstantFP::get(llvm::Type::getDoubleTy(*TheContext), 0.0);
+        }
+
+        ValueType inferType() override {
+            Value->inferType();
+            return exprType = ValueType::F64;
+        }
+
+        void forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) override {
+            F(Value);
+        }
+};
+
+// Copies the module into a context of its own, the JIT takes ownership of both.
+std::unique_ptr<llvm::Module> snapshotModule(llvm::LLVMContext& Ctx) {
+    llvm::SmallVector<char, 0> Buffer;
+    llvm::raw_svector_ostream OS(Buffer);
+    llvm::WriteBitcodeToFile(*ASTNode::TheModule, OS);
+
+    auto M = llvm::parseBitcodeFile(llvm::MemoryBufferRef(llvm::StringRef(Buffer.data(), Buffer.size()), "comptime"), Ctx);
+    if (!M)
+    {
+        comptimeError(llvm::toString(M.takeError()));
+        return nullptr;
+    }
+    return std::move(*M);
+}
+
+// Drops everything Entry doesn't reach, so unrelated externs don't have to
+// resolve in the compiler process.
+void keepReachable(llvm::Module& M, llvm::Function* Entry) {
+    std::set<llvm::Function*> Reachable;
+    std::vector<llvm::Function*> Worklist{Entry};
+    while (!Worklist.empty())
+    {
+        llvm::Function* F = Worklist.back();
+        Worklist.pop_back();
+        if (!Reachable.insert(F).second)
+        {
+            continue;
+        }
+        for (auto &I : llvm::instructions(*F))
+        {
+            for (auto &Op : I.operands())
+            {
+                if (auto* Callee = llvm::dyn_cast<llvm::Function>(Op->stripPointerCasts()))
+                {
+                    Worklist.push_back(Callee);
+                }
+            }
+        }
+    }
+
+    for (auto &F : M)
+    {
+        if (!Reachable.count(&F))
+        {
+            F.deleteBody();
+        }
+    }
+    for (auto &F : llvm::make_early_inc_range(M))
+    {
+        if (F.isDeclaration() && F.use_empty())
+        {
+            F.eraseFromParent();
+        }
+    }
+
+    for (auto &Host : HostFunctions)
+    {
+        if (llvm::Function* Decl = M.getFunction(Host.Name))
+        {
+            llvm::Constant* Address = llvm::ConstantInt::get(llvm::Type::getInt64Ty(M.getContext()), (uint64_t)(uintptr_t)Host.Address);
+            Decl->replaceAllUsesWith(llvm::ConstantExpr::getIntToPtr(Address, Decl->getType()));
+            Decl->eraseFromParent();
+        }
+    }
+}
+
+// Removes the evaluation function and whatever only it used from TheModule.
+// Cached analyses go first, a later function may get the same address.
+void discardFunction(llvm::Function* F) {
+    FunctionASTNode::FunctionProtos.erase(std::string(F->getName()));
+    ASTNode::TheFAM->clear(*F, F->getName());
+    F->eraseFromParent();
+
+    bool Erased = true;
+    while (Erased)
+    {
+        Erased = false;
+        for (auto &G : llvm::make_early_inc_range(*ASTNode::TheModule))
+        {
+            if (G.use_empty() && (G.hasLocalLinkage() || G.getName().starts_with("__rdlg_comptime_")))
+            {
+                ASTNode::TheFAM->clear(G, G.getName());
+                G.eraseFromParent();
+                Erased = true;
+            }
+        }
+    }
+}
+
+// Appends the functions of every object the JIT loads to /tmp/perf-<pid>.map,
+// which perf reads without perf inject. Shared by the threads of -j.
+class PerfMapListener : public llvm::JITEventListener {
+    private:
+        std::mutex Mutex;
+        std::unique_ptr<llvm::raw_fd_ostream> Map;
+
+    public:
+        void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile& Obj, const llvm::RuntimeDyld::LoadedObjectInfo& L) override {
+            // The copy for debuggers has the symbols at their final addresses.
+            llvm::object::OwningBinary<llvm::object::ObjectFile> Loaded = L.getObjectForDebug(Obj);
+            if (!Loaded.getBinary())
+            {
+                return;
+            }
+            std::lock_guard<std::mutex> Lock(Mutex);
+            if (!Map)
+            {
+                std::error_code EC;
+                std::string Path = "/tmp/perf-" + std::to_string(llvm::sys::Process::getProcessId()) + ".map";
+                Map = std::make_unique<llvm::raw_fd_ostream>(Path, EC, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+                if (EC)
+                {
+                    std::cerr << "could not open " << Path << ": " << EC.message() << std::endl;
+                    Map.reset();
+                    return;
+                }
+            }
+            for (auto &[Symbol, Size] : llvm::object::computeSymbolSizes(*Loaded.getBinary()))
+            {
+                auto Type = Symbol.getType();
+                auto Name = Symbol.getName();
+                auto Address = Symbol.getAddress();
+                if (!Type || !Name || !Address || *Type != llvm::object::SymbolRef::ST_Function || !Size)
+                {
+                    llvm::consumeError(Type.takeError());
+                    llvm::consumeError(Name.takeError());
+                    llvm::consumeError(Address.takeError());
+                    continue;
+                }
+                *Map << llvm::format_hex_no_prefix(*Address, 1) << " " << llvm::format_hex_no_prefix(Size, 1) << " " << *Name << "\n";
+            }
+            Map->flush();
+        }
+};
+
+// With --perf-jit the objects are linked by RuntimeDyld rather than JITLink,
+// its event listeners are where LLVM's jitdump writer plugs in. The jitdump
+// also carries the line table when the code has debug info.
+llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> createPerfObjectLayer(llvm::orc::ExecutionSession& ES) {
+    static PerfMapListener PerfMap;
+    auto Layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(ES, [](const llvm::MemoryBuffer&) {
+        return std::make_unique<llvm::SectionMemoryManager>();
+    });
+    Layer->registerJITEventListener(PerfMap);
+    if (llvm::JITEventListener* JITDump = llvm::JITEventListener::createPerfJITEventListener())
+    {
+        Layer->registerJITEventListener(*JITDump);
+    }
+    return std::move(Layer);
+}
+
+bool run(std::unique_ptr<llvm::Module> M, std::unique_ptr<llvm::LLVMContext> Ctx, const std::string& Name, ComptimeValue& Result) {
+    static const bool TargetInitialized = [] {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        return true;
+    }();
+    (void)TargetInitialized;
+
+    TimeScope Scope(Phase::Comptime, Name);
+    llvm::orc::LLJITBuilder Builder;
+    if (ComptimeEvaluator::PerfSupport)
+    {
+        Builder.setObjectLinkingLayerCreator(createPerfObjectLayer);
+    }
+    auto J = Builder.create();
+    if (!J)
+    {
+        return comptimeError(llvm::toString(J.takeError()));
+    }
+    auto ProcessSymbols = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*J)->getDataLayout().getGlobalPrefix());
+    if (!ProcessSymbols)
+    {
+        return comptimeError(llvm::toString(ProcessSymbols.takeError()));
+    }
+    (*J)->getMainJITDylib().addGenerator(std::move(*ProcessSymbols));
+
+    // The tables of memo functions are kept by the runtime of the compiler,
+    // their rdlg_memo goes away with the JIT. Exported so they can be found
+    // and released again.
+    std::vector<std::string> Memos;
+    for (auto &G : M->globals())
+    {
+        if (G.getName().ends_with(".memo"))
+        {
+            G.setLinkage(llvm::GlobalValue::ExternalLinkage);
+            Memos.push_back(G.getName().str());
+        }
+    }
+
+    if (auto Err = (*J)->addIRModule(llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx))))
+    {
+        return comptimeError(llvm::toString(std::move(Err)));
+    }
+    auto Entry = (*J)->lookup(Name);
+    if (!Entry)
+    {
+        return comptimeError(llvm::toString(Entry.takeError()));
+    }
+
+    CurrentResult = &Result;
+    ResultReported = false;
+    ResultError.clear();
+    Entry->toPtr<double (*)()>()();
+    CurrentResult = nullptr;
+    for (auto &Memo : Memos)
+    {
+        if (auto Address = (*J)->lookup(Memo))
+        {
+            __rdlg_memo_release(Address->toPtr<rdlg_memo*>());
+        } else
+        {
+            llvm::consumeError(Address.takeError());
+        }
+    }
+    if (!ResultError.empty())
+    {
+        return comptimeError(ResultError);
+    }
+    return ResultReported || comptimeError("the block didn't produce a value");
+}
+
+} // namespace
+
+bool ComptimeEvaluator::enablePerfSupport() {
+    PerfSupport = true;
+    return llvm::JITEventListener::createPerfJITEventListener() != nullptr;
+}
+
+bool ComptimeEvaluator::evaluate(std::vector<std::unique_ptr<ASTNode>> Body, ComptimeValue& Result) {
+    std::string Name = "__comptime" + std::to_string(Counter++);
+    FunctionASTNode Fn(std::make_unique<PrototypeASTNode>(Name, std::vector<std::string>()), std::move(Body));
+    Fn.foldConstants();
+
+    auto &Exprs = Fn.getBody();
+    if (Exprs.empty())
+    {
+        return comptimeError("empty comptime block");
+    }
+    // Nothing to run if folding already found the value.
+    ConstantEnv Env;
+    Constant Folded;
+    if (Exprs.size() == 1 && dynamic_cast<NumberASTNode*>(Exprs[0].get()) && Exprs[0]->evaluate(Env, Folded))
+    {
+        Result = ComptimeValue{Folded.type, Folded.value, {}};
+        return true;
+    }
+    Exprs.back() = std::make_unique<ComptimeResultAST>(std::move(Exprs.back()));
+
+    llvm::Function* F = Fn.codegen();
+    if (!F)
+    {
+        FunctionASTNode::FunctionProtos.erase(Name);
+        return comptimeError("could not generate code");
+    }
+
+    auto Ctx = std::make_unique<llvm::LLVMContext>();
+    std::unique_ptr<llvm::Module> M = snapshotModule(*Ctx);
+    discardFunction(F);
+    if (!M)
+    {
+        return false;
+    }
+    keepReachable(*M, M->getFunction(Name));
+    return run(std::move(M), std::move(Ctx), Name, Result);
+}
+
+bool ComptimeEvaluator::define(const std::string& Name, const ComptimeValue& Value) {
+    if (ASTNode::TheModule->getNamedValue(Name) || ASTNode::ConstValues.count(Name) || ASTNode::ConstArrays.count(Name))
+    {
+        return comptimeError("redefinition of " + Name);
+    }
+
+    llvm::LLVMContext& Ctx = *ASTNode::TheContext;
+    llvm::Constant* Init;
+    if (Value.type.isArray())
+    {
+        Init = llvm::ConstantDataArray::get(Ctx, llvm::ArrayRef<double>(Value.elements));
+    } else if (Value.type == ValueType::F64)
+    {
+        Init = llvm::ConstantFP::get(llvm::Type::getDoubleTy(Ctx), Value.value);
+    } else
+    {
+        // bool is stored as a byte, like C does.
+        llvm::Type* Ty = Value.type == ValueType::Bool ? llvm::Type::getInt8Ty(Ctx) : llvm::Type::getInt64Ty(Ctx);
+        Init = llvm::ConstantInt::get(Ty, (int64_t)Value.value, true);
+    }
+
+    auto* GV = new llvm::GlobalVariable(*ASTNode::TheModule, Init->getType(), true, llvm::GlobalValue::ExternalLinkage, Init, Name);
+    if (Value.type.isArray())
+    {
+        GV->setAlignment(llvm::Align(64));
+        ASTNode::ConstArrays[Name] = GV;
+    } else
+    {
+        ASTNode::ConstValues[Name] = Constant{Value.type, Value.value};
+    }
+    return true;
+}
+
+std::unique_ptr<ASTNode> ComptimeEvaluator::embed(const ComptimeValue& Value, std::string Name) {
+    if (!Value.type.isArray())
+    {
+        return std::make_unique<NumberASTNode>(Value.value, Value.type);
+    }
+
+    if (Name.empty())
+    {
+        Name = "__comptime.data" + std::to_string(Counter++);
+    }
+    auto* GV = new llvm::GlobalVariable(*ASTNode::TheModule, llvm::ArrayType::get(llvm::Type::getDoubleTy(*ASTNode::TheContext), Value.elements.size()),
+        true, llvm::GlobalValue::PrivateLinkage, llvm::ConstantDataArray::get(*ASTNode::TheContext, llvm::ArrayRef<double>(Value.elements)), Name);
+    GV->setAlignment(llvm::Align(64));
+    ASTNode::ConstArrays[Name] = GV;
+    return std::make_unique<VariableASTNode>(Name);
+}
@@ -0,0 +1,162 @@
+// DWARF for -g and -gline-tables-only, see DebugInfo.h.
+#include "../include/DebugInfo.h"
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/TargetParser/Triple.h"
+
+DebugLevel DebugInfo::Level = DebugLevel::None;
+thread_local std::unique_ptr<llvm::DIBuilder> DebugInfo::DBuilder = nullptr;
+thread_local llvm::DICompileUnit* DebugInfo::Unit = nullptr;
+thread_local llvm::DIFile* DebugInfo::File = nullptr;
+
+void DebugInfo::beginFile(llvm::Module& M, const std::string& Path, llvm::StringRef TargetTriple, bool Optimized) {
+    reset();
+    if (Level == DebugLevel::None)
+    {
+        return;
+    }
+    // Absolute, so the debugger finds the source from anywhere.
+    llvm::SmallString<128> Absolute(Path);
+    llvm::sys::fs::make_absolute(Absolute);
+    DBuilder = std::make_unique<llvm::DIBuilder>(M);
+    File = DBuilder->createFile(llvm::sys::path::filename(Absolute), llvm::sys::path::parent_path(Absolute));
+    Unit = DBuilder->createCompileUnit(llvm::dwarf::DW_LANG_C, File, "randlang", Optimized, "", 0, "",
+        Level == DebugLevel::Full ? llvm::DICompileUnit::FullDebug : llvm::DICompileUnit::LineTablesOnly);
+
+    // Set now rather than in endFile, functions stored in the function cache
+    // are cut from the module before that and would lose their debug info
+    // when read back without the version.
+    M.addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+    M.addModuleFlag(llvm::Module::Max, "Dwarf Version", llvm::Triple(TargetTriple).isOSDarwin() ? 4 : 5);
+}
+
+void DebugInfo::endFile() {
+    if (DBuilder)
+    {
+        DBuilder->finalize();
+    }
+}
+
+void DebugInfo::reset() {
+    DBuilder.reset();
+    Unit = nullptr;
+    File = nullptr;
+}
+
+std::string DebugInfo::fileName() {
+    return File ? (File->getDirectory() + "/" + File->getFilename()).str() : "";
+}
+
+llvm::DIType* DebugInfo::type(ValueType Type) {
+    if (Type.isArray())
+    {
+        // { double* data, i64 length } like the arrays themselves
+        llvm::DIType* Data = DBuilder->createPointerType(type(ValueType::F64), 64);
+        llvm::DIType* Length = type(ValueType::I64);
+        llvm::Metadata* Members[] = {
+            DBuilder->createMemberType(File, "data", File, 0, 64, 64, 0, llvm::DINode::FlagZero, Data),
+            DBuilder->createMemberType(File, "length", File, 0, 64, 64, 64, llvm::DINode::FlagZero, Length)};
+        return DBuilder->createStructType(File, "f64[]", File, 0, 128, 64, llvm::DINode::FlagZero, nullptr,
+            DBuilder->getOrCreateArray(Members));
+    }
+    llvm::DIType* Element;
+    switch (Type.scalar)
+    {
+        case ScalarType::Bool:
+            Element = DBuilder->createBasicType("bool", 8, llvm::dwarf::DW_ATE_boolean);
+            break;
+        case ScalarType::I64:
+            Element = DBuilder->createBasicType("i64", 64, llvm::dwarf::DW_ATE_signed);
+            break;
+        case ScalarType::F32:
+            Element = DBuilder->createBasicType("f32", 32, llvm::dwarf::DW_ATE_float);
+            break;
+        default:
+            Element = DBuilder->createBasicType("f64", 64, llvm::dwarf::DW_ATE_float);
+            break;
+    }
+    if (!Type.isVector())
+    {
+        return Element;
+    }
+    uint64_t Bits = Type.lanes * Element->getSizeInBits();
+    llvm::Metadata* Lanes[] = {DBuilder->getOrCreateSubrange(0, Type.lanes)};
+    return DBuilder->createVectorType(Bits, Bits, Element, DBuilder->getOrCreateArray(Lanes));
+}
+
+llvm::DISubprogram* DebugInfo::beginFunction(llvm::Function& F, llvm::StringRef Name, SourceLocation Loc, const std::vector<ValueType>& Types) {
+    if (!DBuilder)
+    {
+        return nullptr;
+    }
+    std::vector<llvm::Metadata*> Elements;
+    if (Level == DebugLevel::Full)
+    {
+        for (ValueType Type : Types)
+        {
+            Elements.push_back(type(Type));
+        }
+    }
+    llvm::DISubroutineType* Ty = DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(Elements));
+    auto Flags = llvm::DISubprogram::SPFlagDefinition;
+    if (F.hasLocalLinkage())
+    {
+        Flags |= llvm::DISubprogram::SPFlagLocalToUnit;
+    }
+    if (Unit->isOptimized())
+    {
+        Flags |= llvm::DISubprogram::SPFlagOptimized;
+    }
+    llvm::DISubprogram* SP = DBuilder->createFunction(File, Name, F.getName(), File, Loc.Line, Ty, Loc.Line,
+        Types.empty() ? llvm::DINode::FlagArtificial : llvm::DINode::FlagPrototyped, Flags);
+    F.setSubprogram(SP);
+    return SP;
+}
+
+void DebugInfo::endFunction(llvm::Function& F) {
+    if (DBuilder && F.getSubprogram())
+    {
+        DBuilder->finalizeSubprogram(F.getSubprogram());
+    }
+}
+
+void DebugInfo::setLocation(llvm::IRBuilderBase& B, SourceLocation Loc) {
+    if (Level == DebugLevel::None)
+    {
+        return;
+    }
+    llvm::DISubprogram* SP = B.GetInsertBlock() ? B.GetInsertBlock()->getParent()->getSubprogram() : nullptr;
+    if (!SP)
+    {
+        B.SetCurrentDebugLocation(llvm::DebugLoc());
+        return;
+    }
+    if (!Loc.Line)
+    {
+        // Made up by the compiler, stays with the node around it.
+        llvm::DebugLoc Current = B.getCurrentDebugLocation();
+        if (Current && Current->getScope()->getSubprogram() == SP)
+        {
+            return;
+        }
+        Loc = SourceLocation{SP->getLine(), 0};
+    }
+    B.SetCurrentDebugLocation(llvm::DILocation::get(SP->getContext(), Loc.Line, Loc.Col, SP));
+}
+
+void DebugInfo::declareVariable(llvm::IRBuilderBase& B, llvm::AllocaInst* Alloca, llvm::StringRef Name, ValueType Type,
+    SourceLocation Loc, unsigned ArgNo) {
+    if (Level != DebugLevel::Full || !DBuilder || !B.GetInsertBlock()->getParent()->getSubprogram())
+    {
+        return;
+    }
+    llvm::DISubprogram* SP = B.GetInsertBlock()->getParent()->getSubprogram();
+    unsigned Line = Loc.Line ? Loc.Line : SP->getLine();
+    llvm::DILocalVariable* Var = ArgNo
+        ? DBuilder->createParameterVariable(SP, Name, ArgNo, File, Line, type(Type), /*AlwaysPreserve*/ true)
+        : DBuilder->createAutoVariable(SP, Name, File, Line, type(Type), /*AlwaysPreserve*/ true);
+    DBuilder->insertDeclare(Alloca, Var, DBuilder->createExpression(), llvm::DILocation::get(SP->getContext(), Line, Loc.Col, SP),
+        B.GetInsertBlock());
+}
@@ -0,0 +1,507 @@
+// Persistent cache of optimized functions, see FunctionCache.h. Also holds
+// the describe methods of the AST nodes, which make up the cache keys.
+#include "../include/FunctionCache.h"
+#include "../include/Purity.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <chrono>
+#include <cstring>
+#include <typeinfo>
+
+namespace {
+
+// Names are length prefixed, so no two different nodes read the same.
+void describeName(std::string& Out, const std::string& Name) {
+    Out += std::to_string(Name.size());
+    Out += ':';
+    Out += Name;
+}
+
+void describeType(std::string& Out, ValueType Type) {
+    Out += std::to_string((int)Type.scalar);
+    Out += 'x';
+    Out += std::to_string(Type.lanes);
+    if (Type.array)
+    {
+        Out += "[]";
+    }
+}
+
+void describeSlot(std::string& Out, const TypeSlot& Slot) {
+    if (Slot.annotated)
+    {
+        describeType(Out, Slot.type);
+    } else
+    {
+        Out += '?';
+    }
+}
+
+void describeOptional(std::unique_ptr<ASTNode>& Node, std::string& Out, std::set<std::string>& Names) {
+    if (Node)
+    {
+        Node->describe(Out, Names);
+    } else
+    {
+        Out += '_';
+    }
+}
+
+void describeAll(std::vector<std::unique_ptr<ASTNode>>& Exprs, std::string& Out, std::set<std::string>& Names) {
+    Out += '{';
+    for (auto &expr : Exprs)
+    {
+        expr->describe(Out, Names);
+    }
+    Out += '}';
+}
+
+// What code referring to Name gets to see of it.
+void describeReferent(std::string& Out, const std::string& Name) {
+    describeName(Out, Name);
+    Out += " = ";
+    llvm::raw_string_ostream OS(Out);
+    auto Proto = FunctionASTNode::FunctionProtos.find(Name);
+    if (Proto != FunctionASTNode::FunctionProtos.end() && Proto->second)
+    {
+        auto &P = *Proto->second;
+        OS << "fn " << (P.isUnaryOp() || P.isBinaryOP()) << ' ' << P.getArgs().size();
+        OS.flush();
+        for (unsigned i = 0, e = P.getArgs().size(); i != e; i++)
+        {
+            Out += ' ';
+            describeType(Out, P.getArgType(i));
+        }
+        Out += " -> ";
+        describeType(Out, P.getReturnType());
+        // The effects of a caller are inferred from those of its callees.
+        Out += " effects ";
+        Out += std::to_string(P.getEffects());
+    } else if (llvm::GlobalValue* GV = ASTNode::TheModule->getNamedValue(Name))
+    {
+        // Private data is copied into the entry, and loads from constants
+        // like exported const arrays may be folded into it, so their contents
+        // count too.
+        auto* Var = llvm::dyn_cast<llvm::GlobalVariable>(GV);
+        OS << GV->getValueType()->getTypeID() << ' ' << GV->getLinkage() << ' ';
+        if (Var && ((Var->hasLocalLinkage() && Var->hasInitializer()) || (Var->isConstant() && Var->hasDefinitiveInitializer())))
+        {
+            Var->getInitializer()->print(OS);
+        } else
+        {
+            GV->getValueType()->print(OS);
+        }
+    } else
+    {
+        OS << "none";
+    }
+    OS.flush();
+    Out += '\n';
+}
+
+// F and the internal functions and private data it uses.
+std::set<const llvm::GlobalValue*> localDefinitions(llvm::Function* F) {
+    std::set<const llvm::GlobalValue*> Found{F};
+    std::vector<const llvm::User*> Worklist;
+    for (auto &I : llvm::instructions(*F))
+    {
+        Worklist.push_back(&I);
+    }
+    while (!Worklist.empty())
+    {
+        const llvm::User* U = Worklist.back();
+        Worklist.pop_back();
+        for (const llvm::Value* Op : U->operands())
+        {
+            if (auto* GV = llvm::dyn_cast<llvm::GlobalValue>(Op))
+            {
+                if (!GV->hasLocalLinkage() || !Found.insert(GV).second)
+                {
+                    continue;
+                }
+                if (auto* Callee = llvm::dyn_cast<llvm::Function>(GV))
+                {
+                    for (auto &I : llvm::instructions(*Callee))
+                    {
+                        Worklist.push_back(&I);
+                    }
+                } else if (auto* Var = llvm::dyn_cast<llvm::GlobalVariable>(GV); Var && Var->hasInitializer())
+                {
+                    Worklist.push_back(Var->getInitializer());
+                }
+            } else if (auto* C = llvm::dyn_cast<llvm::Constant>(Op))
+            {
+                Worklist.push_back(C);
+            }
+        }
+    }
+    return Found;
+}
+
+} // namespace
+
+void ASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += '(';
+    Out += typeid(*this).name();
+    forEachChild([&](std::unique_ptr<ASTNode>& Child) { Child->describe(Out, Names); });
+    Out += ')';
+}
+
+void NumberASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    uint64_t Bits;
+    std::memcpy(&Bits, &val, sizeof(Bits));
+    Out += "(num ";
+    describeType(Out, literalType);
+    Out += ' ';
+    Out += std::to_string(Bits);
+    Out += ')';
+}
+
+void VariableASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(var ";
+    describeName(Out, varName);
+    Out += ')';
+    Names.insert(varName);
+}
+
+void BinaryASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(bin ";
+    Out += std::to_string((int)op);
+    Out += ' ';
+    Out += std::to_string(isSinglecharOperator);
+    Out += ' ';
+    Out += std::to_string((int)tokenkind);
+    LHS->describe(Out, Names);
+    RHS->describe(Out, Names);
+    Out += ')';
+    if (!isBuiltinOperator())
+    {
+        Names.insert(std::string("binary") + op);
+    }
+}
+
+void IndexExprAST::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(index";
+    Base->describe(Out, Names);
+    Index->describe(Out, Names);
+    describeOptional(SliceEnd, Out, Names);
+    Out += ')';
+}
+
+void CallASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(call ";
+    describeName(Out, callee);
+    Out += ' ';
+    Out += std::to_string(args.size());
+    for (auto &arg : args)
+    {
+        arg->describe(Out, Names);
+    }
+    Out += ')';
+    Names.insert(callee);
+}
+
+void PrototypeASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(proto ";
+    describeName(Out, name);
+    Out += ' ';
+    Out += std::to_string(isOperator);
+    Out += ' ';
+    Out += std::to_string(Precedence);
+    for (unsigned i = 0, e = args.size(); i != e; i++)
+    {
+        Out += ' ';
+        describeName(Out, args[i]);
+        describeType(Out, getArgType(i));
+    }
+    Out += " -> ";
+    describeType(Out, returnType);
+    Out += pure ? " pure" : "";
+    if (memo)
+    {
+        Out += " memo " + std::to_string(memo->Capacity) + ' ' + std::to_string(memo->Policy) + ' ' + std::to_string(memo->Shards);
+    }
+    Out += ')';
+}
+
+void FunctionASTNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(fn";
+    proto->describe(Out, Names);
+    Out += " fastmath ";
+    Out += std::to_string(proto->getFastMath());
+    describeAll(body, Out, Names);
+    // The lines are part of the debug info in the cached function.
+    if (DebugInfo::Level != DebugLevel::None)
+    {
+        Out += " at ";
+        describeName(Out, DebugInfo::fileName());
+        Out += ' ' + std::to_string(proto->Loc.Line) + ':' + std::to_string(proto->Loc.Col);
+        std::function<void(std::unique_ptr<ASTNode>&)> describeLoc = [&](std::unique_ptr<ASTNode>& Node) {
+            Out += ' ' + std::to_string(Node->Loc.Line) + ':' + std::to_string(Node->Loc.Col);
+            Node->forEachChild(describeLoc);
+        };
+        forEachChild(describeLoc);
+    }
+    Out += ')';
+}
+
+void IfExprAST::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(if";
+    Cond->describe(Out, Names);
+    describeAll(Then, Out, Names);
+    describeAll(Else, Out, Names);
+    Out += ')';
+}
+
+void ForExprAST::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(for ";
+    describeName(Out, VarName);
+    describeSlot(Out, VarType);
+    Start->describe(Out, Names);
+    End->describe(Out, Names);
+    describeOptional(Step, Out, Names);
+    describeAll(Body, Out, Names);
+    Out += ')';
+}
+
+void UnaryExprAst::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(unary ";
+    Out += std::to_string((int)Opcode);
+    Operand->describe(Out, Names);
+    Out += ')';
+    Names.insert(std::string("unary") + Opcode);
+}
+
+void VarAstNode::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(let";
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        Out += ' ';
+        describeName(Out, VarNames[i].first);
+        describeSlot(Out, VarTypes[i]);
+        describeOptional(VarNames[i].second, Out, Names);
+    }
+    Body->describe(Out, Names);
+    Out += ')';
+}
+
+void ReduceExprAST::describe(std::string& Out, std::set<std::string>& Names) {
+    Out += "(reduce ";
+    describeName(Out, Op);
+    Out += ' ';
+    Out += std::to_string(Parallel);
+    describeOptional(Identity, Out, Names);
+    Out += ' ';
+    describeName(Out, VarName);
+    describeSlot(Out, VarType);
+    Start->describe(Out, Names);
+    End->describe(Out, Names);
+    Body->describe(Out, Names);
+    Out += ')';
+    if (isUserOperator())
+    {
+        Names.insert("binary" + Op);
+    }
+}
+
+FunctionCache::FunctionCache(std::string Directory, std::string Configuration, uint64_t MaxSizeBytes)
+    : Directory(std::move(Directory)), Configuration(std::move(Configuration)), MaxSizeBytes(MaxSizeBytes) {
+    if (std::error_code EC = llvm::sys::fs::create_directories(this->Directory))
+    {
+        llvm::errs() << "Function cache: could not create " << this->Directory << ": " << EC.message() << "\n";
+    }
+}
+
+std::string FunctionCache::compilerVersion(const char* Argv0) {
+    std::string Version = "LLVM " LLVM_VERSION_STRING;
+    std::string Executable = llvm::sys::fs::getMainExecutable(Argv0, (void*)&FunctionCache::compilerVersion);
+    llvm::sys::fs::file_status Status;
+    if (!llvm::sys::fs::status(Executable, Status))
+    {
+        Version += ", " + Executable + " " + std::to_string(Status.getSize()) + " " +
+            std::to_string(Status.getLastModificationTime().time_since_epoch().count());
+    }
+    return Version;
+}
+
+std::string FunctionCache::key(FunctionASTNode& Fn) {
+    std::string Text = Configuration + "\n";
+    std::set<std::string> Names;
+    Fn.describe(Text, Names);
+    Text += '\n';
+    for (auto &Name : Names)
+    {
+        describeReferent(Text, Name);
+    }
+    auto Hash = llvm::SHA256::hash(llvm::ArrayRef<uint8_t>((const uint8_t*)Text.data(), Text.size()));
+    return llvm::toHex(Hash, true);
+}
+
+std::string FunctionCache::entryPath(const std::string& Key) {
+    llvm::SmallString<128> Path(Directory);
+    // pruneCache only ever removes files with this prefix.
+    llvm::sys::path::append(Path, "llvmcache-" + Key);
+    return std::string(Path);
+}
+
+bool FunctionCache::load(const std::string& Key, FunctionASTNode& Fn) {
+    llvm::Function* Existing = ASTNode::TheModule->getFunction(Fn.getName());
+    if (Existing && !Existing->isDeclaration())
+    {
+        return false; // let codegen report the redefinition
+    }
+
+    std::string Path = entryPath(Key);
+    int FD;
+    if (llvm::sys::fs::openFileForRead(Path, FD))
+    {
+        return false;
+    }
+    auto Buffer = llvm::MemoryBuffer::getOpenFile(llvm::sys::fs::convertFDToNativeFile(FD), Path, -1);
+    // Entries are dropped least recently used first.
+    llvm::sys::fs::setLastAccessAndModificationTime(FD, std::chrono::system_clock::now());
+    llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+    if (!Buffer)
+    {
+        return false;
+    }
+
+    auto M = llvm::parseBitcodeFile((*Buffer)->getMemBufferRef(), *ASTNode::TheContext);
+    if (!M)
+    {
+        llvm::consumeError(M.takeError());
+        return false;
+    }
+    if (llvm::Linker::linkModules(*ASTNode::TheModule, std::move(*M)))
+    {
+        return false;
+    }
+    BytesRead += (*Buffer)->getBufferSize();
+    Fn.declare();
+    // The entry was stored with the attributes of the purity analysis.
+    FunctionASTNode::FunctionProtos[Fn.getName()]->setEffects(effectsOf(*ASTNode::TheModule->getFunction(Fn.getName())));
+
+    // comptime arrays of the body were created while parsing, the entry has its own copy.
+    for (auto It = ASTNode::ConstArrays.begin(); It != ASTNode::ConstArrays.end();)
+    {
+        llvm::GlobalVariable* GV = It->second;
+        if (GV->hasLocalLinkage() && GV->use_empty())
+        {
+            GV->eraseFromParent();
+            It = ASTNode::ConstArrays.erase(It);
+        } else
+        {
+            ++It;
+        }
+    }
+    return true;
+}
+
+void FunctionCache::store(const std::string& Key, llvm::Function* F) {
+    std::set<const llvm::GlobalValue*> Definitions = localDefinitions(F);
+    llvm::ValueToValueMapTy VMap;
+    std::unique_ptr<llvm::Module> M = llvm::CloneModule(*ASTNode::TheModule, VMap,
+        [&](const llvm::GlobalValue* GV) { return Definitions.count(GV) != 0; });
+
+    // Everything else was turned into declarations, only the used ones stay.
+    bool Erased = true;
+    while (Erased)
+    {
+        Erased = false;
+        for (auto &G : llvm::make_early_inc_range(M->global_values()))
+        {
+            if (G.isDeclaration() && G.use_empty())
+            {
+                G.eraseFromParent();
+                Erased = true;
+            }
+        }
+    }
+
+    llvm::SmallVector<char, 0> Buffer;
+    llvm::raw_svector_ostream BufferOS(Buffer);
+    llvm::WriteBitcodeToFile(*M, BufferOS);
+
+    // Written under a temporary name first, concurrent compilers never see half an entry.
+    int FD;
+    llvm::SmallString<128> TempPath;
+    if (llvm::sys::fs::createUniqueFile(Directory + "/tmp-%%%%%%%%", FD, TempPath))
+    {
+        return;
+    }
+    {
+        llvm::raw_fd_ostream OS(FD, true);
+        OS.write(Buffer.data(), Buffer.size());
+        if (OS.has_error())
+        {
+            OS.clear_error();
+            llvm::sys::fs::remove(TempPath);
+            return;
+        }
+    }
+    if (llvm::sys::fs::rename(TempPath, entryPath(Key)))
+    {
+        llvm::sys::fs::remove(TempPath);
+        return;
+    }
+    Stored++;
+    BytesWritten += Buffer.size();
+}
+
+llvm::Function* FunctionCache::codegen(FunctionASTNode& Fn) {
+    std::string Key = key(Fn);
+    if (load(Key, Fn))
+    {
+        Hits++;
+        return ASTNode::TheModule->getFunction(Fn.getName());
+    }
+    Misses++;
+    llvm::Function* F = Fn.codegen();
+    if (F)
+    {
+        store(Key, F);
+    }
+    return F;
+}
+
+void FunctionCache::prune() {
+    llvm::CachePruningPolicy Policy;
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.Expiration = std::chrono::seconds(0);
+    Policy.MaxSizePercentageOfAvailableSpace = 0;
+    Policy.MaxSizeBytes = MaxSizeBytes;
+    llvm::pruneCache(Directory, Policy);
+}
+
+void FunctionCache::printStats(llvm::raw_ostream& OS) {
+    unsigned Entries = 0;
+    uint64_t Size = 0;
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator It(Directory, EC), End; It != End && !EC; It.increment(EC))
+    {
+        if (!llvm::sys::path::filename(It->path()).starts_with("llvmcache-"))
+        {
+            continue;
+        }
+        if (auto Status = It->status())
+        {
+            Entries++;
+            Size += Status->getSize();
+        }
+    }
+
+    OS << "Function cache: " << Hits.load() << " hits, " << Misses.load() << " misses, " << Stored.load() << " stored\n";
+    OS << "  read " << BytesRead.load() << " bytes, wrote " << BytesWritten.load() << " bytes\n";
+    OS << "  " << Directory << ": " << Entries << " entries, " << Size << " of " << MaxSizeBytes << " bytes\n";
+}
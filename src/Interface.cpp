@@ -0,0 +1,162 @@
+// Interface files for separate compilation, see Interface.h.
+#include "../include/Interface.h"
+#include "../include/Serialize.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstring>
+
+namespace {
+
+constexpr char Magic[4] = {'R', 'D', 'L', 'I'};
+constexpr uint32_t HeaderSize = 24;
+
+void appendWord(std::string& Out, uint32_t Value) {
+    char Bytes[4];
+    llvm::support::endian::write32le(Bytes, Value);
+    Out.append(Bytes, 4);
+}
+
+// Bodies are only exported if they are small and refer to nothing but their
+// parameters, locals and other functions, which the importer sees as well.
+bool exportsBody(FunctionASTNode& Body) {
+    if (ASTNode::countNodes(Body) > InterfaceFile::InlineLimit)
+    {
+        return false;
+    }
+    std::string Unused;
+    std::set<std::string> Names;
+    Body.describe(Unused, Names);
+    for (auto &Name : Names)
+    {
+        if (ASTNode::ConstArrays.count(Name))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+std::string InterfaceFile::pathFor(const std::string& Output) {
+    llvm::SmallString<128> Path(Output);
+    llvm::sys::path::replace_extension(Path, "rdlgi");
+    return std::string(Path);
+}
+
+bool InterfaceFile::write(const std::string& Path) {
+    ASTWriter W;
+    std::vector<std::pair<uint32_t, uint32_t>> Symbols;
+    for (auto &[Name, Proto] : FunctionASTNode::FunctionProtos)
+    {
+        // Top level expressions and main aren't called from other files.
+        if (!Proto || Name.empty() || Name == "main")
+        {
+            continue;
+        }
+        uint32_t ProtoOffset = Proto->serialize(W);
+        uint32_t BodyOffset = 0;
+        auto Body = FunctionASTNode::OperatorBodies.find(Name);
+        if (Body != FunctionASTNode::OperatorBodies.end() && exportsBody(*Body->second))
+        {
+            BodyOffset = Body->second->serialize(W);
+        }
+        Symbols.push_back({ProtoOffset, BodyOffset});
+    }
+    if (W.failed())
+    {
+        llvm::errs() << "Could not write the interface " << Path << "\n";
+        return false;
+    }
+
+    std::string Out(Magic, 4);
+    appendWord(Out, Version);
+    appendWord(Out, Symbols.size());
+    appendWord(Out, HeaderSize);
+    appendWord(Out, HeaderSize + 8 * Symbols.size());
+    appendWord(Out, W.buffer().size());
+    for (auto &[ProtoOffset, BodyOffset] : Symbols)
+    {
+        appendWord(Out, ProtoOffset);
+        appendWord(Out, BodyOffset);
+    }
+    Out += W.buffer();
+
+    // Written under a temporary name first, files compiled in parallel never import half an interface.
+    int FD;
+    llvm::SmallString<128> TempPath;
+    if (std::error_code EC = llvm::sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TempPath))
+    {
+        llvm::errs() << "Could not write the interface " << Path << ": " << EC.message() << "\n";
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream OS(FD, true);
+        OS << Out;
+        if (OS.has_error())
+        {
+            OS.clear_error();
+            llvm::sys::fs::remove(TempPath);
+            llvm::errs() << "Could not write the interface " << Path << "\n";
+            return false;
+        }
+    }
+    if (std::error_code EC = llvm::sys::fs::rename(TempPath, Path))
+    {
+        llvm::sys::fs::remove(TempPath);
+        llvm::errs() << "Could not write the interface " << Path << ": " << EC.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool InterfaceFile::read(const std::string& Path, std::vector<ImportedSymbol>& Symbols, std::string& Error) {
+    // Mapped rather than copied if the file is big enough, only the nodes
+    // that are used get turned into AST nodes.
+    auto File = llvm::MemoryBuffer::getFile(Path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+    if (!File)
+    {
+        Error = File.getError().message();
+        return false;
+    }
+    llvm::StringRef Data = (*File)->getBuffer();
+    auto wordAt = [&](uint32_t Offset) { return llvm::support::endian::read32le(Data.data() + Offset); };
+    if (Data.size() < HeaderSize || std::memcmp(Data.data(), Magic, 4) != 0)
+    {
+        Error = "not an interface file";
+        return false;
+    }
+    if (wordAt(4) != Version)
+    {
+        Error = "interface file of another compiler version";
+        return false;
+    }
+    uint64_t Count = wordAt(8), Table = wordAt(12), AST = wordAt(16), ASTSize = wordAt(20);
+    if (Table + 8 * Count > Data.size() || AST + ASTSize > Data.size() || AST % 4)
+    {
+        Error = "damaged interface file";
+        return false;
+    }
+
+    ASTReader Reader(Data.substr(AST, ASTSize));
+    for (uint64_t i = 0; i < Count; i++)
+    {
+        ImportedSymbol Symbol;
+        Symbol.Proto = Reader.readPrototype(wordAt(Table + 8 * i));
+        uint32_t Body = wordAt(Table + 8 * i + 4);
+        if (Body)
+        {
+            Symbol.Body = Reader.readFunction(Body);
+        }
+        if (!Symbol.Proto || (Body && !Symbol.Body))
+        {
+            Error = "damaged interface file";
+            return false;
+        }
+        Symbols.push_back(std::move(Symbol));
+    }
+    return true;
+}
@@ -5,13 +5,12 @@
 bool Lexer::is_space(char c) noexcept {
   switch (c) {
     case '\n':
-    case '\r':
       ++linenumber;
-      col = 0;
+      m_lineStart = m_beg + 1;
       return true;
+    case '\r':
     case '\t':
     case ' ':
-      ++col;
       return true;
     default:
       return false;
@@ -109,10 +108,41 @@ bool Lexer::is_identifier_char(char c) noexcept {
 
 Token Lexer::atom(Token::Kind kind) noexcept { return Token(kind, m_beg++, 1); }
 
+// Tokens are lexed kLexBatch at a time, timing every token would cost
+// about as much as lexing it.
+constexpr size_t kLexBatch = 256;
+
+void Lexer::lexBatch() noexcept {
+  TimeScope Scope(Phase::Lex);
+  tokens.clear();
+  nextToken = 0;
+  // Lexing continues where the last batch ended, not at the line of the token handed out last.
+  linenumber = lexLine;
+  while (tokens.size() < kLexBatch) {
+    Token t = token();
+    t.location(tokenLine, col);
+    tokenCount++;
+    lexemeBytes += t.lexeme().size();
+    tokens.push_back(Lexed{t, linenumber});
+    if (t.is(Token::Kind::End)) break;
+  }
+  lexLine = linenumber;
+}
+
 Token Lexer::next() noexcept {
+  if (nextToken == tokens.size()) lexBatch();
+  const Lexed& l = tokens[nextToken++];
+  linenumber = l.line;
+  col = l.token.col();
+  return l.token;
+}
+
+Token Lexer::token() noexcept {
   while (is_space(peek())) get();
 
   //currentLineNumber = linenumber;
+  tokenLine = linenumber;
+  col = m_beg - m_lineStart + 1;
 
   switch (peek()) {
     case '\0':
@@ -211,6 +241,8 @@ Token Lexer::next() noexcept {
       return slash_or_comment();
     case '#':
       return atom(Token::Kind::Hash);
+    case '@':
+      return atom(Token::Kind::At);
     case '.':
       return atom(Token::Kind::Dot);
     case ',':
@@ -222,7 +254,7 @@ Token Lexer::next() noexcept {
     case '\'':
       return atom(Token::Kind::SingleQuote);
     case '"':
-      return atom(Token::Kind::DoubleQuote);
+      return string();
     case '|':
       return atom(Token::Kind::Pipe);
     case '~':
@@ -239,7 +271,10 @@ Token Lexer::identifier() noexcept {
   std::string_view kwidentifier(start, std::distance(start, m_beg));
   if (kwidentifier == "for" || kwidentifier == "while" ||
    kwidentifier == "if" || kwidentifier == "else" || kwidentifier == "return" || kwidentifier == "extern" || kwidentifier == "fn" || kwidentifier == "then" ||
-  kwidentifier == "in" || kwidentifier == "binary" || kwidentifier == "unary" || kwidentifier == "var")
+  kwidentifier == "in" || kwidentifier == "binary" || kwidentifier == "unary" || kwidentifier == "var" ||
+  kwidentifier == "reduce" || kwidentifier == "parallel" ||
+  kwidentifier == "region" || kwidentifier == "const" ||
+  kwidentifier == "comptime" || kwidentifier == "import" || kwidentifier == "pure" || kwidentifier == "memo")
   {
    return Token(Token::Kind::Keyword, start, m_beg);
   }
@@ -262,6 +297,8 @@ Token Lexer::slash_or_comment() noexcept {
     start = m_beg;
     while (peek() != '\0') {
       if (get() == '\n') {
+        ++linenumber;
+        m_lineStart = m_beg;
         return Token(Token::Kind::Comment, start,
                      std::distance(start, m_beg) - 1);
       }
@@ -272,6 +309,22 @@ Token Lexer::slash_or_comment() noexcept {
   }
 }
 
+// Strings end on the same line, there are no escapes.
+Token Lexer::string() noexcept {
+  const char* quote = m_beg;
+  get();
+  const char* start = m_beg;
+  while (peek() != '"') {
+    if (peek() == '\0' || peek() == '\n') {
+      return Token(Token::Kind::Unexpected, quote, 1);
+    }
+    get();
+  }
+  Token t(Token::Kind::String, start, m_beg);
+  get();
+  return t;
+}
+
 Token Lexer::or_is(Token::Kind first, Token::Kind second) noexcept {
   const char* start = m_beg;
   get();
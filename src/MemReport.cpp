@@ -0,0 +1,305 @@
+// Compiler memory report, see MemReport.h.
+#include "../include/MemReport.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <malloc.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sys/resource.h>
+#include <typeinfo>
+#include <vector>
+
+namespace {
+
+constexpr size_t Phases = (size_t)Phase::Count + 1; // the last one is outside of all phases
+
+struct PhaseMemory {
+    std::atomic<uint64_t> Allocations{0}, Bytes{0};
+    std::atomic<int64_t> PeakLive{0};
+    std::atomic<long> RaisedRSS{0}; // KiB
+};
+PhaseMemory PerPhase[Phases];
+std::atomic<int64_t> Live{0}; // may start below zero, memory from before start() is freed too
+std::atomic<long> HighWater{0};
+long StartRSS = 0;
+
+std::atomic<uint64_t> Tokens{0}, LexemeBytes{0}, TokenBufferBytes{0};
+
+struct FunctionSize {
+    std::string Name;
+    std::string File;
+    unsigned Blocks;
+    unsigned Instructions;
+};
+struct FileSize {
+    std::string File;
+    size_t Prototypes, OperatorBodies, ConstValues, ConstArrays, Globals;
+    unsigned Functions = 0, Blocks = 0, Instructions = 0;
+};
+
+std::mutex Lock; // for the AST, file and function lists
+std::map<std::string, std::pair<uint64_t, uint64_t>> ASTClasses; // count, bytes
+std::vector<FileSize> Files;
+std::vector<FunctionSize> Functions;
+
+void counted(void* P) {
+    int64_t Bytes = malloc_usable_size(P);
+    auto &M = PerPhase[(size_t)TimeScope::current()];
+    M.Allocations.fetch_add(1, std::memory_order_relaxed);
+    M.Bytes.fetch_add(Bytes, std::memory_order_relaxed);
+    int64_t Now = Live.fetch_add(Bytes, std::memory_order_relaxed) + Bytes;
+    int64_t Peak = M.PeakLive.load(std::memory_order_relaxed);
+    while (Now > Peak && !M.PeakLive.compare_exchange_weak(Peak, Now, std::memory_order_relaxed))
+    {
+    }
+}
+
+void* allocate(size_t Size) {
+    void* P = std::malloc(Size ? Size : 1);
+    if (!P)
+    {
+        throw std::bad_alloc();
+    }
+    if (MemReport::Enabled)
+    {
+        counted(P);
+    }
+    return P;
+}
+
+void deallocate(void* P) noexcept {
+    if (P && MemReport::Enabled)
+    {
+        Live.fetch_sub(malloc_usable_size(P), std::memory_order_relaxed);
+    }
+    std::free(P);
+}
+
+long maxRSS() {
+    rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_maxrss; // KiB on Linux
+}
+
+void countNode(ASTNode& Node, std::map<llvm::StringRef, std::pair<uint64_t, uint64_t>>& Classes) {
+    // Class names are mangled as their length followed by the name.
+    auto &C = Classes[llvm::StringRef(typeid(Node).name()).ltrim("0123456789")];
+    C.first++;
+    C.second += malloc_usable_size(&Node);
+    Node.forEachChild([&](std::unique_ptr<ASTNode>& Child) {
+        if (Child)
+        {
+            countNode(*Child, Classes);
+        }
+    });
+}
+
+double kib(uint64_t Bytes) {
+    return Bytes / 1024.0;
+}
+
+} // namespace
+
+void* operator new(size_t Size) {
+    return allocate(Size);
+}
+
+void* operator new[](size_t Size) {
+    return allocate(Size);
+}
+
+void operator delete(void* P) noexcept {
+    deallocate(P);
+}
+
+void operator delete[](void* P) noexcept {
+    deallocate(P);
+}
+
+void operator delete(void* P, size_t) noexcept {
+    deallocate(P);
+}
+
+void operator delete[](void* P, size_t) noexcept {
+    deallocate(P);
+}
+
+bool MemReport::Enabled = false;
+
+void MemReport::start() {
+    StartRSS = maxRSS();
+    HighWater = StartRSS;
+    Enabled = true;
+}
+
+void MemReport::countAST(ASTNode& Node) {
+    std::map<llvm::StringRef, std::pair<uint64_t, uint64_t>> Classes;
+    countNode(Node, Classes);
+    std::lock_guard<std::mutex> Guard(Lock);
+    for (auto &C : Classes)
+    {
+        auto &Total = ASTClasses[C.first.str()];
+        Total.first += C.second.first;
+        Total.second += C.second.second;
+    }
+}
+
+void MemReport::countTokens(unsigned Count, size_t Bytes, size_t BufferBytes) {
+    Tokens += Count;
+    LexemeBytes += Bytes;
+    TokenBufferBytes += BufferBytes;
+}
+
+void MemReport::countFile(const std::string& File) {
+    FileSize Size{File, FunctionASTNode::FunctionProtos.size(), FunctionASTNode::OperatorBodies.size(), ASTNode::ConstValues.size(),
+                  ASTNode::ConstArrays.size(), ASTNode::TheModule->global_size()};
+    std::vector<FunctionSize> Sizes;
+    for (auto &F : *ASTNode::TheModule)
+    {
+        if (F.isDeclaration())
+        {
+            continue;
+        }
+        Sizes.push_back({F.getName().str(), File, (unsigned)F.size(), F.getInstructionCount()});
+        Size.Functions++;
+        Size.Blocks += F.size();
+        Size.Instructions += F.getInstructionCount();
+    }
+    std::lock_guard<std::mutex> Guard(Lock);
+    Files.push_back(Size);
+    Functions.insert(Functions.end(), Sizes.begin(), Sizes.end());
+}
+
+void MemReport::phaseEnded(Phase P) {
+    long Now = maxRSS();
+    long Seen = HighWater.load();
+    while (Now > Seen)
+    {
+        if (HighWater.compare_exchange_weak(Seen, Now))
+        {
+            PerPhase[(size_t)P].RaisedRSS += Now - Seen;
+            break;
+        }
+    }
+}
+
+void MemReport::print(llvm::raw_ostream& OS) {
+    phaseEnded(Phase::Count);
+    std::lock_guard<std::mutex> Guard(Lock);
+    OS << "===== Memory report =====\n";
+    OS << llvm::format("Peak RSS %.1f MiB, %.1f MiB at the start\n", HighWater / 1024.0, StartRSS / 1024.0);
+    OS << "  Phase      RSS raised (KiB)  Allocations  Allocated (KiB)  Peak live (KiB)\n";
+    for (size_t i = 0; i < Phases; i++)
+    {
+        auto &M = PerPhase[i];
+        OS << llvm::format("  %-10s %16ld %12llu %16.1f %16.1f\n", phaseName((Phase)i), M.RaisedRSS.load(), (unsigned long long)M.Allocations.load(),
+                           kib(M.Bytes), kib(std::max<int64_t>(M.PeakLive, 0)));
+    }
+
+    OS << "AST nodes as parsed:\n";
+    OS << "  Class                  Count    Bytes (KiB)\n";
+    for (auto &C : ASTClasses)
+    {
+        OS << llvm::format("  %-20s %9llu %14.1f\n", C.first.c_str(), (unsigned long long)C.second.first, kib(C.second.second));
+    }
+    OS << llvm::format("Tokens: %llu, %.1f KiB of lexemes, %.1f KiB of token buffers\n", (unsigned long long)Tokens.load(), kib(LexemeBytes),
+                       kib(TokenBufferBytes));
+
+    OS << "Modules handed to the backend:\n";
+    for (auto &F : Files)
+    {
+        OS << "  " << F.File << llvm::format(": %u functions, %u basic blocks, %u instructions, %zu globals; ", F.Functions, F.Blocks, F.Instructions, F.Globals)
+           << llvm::format("%zu prototypes, %zu operator bodies, %zu consts, %zu const arrays\n", F.Prototypes, F.OperatorBodies, F.ConstValues, F.ConstArrays);
+    }
+    std::vector<FunctionSize> Largest = Functions;
+    const size_t Shown = std::min<size_t>(10, Largest.size());
+    std::partial_sort(Largest.begin(), Largest.begin() + Shown, Largest.end(),
+                      [](const FunctionSize& A, const FunctionSize& B) { return A.Instructions > B.Instructions; });
+    if (Shown)
+    {
+        OS << "Largest functions:\n  Instructions  Blocks\n";
+    }
+    for (size_t i = 0; i < Shown; i++)
+    {
+        OS << llvm::format("  %12u %7u  ", Largest[i].Instructions, Largest[i].Blocks) << Largest[i].Name << " (" << Largest[i].File << ")\n";
+    }
+}
+
+bool MemReport::writeJSON(const std::string& Path) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+    if (EC)
+    {
+        llvm::errs() << "Could not open file: " << EC.message() << "\n";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    llvm::json::OStream J(OS, 2);
+    J.object([&] {
+        J.attribute("peak_rss_kib", (int64_t)HighWater);
+        J.attribute("start_rss_kib", (int64_t)StartRSS);
+        J.attributeArray("phases", [&] {
+            for (size_t i = 0; i < Phases; i++)
+            {
+                auto &M = PerPhase[i];
+                J.object([&] {
+                    J.attribute("phase", phaseName((Phase)i));
+                    J.attribute("rss_raised_kib", (int64_t)M.RaisedRSS);
+                    J.attribute("allocations", (int64_t)M.Allocations);
+                    J.attribute("allocated_bytes", (int64_t)M.Bytes);
+                    J.attribute("peak_live_bytes", std::max<int64_t>(M.PeakLive, 0));
+                });
+            }
+        });
+        J.attributeArray("ast_nodes", [&] {
+            for (auto &C : ASTClasses)
+            {
+                J.object([&] {
+                    J.attribute("class", C.first);
+                    J.attribute("count", (int64_t)C.second.first);
+                    J.attribute("bytes", (int64_t)C.second.second);
+                });
+            }
+        });
+        J.attributeObject("tokens", [&] {
+            J.attribute("count", (int64_t)Tokens);
+            J.attribute("lexeme_bytes", (int64_t)LexemeBytes);
+            J.attribute("token_bytes", (int64_t)TokenBufferBytes);
+        });
+        J.attributeArray("files", [&] {
+            for (auto &F : Files)
+            {
+                J.object([&] {
+                    J.attribute("file", F.File);
+                    J.attribute("functions", (int64_t)F.Functions);
+                    J.attribute("basic_blocks", (int64_t)F.Blocks);
+                    J.attribute("instructions", (int64_t)F.Instructions);
+                    J.attribute("globals", (int64_t)F.Globals);
+                    J.attribute("prototypes", (int64_t)F.Prototypes);
+                    J.attribute("operator_bodies", (int64_t)F.OperatorBodies);
+                    J.attribute("consts", (int64_t)F.ConstValues);
+                    J.attribute("const_arrays", (int64_t)F.ConstArrays);
+                });
+            }
+        });
+        J.attributeArray("functions", [&] {
+            for (auto &F : Functions)
+            {
+                J.object([&] {
+                    J.attribute("name", F.Name);
+                    J.attribute("file", F.File);
+                    J.attribute("basic_blocks", (int64_t)F.Blocks);
+                    J.attribute("instructions", (int64_t)F.Instructions);
+                });
+            }
+        });
+    });
+    OS << "\n";
+    return true;
+}
@@ -0,0 +1,89 @@
+// Memo tables of memo functions, see Memo.h.
+#include "../include/Memo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <string>
+
+namespace {
+
+llvm::StructType* memoType(llvm::LLVMContext& Ctx) {
+    llvm::Type* PtrTy = llvm::PointerType::getUnqual(Ctx);
+    llvm::Type* I32 = llvm::Type::getInt32Ty(Ctx);
+    return llvm::StructType::get(Ctx, {PtrTy, PtrTy, llvm::Type::getInt64Ty(Ctx), I32, I32, I32, I32});
+}
+
+llvm::Value* toBits(llvm::IRBuilder<>& B, llvm::Value* V) {
+    llvm::Type* Ty = V->getType();
+    if (Ty->isDoubleTy())
+    {
+        return B.CreateBitCast(V, B.getInt64Ty());
+    } else if (Ty->isFloatTy())
+    {
+        return B.CreateZExt(B.CreateBitCast(V, B.getInt32Ty()), B.getInt64Ty());
+    }
+    return B.CreateZExt(V, B.getInt64Ty()); // i1 and i64
+}
+
+llvm::Value* fromBits(llvm::IRBuilder<>& B, llvm::Value* Bits, llvm::Type* Ty) {
+    if (Ty->isDoubleTy())
+    {
+        return B.CreateBitCast(Bits, Ty);
+    } else if (Ty->isFloatTy())
+    {
+        return B.CreateBitCast(B.CreateTrunc(Bits, B.getInt32Ty()), Ty);
+    }
+    return B.CreateTrunc(Bits, Ty);
+}
+
+llvm::FunctionCallee declareMemoFunction(llvm::Module& M, llvm::StringRef Name) {
+    llvm::LLVMContext& Ctx = M.getContext();
+    llvm::Type* PtrTy = llvm::PointerType::getUnqual(Ctx);
+    llvm::FunctionType* FT = Name == "__rdlg_memo_lookup"
+        ? llvm::FunctionType::get(llvm::Type::getInt32Ty(Ctx), {PtrTy, PtrTy, PtrTy}, false)
+        : llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), {PtrTy, PtrTy, llvm::Type::getInt64Ty(Ctx)}, false);
+    auto* F = llvm::cast<llvm::Function>(M.getOrInsertFunction(Name, FT).getCallee());
+    F->setDoesNotThrow();
+    F->setWillReturn();
+    F->setOnlyAccessesInaccessibleMemOrArgMem();
+    return F;
+}
+
+} // namespace
+
+MemoKey emitMemoLookup(llvm::IRBuilder<>& B, llvm::Function& F, const MemoOptions& Options) {
+    llvm::Module& M = *F.getParent();
+    llvm::LLVMContext& Ctx = M.getContext();
+    llvm::StructType* MemoTy = memoType(Ctx);
+    std::string Name = F.getName().str();
+    llvm::Constant* FnName = B.CreateGlobalString(Name, Name + ".memo.name", 0, &M);
+    llvm::Constant* Init = llvm::ConstantStruct::get(MemoTy, {
+        llvm::ConstantPointerNull::get(llvm::PointerType::getUnqual(Ctx)), FnName,
+        B.getInt64(llvm::PowerOf2Ceil(std::max<uint64_t>(Options.Capacity, 1))), B.getInt32(F.arg_size()),
+        B.getInt32(Options.Policy), B.getInt32(Options.Shards ? llvm::PowerOf2Ceil(Options.Shards) : 0), B.getInt32(0)});
+    // The runtime keeps the table in the first field.
+    auto* Memo = new llvm::GlobalVariable(M, MemoTy, false, llvm::GlobalValue::InternalLinkage, Init, Name + ".memo");
+
+    llvm::IRBuilder<> TmpB(&F.getEntryBlock(), F.getEntryBlock().begin());
+    llvm::Value* Key = TmpB.CreateAlloca(llvm::ArrayType::get(B.getInt64Ty(), F.arg_size()), nullptr, "memo.key");
+    llvm::Value* Result = TmpB.CreateAlloca(B.getInt64Ty(), nullptr, "memo.result");
+    for (auto &Arg : F.args())
+    {
+        B.CreateStore(toBits(B, &Arg), B.CreateConstInBoundsGEP1_64(B.getInt64Ty(), Key, Arg.getArgNo()));
+    }
+    llvm::Value* Found = B.CreateCall(declareMemoFunction(M, "__rdlg_memo_lookup"), {Memo, Key, Result}, "memo.found");
+
+    llvm::BasicBlock* Hit = llvm::BasicBlock::Create(Ctx, "memo.hit", &F);
+    llvm::BasicBlock* Miss = llvm::BasicBlock::Create(Ctx, "memo.miss", &F);
+    B.CreateCondBr(B.CreateICmpNE(Found, B.getInt32(0)), Hit, Miss);
+    B.SetInsertPoint(Hit);
+    B.CreateRet(fromBits(B, B.CreateLoad(B.getInt64Ty(), Result, "memo.bits"), F.getReturnType()));
+    B.SetInsertPoint(Miss);
+    return MemoKey{Memo, Key};
+}
+
+void emitMemoStore(llvm::IRBuilder<>& B, const MemoKey& Key, llvm::Value* Result) {
+    llvm::Module& M = *B.GetInsertBlock()->getModule();
+    B.CreateCall(declareMemoFunction(M, "__rdlg_memo_store"), {Key.Memo, Key.Key, toBits(B, Result)});
+}
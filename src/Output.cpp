@@ -0,0 +1,201 @@
+// Buffered output builtins, see Output.h.
+#include "../include/Output.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool isConstantPutc(llvm::Instruction& I, llvm::Function* Putc) {
+    auto* Call = llvm::dyn_cast<llvm::CallInst>(&I);
+    return Call && Call->getCalledFunction() == Putc && llvm::isa<llvm::ConstantInt>(Call->getArgOperand(0));
+}
+
+// Replaces each run of two or more putc calls with constant characters by one
+// __rdlg_write. Calls in between that may write memory end a run, their
+// output would otherwise land in the wrong place.
+unsigned batchConstantRuns(llvm::Module& M, llvm::Function* Putc) {
+    std::vector<std::vector<llvm::CallInst*>> Runs;
+    for (auto &F : M)
+    {
+        for (auto &BB : F)
+        {
+            Runs.emplace_back();
+            for (auto &I : BB)
+            {
+                if (isConstantPutc(I, Putc))
+                {
+                    Runs.back().push_back(llvm::cast<llvm::CallInst>(&I));
+                    continue;
+                }
+                auto* Call = llvm::dyn_cast<llvm::CallBase>(&I);
+                if (Call && !Call->onlyReadsMemory() && !Call->onlyAccessesArgMemory() && !Runs.back().empty())
+                {
+                    Runs.emplace_back();
+                }
+            }
+        }
+    }
+
+    unsigned Batched = 0;
+    llvm::Function* Write = nullptr;
+    for (auto &Run : Runs)
+    {
+        if (Run.size() < 2)
+        {
+            continue;
+        }
+        std::string Text;
+        for (llvm::CallInst* Call : Run)
+        {
+            Text += (char)llvm::cast<llvm::ConstantInt>(Call->getArgOperand(0))->getZExtValue();
+        }
+        Write = Write ? Write : declareOutputFunction(M, "__rdlg_write");
+        llvm::IRBuilder<> B(Run.back());
+        llvm::Constant* Str = B.CreateGlobalString(Text, "putc.batch", 0, &M, /*AddNull*/ false);
+        B.CreateCall(Write, {Str, B.getInt64(Text.size())});
+        for (llvm::CallInst* Call : Run)
+        {
+            Call->eraseFromParent();
+        }
+        Batched += Run.size();
+    }
+    return Batched;
+}
+
+// if (cur == end) __rdlg_putc(c) else *cur++ = c
+unsigned inlinePutc(llvm::Module& M, llvm::Function* Putc) {
+    std::vector<llvm::CallInst*> Calls;
+    for (llvm::User* U : Putc->users())
+    {
+        auto* Call = llvm::dyn_cast<llvm::CallInst>(U);
+        if (Call && Call->getCalledFunction() == Putc)
+        {
+            Calls.push_back(Call);
+        }
+    }
+    if (Calls.empty())
+    {
+        return 0;
+    }
+    llvm::LLVMContext& Ctx = M.getContext();
+    llvm::Type* PtrTy = llvm::PointerType::getUnqual(Ctx);
+    llvm::StructType* OutTy = llvm::StructType::get(Ctx, {PtrTy, PtrTy});
+    llvm::GlobalVariable* Out = M.getNamedGlobal("__rdlg_out");
+    if (!Out)
+    {
+        Out = new llvm::GlobalVariable(M, OutTy, false, llvm::GlobalValue::ExternalLinkage, nullptr, "__rdlg_out", nullptr,
+            llvm::GlobalValue::GeneralDynamicTLSModel);
+    }
+    llvm::MDNode* Unlikely = llvm::MDBuilder(Ctx).createUnlikelyBranchWeights();
+
+    for (llvm::CallInst* Call : Calls)
+    {
+        llvm::IRBuilder<> B(Call);
+        llvm::Value* Addr = B.CreateThreadLocalAddress(Out);
+        llvm::Value* EndAddr = B.CreateStructGEP(OutTy, Addr, 1);
+        llvm::Value* Cur = B.CreateLoad(PtrTy, Addr, "out.cur");
+        llvm::Value* End = B.CreateLoad(PtrTy, EndAddr, "out.end");
+        // Both are null before the thread's first write.
+        llvm::Value* Full = B.CreateICmpEQ(Cur, End, "out.full");
+        llvm::Instruction *SlowTerm, *FastTerm;
+        llvm::SplitBlockAndInsertIfThenElse(Full, Call->getIterator(), &SlowTerm, &FastTerm, Unlikely);
+        Call->moveBefore(SlowTerm->getIterator());
+
+        B.SetInsertPoint(FastTerm);
+        B.CreateStore(B.CreateTrunc(Call->getArgOperand(0), B.getInt8Ty()), Cur);
+        B.CreateStore(B.CreateConstInBoundsGEP1_64(B.getInt8Ty(), Cur, 1), Addr);
+    }
+    return Calls.size();
+}
+
+// The inline stores and every output function of the runtime change
+// __rdlg_out, which the module can now see, so none of them may claim to only
+// touch inaccessible memory any more. Neither may the functions calling them,
+// which the module passes may have inferred that for, as the IR can be
+// optimized again after --emit=bc or --thinlto.
+void dropMemoryAttributes(llvm::Module& M) {
+    std::vector<llvm::Function*> Worklist;
+    for (const char* Name : {"__rdlg_putc", "__rdlg_write", "__rdlg_puti", "__rdlg_putf", "__rdlg_flush"})
+    {
+        if (llvm::Function* F = M.getFunction(Name))
+        {
+            Worklist.push_back(F);
+        }
+    }
+    std::set<llvm::Function*> Seen(Worklist.begin(), Worklist.end());
+    while (!Worklist.empty())
+    {
+        llvm::Function* F = Worklist.back();
+        Worklist.pop_back();
+        F->removeFnAttr(llvm::Attribute::Memory);
+        for (llvm::User* U : F->users())
+        {
+            if (auto* Call = llvm::dyn_cast<llvm::CallBase>(U))
+            {
+                Call->removeFnAttr(llvm::Attribute::Memory);
+                if (Seen.insert(Call->getFunction()).second)
+                {
+                    Worklist.push_back(Call->getFunction());
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+llvm::Function* declareOutputFunction(llvm::Module& M, llvm::StringRef Name) {
+    llvm::LLVMContext& Ctx = M.getContext();
+    llvm::Type* VoidTy = llvm::Type::getVoidTy(Ctx);
+    llvm::FunctionType* FT;
+    if (Name == "__rdlg_putc")
+    {
+        FT = llvm::FunctionType::get(VoidTy, {llvm::Type::getInt32Ty(Ctx)}, false);
+    } else if (Name == "__rdlg_write")
+    {
+        FT = llvm::FunctionType::get(VoidTy, {llvm::PointerType::getUnqual(Ctx), llvm::Type::getInt64Ty(Ctx)}, false);
+    } else if (Name == "__rdlg_puti")
+    {
+        FT = llvm::FunctionType::get(VoidTy, {llvm::Type::getInt64Ty(Ctx)}, false);
+    } else if (Name == "__rdlg_putf")
+    {
+        FT = llvm::FunctionType::get(VoidTy, {llvm::Type::getDoubleTy(Ctx)}, false);
+    } else
+    {
+        FT = llvm::FunctionType::get(VoidTy, false);
+    }
+
+    auto* F = llvm::cast<llvm::Function>(M.getOrInsertFunction(Name, FT).getCallee());
+    F->setDoesNotThrow();
+    F->setWillReturn();
+    if (Name == "__rdlg_write")
+    {
+        F->setOnlyAccessesInaccessibleMemOrArgMem();
+        F->addParamAttr(0, llvm::Attribute::ReadOnly);
+    } else
+    {
+        F->setOnlyAccessesInaccessibleMemory();
+    }
+    return F;
+}
+
+unsigned lowerOutputCalls(llvm::Module& M) {
+    llvm::Function* Putc = M.getFunction("__rdlg_putc");
+    if (!Putc)
+    {
+        return 0;
+    }
+    unsigned Lowered = batchConstantRuns(M, Putc);
+    unsigned Inlined = inlinePutc(M, Putc);
+    if (Inlined)
+    {
+        dropMemoryAttributes(M);
+    }
+    return Lowered + Inlined;
+}
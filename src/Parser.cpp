@@ -2,6 +2,7 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
@@ -23,11 +24,29 @@
 #include "../include/Token.hpp"
 #include "../include/Lexer.h"
 #include "../include/ASTNodes.h"
+#include "../include/ASTCache.h"
+#include "../include/Comptime.h"
+#include "../include/Interface.h"
+#include "../include/MemReport.h"
+#include "../include/Timing.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <vector>
 
-Parser::Parser(const char* beg) : curTok(Token::Kind::Semicolon), lex(beg) {
+std::mutex Parser::OutputLock;
+unsigned Parser::OptLevel = 1;
+bool Parser::PrintIR = false;
+std::vector<std::string> Parser::ImportPaths;
+
+const char* Parser::functionPasses() {
+    return OptLevel == 0 ? "" : "mem2reg,instcombine,reassociate,gvn,simplifycfg";
+}
+
+Parser::Parser(const char* beg, FunctionCache* Cache, std::string SourceDirectory)
+    : curTok(Token::Kind::Semicolon), lex(beg), Cache(Cache), SourceDirectory(std::move(SourceDirectory)) {
     // llvm::InitializeNativeTarget();
     // llvm::InitializeNativeTargetAsmPrinter();
     // llvm::InitializeNativeTargetAsmParser();
@@ -50,9 +69,11 @@ Parser::Parser(const char* beg) : curTok(Token::Kind::Semicolon), lex(beg) {
 
 Parser::~Parser()
 {
+    ASTNode::resetState();
 }
 
 void Parser::InitializeModulesAndManagers() {
+    ASTNode::resetState();
     ASTNode::TheContext = std::make_unique<llvm::LLVMContext>();
     ASTNode::TheModule = std::make_unique<llvm::Module>("my cool jit", *ASTNode::TheContext);
     //ASTNode::TheModule->setDataLayout(theJIT->getDataLayout());
@@ -65,17 +86,22 @@ void Parser::InitializeModulesAndManagers() {
     ASTNode::TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
     ASTNode::TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
     ASTNode::ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
-    ASTNode::TheSI = std::make_unique<llvm::StandardInstrumentations>(*ASTNode::TheContext, /*DebugLogging*/ true);
+    ASTNode::TheSI = std::make_unique<llvm::StandardInstrumentations>(*ASTNode::TheContext, /*DebugLogging*/ false);
 
     ASTNode::TheSI->registerCallbacks(*ASTNode::ThePIC, ASTNode::TheMAM.get());
 
-    ASTNode::TheFPM->addPass(llvm::PromotePass());
-    ASTNode::TheFPM->addPass(llvm::InstCombinePass());
-    ASTNode::TheFPM->addPass(llvm::ReassociatePass());
-    ASTNode::TheFPM->addPass(llvm::GVNPass());
-    ASTNode::TheFPM->addPass(llvm::SimplifyCFGPass());
+    // -O0 leaves the functions as they were generated.
+    if (OptLevel > 0)
+    {
+        ASTNode::TheFPM->addPass(llvm::PromotePass());
+        ASTNode::TheFPM->addPass(llvm::InstCombinePass());
+        ASTNode::TheFPM->addPass(llvm::ReassociatePass());
+        ASTNode::TheFPM->addPass(llvm::GVNPass());
+        ASTNode::TheFPM->addPass(llvm::SimplifyCFGPass());
+    }
 
-    llvm::PassBuilder PB;
+    // The instrumentation is handed to the analyses, so --time-trace shows every pass.
+    llvm::PassBuilder PB(nullptr, llvm::PipelineTuningOptions(), {}, ASTNode::ThePIC.get());
     PB.registerModuleAnalyses(*ASTNode::TheMAM);
     PB.registerFunctionAnalyses(*ASTNode::TheFAM);
     PB.crossRegisterProxies(*ASTNode::TheLAM, *ASTNode::TheFAM, *ASTNode::TheCGAM, *ASTNode::TheMAM);
@@ -88,6 +114,10 @@ Token Parser::getNextToken() {
 }
 
 std::unique_ptr<ASTNode> Parser::logError(const char* str, int linenumber=0){
+    if (Record)
+    {
+        Record->Failed = true;
+    }
     if (linenumber == 0)
     {
         std::cerr << str << std::endl;
@@ -108,17 +138,25 @@ std::unique_ptr<FunctionASTNode> Parser::fLogError(const char* str, int linenumb
 }
 
 std::unique_ptr<ASTNode> Parser::parseNumberExpr() {
+    SourceLocation Loc = location();
     std::string finalNumber(std::string(curTok.lexeme()));
     double val = 0;
+    ValueType literalType = ValueType::I64;
     if (getNextToken().is(Token::Kind::Dot))
     {
         finalNumber += ".";
         finalNumber += std::string(getNextToken().lexeme());
+        literalType = ValueType::F64;
         getNextToken();
     }
     
-    val = std::stod(finalNumber);
-    auto Result = std::make_unique<NumberASTNode>(val);
+    val = std::strtod(finalNumber.c_str(), nullptr);
+    // Literals are unsigned, the minus is a unary operator.
+    if (literalType == ValueType::I64 && !(val < 9223372036854775808.0)) // 2^63
+    {
+        return logError("Integer literal doesn't fit in an i64", Loc.Line);
+    }
+    auto Result = at(Loc, std::make_unique<NumberASTNode>(val, literalType));
     //std::cout << "Parsed number" << std::endl;
     return std::move(Result);
 }
@@ -139,11 +177,17 @@ std::unique_ptr<ASTNode> Parser::parseParenExpr() {
 }
 
 std::unique_ptr<ASTNode> Parser::parseIdentifierExpr() {
+    SourceLocation Loc = location();
     std::string idName = std::string(curTok.lexeme());
     
 
     if (getNextToken().kind() != Token::Kind::LeftParen) {
-        return std::make_unique<VariableASTNode>(idName);
+        auto Var = at(Loc, std::make_unique<VariableASTNode>(idName));
+        if (curTok.is(Token::Kind::LeftSquare))
+        {
+            return parseIndexExpr(std::move(Var));
+        }
+        return Var;
     }
 
     
@@ -188,7 +232,7 @@ std::unique_ptr<ASTNode> Parser::parseIdentifierExpr() {
     // }
     //std::cout << "Parsed function call" << std::endl;
     getNextToken();
-    return std::make_unique<CallASTNode>(idName, std::move(args));
+    return at(Loc, std::make_unique<CallASTNode>(idName, std::move(args)));
 }
 
 std::unique_ptr<ASTNode> Parser::parsePrimary() {
@@ -210,6 +254,13 @@ std::unique_ptr<ASTNode> Parser::parsePrimary() {
             return ParseForExpr();
         case Token::KeywordType::Var:
             return ParseVarExpr();
+        case Token::KeywordType::Reduce:
+        case Token::KeywordType::Parallel:
+            return ParseReduceExpr();
+        case Token::KeywordType::Region:
+            return ParseRegionExpr();
+        case Token::KeywordType::Comptime:
+            return ParseComptimeExpr();
         default:
             return logError("CAUTION: Everything other than the if and for statements are not implemented. Expecting an if, for or var statement therefore", lex.getCurrentLineNumber());
         }
@@ -266,16 +317,119 @@ std::unique_ptr<ASTNode> Parser::parseBinOpRHS(int exprPrec, std::unique_ptr<AST
             }
         }
         //std::cout << "Parsed RHS" << std::endl;
-        LHS = std::make_unique<BinaryASTNode>((binOP.length() <= 1) ? (char)*binOP.lexeme().begin() : '?', std::move(LHS), std::move(RHS), binOP.length() <= 1, binOP.kind()); //attention here. this doesn't work probable
+        LHS = at(SourceLocation{binOP.line(), binOP.col()}, std::make_unique<BinaryASTNode>((binOP.length() <= 1) ? (char)*binOP.lexeme().begin() : '?', std::move(LHS), std::move(RHS), binOP.length() <= 1, binOP.kind())); //attention here. this doesn't work probable
     }
     
 }
 
+// @fastmath, @fastmath(flag...) and @nofastmath in front of a function name.
+// They replace the fast-math flags given to the compiler for that function.
+bool Parser::parseAnnotation(std::optional<unsigned>& FastMath) {
+    if (getNextToken().is_not(Token::Kind::Identifier))
+    {
+        logError("Expected an annotation after '@'", lex.getCurrentLineNumber());
+        return false;
+    }
+    if (curTok.lexeme() == "nofastmath")
+    {
+        FastMath = 0;
+        getNextToken();
+        return true;
+    } else if (curTok.lexeme() != "fastmath")
+    {
+        logError("Unknown annotation", lex.getCurrentLineNumber());
+        return false;
+    }
+
+    if (getNextToken().is_not(Token::Kind::LeftParen))
+    {
+        FastMath = FMAll;
+        return true;
+    }
+    unsigned Flags = 0;
+    getNextToken();
+    while (curTok.is_one_of(Token::Kind::Identifier, Token::Kind::Comma))
+    {
+        unsigned Flag = 0;
+        if (curTok.is(Token::Kind::Identifier) && !parseFastMathFlag(curTok.lexeme(), Flag))
+        {
+            logError("Unknown fast-math flag, expected reassoc, contract, nnan, ninf, nsz, arcp or afn", lex.getCurrentLineNumber());
+            return false;
+        }
+        Flags |= Flag;
+        getNextToken();
+    }
+    if (curTok.is_not(Token::Kind::RightParen))
+    {
+        logError("Expected ')' after the fast-math flags", lex.getCurrentLineNumber());
+        return false;
+    }
+    getNextToken();
+    FastMath = Flags;
+    return true;
+}
+
+// memo(capacity=N, evict=replace|keep, shards=N), the options are optional
+bool Parser::parseMemoOptions(MemoOptions& Options) {
+    if (getNextToken().is_not(Token::Kind::LeftParen))
+    {
+        return true;
+    }
+    getNextToken();
+    while (curTok.is(Token::Kind::Identifier))
+    {
+        std::string Name(curTok.lexeme());
+        Token::Kind ValueKind = Name == "evict" ? Token::Kind::Identifier : Token::Kind::Number;
+        if (getNextToken().is_not(Token::Kind::Equal) || getNextToken().is_not(ValueKind))
+        {
+            logError("Expected capacity=N, evict=replace|keep or shards=N in the memo options", lex.getCurrentLineNumber());
+            return false;
+        }
+        std::string Value(curTok.lexeme());
+        uint64_t Number = ValueKind == Token::Kind::Number && Value.size() <= 10 ? std::stoull(Value) : 0;
+        if (Name == "capacity" && Number >= 1 && Number <= (1u << 31))
+        {
+            Options.Capacity = Number;
+        } else if (Name == "shards" && Number <= 256)
+        {
+            Options.Shards = Number;
+        } else if (Name == "evict" && (Value == "replace" || Value == "keep"))
+        {
+            Options.Policy = Value == "keep" ? RDLG_MEMO_KEEP : RDLG_MEMO_REPLACE;
+        } else
+        {
+            logError("Invalid memo option, expected capacity from 1 to 2^31, evict=replace|keep or at most 256 shards", lex.getCurrentLineNumber());
+            return false;
+        }
+        if (getNextToken().is(Token::Kind::Comma))
+        {
+            getNextToken();
+        }
+    }
+    if (curTok.is_not(Token::Kind::RightParen))
+    {
+        logError("Expected ')' after the memo options", lex.getCurrentLineNumber());
+        return false;
+    }
+    getNextToken();
+    return true;
+}
+
 std::unique_ptr<PrototypeASTNode> Parser::parsePrototype() {
     std::string FnName;
     unsigned Kind = 0;
     unsigned BinaryPrecedence = 30;
+    std::optional<unsigned> FastMath;
+
+    while (curTok.is(Token::Kind::At))
+    {
+        if (!parseAnnotation(FastMath))
+        {
+            return nullptr;
+        }
+    }
 
+    SourceLocation Loc = location();
     if (curTok.is(Token::Kind::Identifier))
     {
         FnName = std::string(curTok.lexeme());
@@ -332,29 +486,70 @@ std::unique_ptr<PrototypeASTNode> Parser::parsePrototype() {
     }
 
     std::vector<std::string> argNames;
+    std::vector<ValueType> argTypes;
     
-    while (getNextToken().is(Token::Kind::Identifier))
+    getNextToken();
+    while (curTok.is(Token::Kind::Identifier))
     {
         argNames.push_back(std::string(curTok.lexeme()));
-        //getNextToken();
+        ValueType argType = ValueType::F64;
+        if (getNextToken().is(Token::Kind::Colon))
+        {
+            getNextToken();
+            if (!parseTypeAnnotation(argType))
+            {
+                return pLogError("Unknown type in prototype", lex.getCurrentLineNumber());
+            }
+            if (argType.vectorBits() > ValueType::MaxParameterVectorBits)
+            {
+                return pLogError("Vector parameters can be at most 128 bits wide, C passes wider ones differently", lex.getCurrentLineNumber());
+            }
+        }
+        argTypes.push_back(argType);
     }
     if (curTok.is_not(Token::Kind::RightParen))
     {
         return pLogError("Expected ')' in prototype", lex.getCurrentLineNumber());
     }
     
-    getNextToken();
+    ValueType returnType = ValueType::F64;
+    if (getNextToken().is(Token::Kind::Colon))
+    {
+        getNextToken();
+        if (!parseTypeAnnotation(returnType))
+        {
+            return pLogError("Unknown return type in prototype", lex.getCurrentLineNumber());
+        }
+        if (returnType.isArray())
+        {
+            return pLogError("Functions can't return arrays, they would outlive their region", lex.getCurrentLineNumber());
+        }
+        if (returnType.vectorBits() > ValueType::MaxParameterVectorBits)
+        {
+            return pLogError("Functions can return vectors of at most 128 bits, C returns wider ones differently", lex.getCurrentLineNumber());
+        }
+    }
     //std::cout << "Parsed function prototype" << std::endl;
-    return std::make_unique<PrototypeASTNode>(FnName, std::move(argNames), Kind != 0, BinaryPrecedence);
-    
+    auto Proto = at(Loc, std::make_unique<PrototypeASTNode>(FnName, std::move(argNames), Kind != 0, BinaryPrecedence, std::move(argTypes), returnType));
+    if (FastMath)
+    {
+        Proto->setFastMath(*FastMath);
+    }
+    return Proto;
 }
 
-std::unique_ptr<FunctionASTNode> Parser::parseDefinition() {
+std::unique_ptr<FunctionASTNode> Parser::parseDefinition(bool Pure, const std::optional<MemoOptions>& Memo) {
+    SourceLocation Loc = location();
     getNextToken();
     auto Proto = parsePrototype();
     if (!Proto) {
         return nullptr;
     }
+    Proto->setPure(Pure);
+    if (Memo)
+    {
+        Proto->setMemo(*Memo);
+    }
     if (curTok.is_not(Token::Kind::LeftCurly))
     {
         return fLogError("Left curly for opening body expected");
@@ -370,7 +565,7 @@ std::unique_ptr<FunctionASTNode> Parser::parseDefinition() {
     if (curTok.is(Token::Kind::RightCurly))
     {
         getNextToken();
-        return std::make_unique<FunctionASTNode>(std::move(Proto), std::move(bodyArgs));
+        return at(Loc, std::make_unique<FunctionASTNode>(std::move(Proto), std::move(bodyArgs)));
     }
     
     
@@ -381,30 +576,48 @@ std::unique_ptr<FunctionASTNode> Parser::parseDefinition() {
     return nullptr;
 }
 
-std::unique_ptr<PrototypeASTNode> Parser::parseExtern() {
+std::unique_ptr<PrototypeASTNode> Parser::parseExtern(bool Pure) {
     getNextToken();
     //std::cout << "Parsed extern" << std::endl;
-    return parsePrototype();
+    auto Proto = parsePrototype();
+    if (Proto && Proto->getAnnotatedFastMath())
+    {
+        return pLogError("Fast-math annotations only apply to definitions", lex.getCurrentLineNumber());
+    }
+    if (Proto && Pure)
+    {
+        // Taken on trust like __attribute__((const)) in C: no side effects, and the call returns.
+        bool ReadsArrays = false;
+        for (unsigned i = 0, e = Proto->getArgs().size(); i != e; i++)
+        {
+            ReadsArrays |= Proto->getArgType(i).isArray();
+        }
+        Proto->setPure(true);
+        Proto->setEffects(ReadsArrays ? EffectReads : 0);
+    }
+    return Proto;
 }
 
 std::unique_ptr<FunctionASTNode> Parser::parseTopLevelExpr() {
+    SourceLocation Loc = location();
     std::vector<std::unique_ptr<ASTNode>> exprs;
     if (auto E = parseExpression())
     {
         exprs.push_back(std::move(E));
         if (curTok.lexeme() == "main")
         {
-            auto Proto = std::make_unique<PrototypeASTNode>("main", std::vector<std::string>());
-            return std::make_unique<FunctionASTNode>(std::move(Proto), std::move(exprs));
+            auto Proto = at(Loc, std::make_unique<PrototypeASTNode>("main", std::vector<std::string>()));
+            return at(Loc, std::make_unique<FunctionASTNode>(std::move(Proto), std::move(exprs)));
         } else {
-            auto Proto = std::make_unique<PrototypeASTNode>("", std::vector<std::string>());
-            return std::make_unique<FunctionASTNode>(std::move(Proto), std::move(exprs));
+            auto Proto = at(Loc, std::make_unique<PrototypeASTNode>("", std::vector<std::string>()));
+            return at(Loc, std::make_unique<FunctionASTNode>(std::move(Proto), std::move(exprs)));
         } 
     }
     return nullptr;
 }
 
 std::unique_ptr<ASTNode> Parser::ParseIfExpr() {
+    SourceLocation Loc = location();
     getNextToken();
 
     auto Cond = parseExpression();
@@ -469,10 +682,11 @@ std::unique_ptr<ASTNode> Parser::ParseIfExpr() {
     }
     
     
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+    return at(Loc, std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else)));
 }
 
 std::unique_ptr<ASTNode> Parser::ParseForExpr() {
+    SourceLocation Loc = location();
     if (getNextToken().kind() != Token::Kind::Identifier)
     {
         return logError("Expected identifier after for", lex.getCurrentLineNumber());
@@ -539,7 +753,7 @@ std::unique_ptr<ASTNode> Parser::ParseForExpr() {
         return pLogError("Right curly expected", lex.getCurrentLineNumber());
     }
     getNextToken();
-    return std::make_unique<ForExprAST>(idName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+    return at(Loc, std::make_unique<ForExprAST>(idName, std::move(Start), std::move(End), std::move(Step), std::move(Body)));
 }
 
 // std::vector<std::unique_ptr<ASTNode>> Parser::parseBody() {
@@ -559,19 +773,22 @@ std::unique_ptr<ASTNode> Parser::parseUnary() {
         return parsePrimary();
     }
     
+    SourceLocation Loc = location();
     int Opc = (char)*curTok.lexeme().begin();
     getNextToken();
     if (auto Operand = parseUnary())
     {
-        return std::make_unique<UnaryExprAst>(Opc, std::move(Operand));
+        return at(Loc, std::make_unique<UnaryExprAst>(Opc, std::move(Operand)));
     }
     return nullptr;
 }
 
 std::unique_ptr<ASTNode> Parser::ParseVarExpr() {
+    SourceLocation Loc = location();
     getNextToken();
 
     std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames;
+    std::vector<TypeSlot> VarTypes;
 
     if (curTok.is_not(Token::Kind::Identifier))
     {
@@ -579,12 +796,36 @@ std::unique_ptr<ASTNode> Parser::ParseVarExpr() {
     }
     
     while (true) {
+        SourceLocation NameLoc = location();
         std::string Name = std::string(curTok.lexeme());
         getNextToken();
 
+        TypeSlot Slot;
+        int64_t fixedLength = -1;
+        if (curTok.is(Token::Kind::Colon))
+        {
+            getNextToken();
+            if (!parseTypeAnnotation(Slot.type, &fixedLength))
+            {
+                return logError("Unknown type after ':' in var", lex.getCurrentLineNumber());
+            }
+            Slot.annotated = true;
+        }
+
         std::unique_ptr<ASTNode> Init;
+        if (fixedLength >= 0)
+        {
+            // var a: f64[16] is short for var a = array(16)
+            std::vector<std::unique_ptr<ASTNode>> Length;
+            Length.push_back(at(NameLoc, std::make_unique<NumberASTNode>((double)fixedLength, ValueType::I64)));
+            Init = at(NameLoc, std::make_unique<CallASTNode>("array", std::move(Length)));
+        }
         if (curTok.is(Token::Kind::Equal))
         {
+            if (Init)
+            {
+                return logError("Fixed size arrays can't have an initializer", lex.getCurrentLineNumber());
+            }
             getNextToken();
 
             Init = parseExpression();
@@ -596,6 +837,7 @@ std::unique_ptr<ASTNode> Parser::ParseVarExpr() {
         }
         
         VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarTypes.push_back(Slot);
         if (curTok.is_not(Token::Kind::Comma))
         {
             break;
@@ -619,7 +861,248 @@ std::unique_ptr<ASTNode> Parser::ParseVarExpr() {
     {
         return nullptr;
     }
-    return std::make_unique<VarAstNode>(std::move(VarNames), std::move(Body));
+    return at(Loc, std::make_unique<VarAstNode>(std::move(VarNames), std::move(VarTypes), std::move(Body)));
+}
+
+// Parses a type name like i64, vec4<f32> or f64[] and moves past it.
+// f64[N] is only accepted where fixedLength is given.
+bool Parser::parseTypeAnnotation(ValueType& type, int64_t* fixedLength) {
+    if (curTok.is_not(Token::Kind::Identifier) || !parseTypeName(curTok.lexeme(), type))
+    {
+        return false;
+    }
+    getNextToken();
+
+    if (curTok.is(Token::Kind::LeftSquare))
+    {
+        if (type != ValueType::F64)
+        {
+            return false;
+        }
+        type = ValueType::Array;
+        if (getNextToken().is(Token::Kind::Number))
+        {
+            if (!fixedLength || curTok.lexeme().find('.') != std::string_view::npos)
+            {
+                return false;
+            }
+            *fixedLength = std::stoll(std::string(curTok.lexeme()));
+            getNextToken();
+        }
+        if (curTok.is_not(Token::Kind::RightSquare))
+        {
+            return false;
+        }
+        getNextToken();
+        return true;
+    }
+
+    if (type.isVector() && curTok.is(Token::Kind::LessThan))
+    {
+        ValueType element;
+        if (getNextToken().is_not(Token::Kind::Identifier) || !parseTypeName(curTok.lexeme(), element) || !element.isFloat() || element.isVector())
+        {
+            return false;
+        }
+        type.scalar = element.scalar;
+        if (getNextToken().is_not(Token::Kind::GreaterThan))
+        {
+            return false;
+        }
+        getNextToken();
+    }
+    return true;
+}
+
+std::unique_ptr<ASTNode> Parser::ParseReduceExpr() {
+    SourceLocation Loc = location();
+    bool Parallel = false;
+    if (curTok.type() == Token::KeywordType::Parallel)
+    {
+        Parallel = true;
+        if (getNextToken().type() != Token::KeywordType::Reduce)
+        {
+            return logError("Expected 'reduce' after 'parallel'", lex.getCurrentLineNumber());
+        }
+    }
+
+    if (getNextToken().is_not(Token::Kind::LeftParen))
+    {
+        return logError("Expected '(' after reduce", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+
+    std::string Op;
+    if (curTok.is(Token::Kind::Identifier) && (curTok.lexeme() == "min" || curTok.lexeme() == "max"))
+    {
+        Op = std::string(curTok.lexeme());
+    } else if (curTok.length() == 1 && curTok.is_not(Token::Kind::Comma) && isascii((char)*curTok.lexeme().begin()))
+    {
+        Op = std::string(curTok.lexeme());
+    } else {
+        return logError("Expected reduction operator", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+
+    std::unique_ptr<ASTNode> Identity;
+    if (curTok.is_not(Token::Kind::Comma))
+    {
+        Identity = parseExpression();
+        if (!Identity)
+        {
+            return nullptr;
+        }
+    } else if (Op != "+" && Op != "*" && Op != "min" && Op != "max")
+    {
+        return logError("user-defined reduction operator needs an identity value", lex.getCurrentLineNumber());
+    }
+
+    if (curTok.is_not(Token::Kind::Comma))
+    {
+        return logError("Expected ',' after reduction operator", lex.getCurrentLineNumber());
+    }
+
+    if (getNextToken().is_not(Token::Kind::Identifier))
+    {
+        return logError("Expected identifier in reduce", lex.getCurrentLineNumber());
+    }
+    std::string idName = std::string(curTok.lexeme());
+
+    if (getNextToken().is_not(Token::Kind::Equal))
+    {
+        return logError("Expected '=' after reduce variable", lex.getCurrentLineNumber());
+    }
+
+    getNextToken();
+    auto Start = parseExpression();
+    if (!Start)
+    {
+        return nullptr;
+    }
+
+    if (curTok.is_not(Token::Kind::Comma))
+    {
+        return logError("expected ',' after reduce start value", lex.getCurrentLineNumber());
+    }
+
+    getNextToken();
+    auto End = parseExpression();
+    if (!End)
+    {
+        return nullptr;
+    }
+
+    if (curTok.is_not(Token::Kind::RightParen))
+    {
+        return logError("expected ')' after reduce range", lex.getCurrentLineNumber());
+    }
+
+    getNextToken();
+    auto Body = parseExpression();
+    if (!Body)
+    {
+        return nullptr;
+    }
+    return at(Loc, std::make_unique<ReduceExprAST>(Op, std::move(Identity), idName, std::move(Start), std::move(End), std::move(Body), Parallel));
+}
+
+// Parses a[i] or a[lo:hi] after the base has been read.
+std::unique_ptr<ASTNode> Parser::parseIndexExpr(std::unique_ptr<ASTNode> Base) {
+    // ':' separates the slice bounds here, so a user defined ':' operator
+    // is switched off while the bounds are parsed.
+    SourceLocation Loc = location();
+    int ColonPrec = BinopPrecedence[':'];
+    BinopPrecedence[':'] = 0;
+    getNextToken();
+    auto Index = parseExpression();
+    std::unique_ptr<ASTNode> SliceEnd;
+    if (Index && curTok.is(Token::Kind::Colon))
+    {
+        getNextToken();
+        SliceEnd = parseExpression();
+        if (!SliceEnd)
+        {
+            Index = nullptr;
+        }
+    }
+    BinopPrecedence[':'] = ColonPrec;
+    if (!Index)
+    {
+        return nullptr;
+    }
+
+    if (curTok.is_not(Token::Kind::RightSquare))
+    {
+        return logError("Expected ']' after index", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+    return at(Loc, std::make_unique<IndexExprAST>(std::move(Base), std::move(Index), std::move(SliceEnd)));
+}
+
+std::unique_ptr<ASTNode> Parser::ParseRegionExpr() {
+    SourceLocation Loc = location();
+    if (getNextToken().is_not(Token::Kind::LeftCurly))
+    {
+        return logError("Expected '{' after region", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+
+    std::vector<std::unique_ptr<ASTNode>> Body;
+    while (!curTok.is_one_of(Token::Kind::RightCurly, Token::Kind::End))
+    {
+        auto expression = parseExpression();
+        if (!expression)
+        {
+            return nullptr;
+        }
+        Body.push_back(std::move(expression));
+    }
+
+    if (curTok.is_not(Token::Kind::RightCurly))
+    {
+        return logError("Right curly expected", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+    return at(Loc, std::make_unique<RegionExprAST>(std::move(Body)));
+}
+
+// comptime { ... } is evaluated as soon as it has been parsed.
+std::unique_ptr<ASTNode> Parser::ParseComptimeExpr() {
+    SourceLocation Loc = location();
+    if (getNextToken().is_not(Token::Kind::LeftCurly))
+    {
+        return logError("Expected '{' after comptime", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+
+    std::vector<std::unique_ptr<ASTNode>> Body;
+    while (!curTok.is_one_of(Token::Kind::RightCurly, Token::Kind::End))
+    {
+        auto expression = parseExpression();
+        if (!expression)
+        {
+            return nullptr;
+        }
+        Body.push_back(std::move(expression));
+    }
+
+    if (curTok.is_not(Token::Kind::RightCurly))
+    {
+        return logError("Right curly expected", lex.getCurrentLineNumber());
+    }
+    getNextToken();
+
+    ComptimeValue Value;
+    if (!ComptimeEvaluator::evaluate(std::move(Body), Value))
+    {
+        return logError("Could not evaluate comptime block", lex.getCurrentLineNumber());
+    }
+    auto Embedded = at(Loc, ComptimeEvaluator::embed(Value));
+    if (Record && Value.type.isArray())
+    {
+        Record->addValue(ItemKind::Embed, static_cast<VariableASTNode&>(*Embedded).getName(), Value);
+    }
+    return Embedded;
 }
 
 int Parser::getTokenPrecedence() {
@@ -642,12 +1125,26 @@ int Parser::getTokenPrecedence() {
     return tokPrec;
 }
 
+// Only with the reports, it would mix into the output of programs and tools otherwise.
+void Parser::reportFolding() {
+    if (TimeReport::Enabled || MemReport::Enabled)
+    {
+        std::lock_guard<std::mutex> Lock(OutputLock);
+        std::cerr << "Constant folding removed " << NodesFolded << " AST nodes." << std::endl;
+    }
+}
+
 void Parser::parse() {
     while (true)
     {
         switch (curTok.kind())
         {
             case Token::Kind::End:
+                if (MemReport::Enabled)
+                {
+                    MemReport::countTokens(lex.getTokenCount(), lex.getLexemeBytes(), lex.getBufferBytes());
+                }
+                reportFolding();
                 return;
             case Token::Kind::Semicolon:
                 getNextToken();
@@ -672,6 +1169,42 @@ void Parser::parse() {
                 {
                     HandleExtern();
                     break;
+                } else if (curTok.lexeme() == "const")
+                {
+                    HandleConst();
+                    break;
+                } else if (curTok.lexeme() == "import")
+                {
+                    HandleImport();
+                    break;
+                } else if (curTok.lexeme() == "pure")
+                {
+                    getNextToken();
+                    if (curTok.lexeme() == "fn")
+                    {
+                        HandleDefinition(true);
+                    } else if (curTok.lexeme() == "extern")
+                    {
+                        HandleExtern(true);
+                    } else
+                    {
+                        logError("Expected fn or extern after pure", lex.getCurrentLineNumber());
+                    }
+                    break;
+                } else if (curTok.lexeme() == "memo")
+                {
+                    MemoOptions Options;
+                    if (!parseMemoOptions(Options))
+                    {
+                        getNextToken();
+                    } else if (curTok.lexeme() == "fn")
+                    {
+                        HandleDefinition(false, Options);
+                    } else
+                    {
+                        logError("Expected fn after memo", lex.getCurrentLineNumber());
+                    }
+                    break;
                 }
                 getNextToken();
                 break;
@@ -683,46 +1216,283 @@ void Parser::parse() {
     
 }
 
-void Parser::HandleDefinition() {
-  if (auto FnAST = parseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-        std::cout << "Parsed a function definition." << std::endl;
-        FnIR->print(llvm::errs());
-        std::cout << "\n";
+void Parser::HandleDefinition(bool Pure, const std::optional<MemoOptions>& Memo) {
+  std::unique_ptr<FunctionASTNode> FnAST;
+  {
+    std::string Line = "line " + std::to_string(lex.getCurrentLineNumber());
+    TimeScope Scope(Phase::Parse, Line);
+    FnAST = parseDefinition(Pure, Memo);
+  }
+  if (FnAST) {
+    if (Record) {
+      Record->add(ItemKind::Definition, FnAST->serialize(Record->W));
     }
-        
+    defineFunction(std::move(FnAST));
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
-void Parser::HandleExtern() {
-  if (auto FnAST = parseExtern()) {
-    if (auto *FnIR = FnAST->codegen()) {
-        std::cout << "Parsed an extern." << std::endl;
-        FnIR->print(llvm::errs());
-        std::cout << "\n";
-        FunctionASTNode::FunctionProtos[FnAST->getName()] = std::move(FnAST);
+void Parser::defineFunction(std::unique_ptr<FunctionASTNode> FnAST) {
+    if (MemReport::Enabled) {
+      MemReport::countAST(*FnAST);
+    }
+    const std::string Name = FnAST->getName();
+    {
+      TimeScope Scope(Phase::Fold, Name);
+      NodesFolded += FnAST->foldConstants();
+    }
+    llvm::Function* FnIR;
+    {
+      TimeScope Scope(Phase::Codegen, Name);
+      FnIR = Cache ? Cache->codegen(*FnAST) : FnAST->codegen();
+    }
+    if (FnIR) {
+        if (PrintIR)
+        {
+            std::lock_guard<std::mutex> Lock(OutputLock);
+            std::cout << "Parsed a function definition." << std::endl;
+            FnIR->print(llvm::errs());
+            std::cout << "\n";
+        }
+
+        // Operator bodies are kept, later uses with literal operands are folded with them.
+        auto& Proto = FunctionASTNode::FunctionProtos[FnAST->getName()];
+        if (Proto && (Proto->isBinaryOP() || Proto->isUnaryOp()))
+        {
+            FunctionASTNode::OperatorBodies[FnAST->getName()] = std::move(FnAST);
+        }
     }
+}
+
+void Parser::HandleExtern(bool Pure) {
+  std::unique_ptr<PrototypeASTNode> FnAST;
+  {
+    std::string Line = "line " + std::to_string(lex.getCurrentLineNumber());
+    TimeScope Scope(Phase::Parse, Line);
+    FnAST = parseExtern(Pure);
+  }
+  if (FnAST) {
+    if (Record) {
+      Record->add(ItemKind::Extern, FnAST->serialize(Record->W));
+    }
+    declareExtern(std::move(FnAST));
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
+void Parser::declareExtern(std::unique_ptr<PrototypeASTNode> FnAST) {
+    if (MemReport::Enabled) {
+      MemReport::countAST(*FnAST);
+    }
+    if (auto *FnIR = FnAST->codegen()) {
+        if (PrintIR)
+        {
+            std::lock_guard<std::mutex> Lock(OutputLock);
+            std::cout << "Parsed an extern." << std::endl;
+            FnIR->print(llvm::errs());
+            std::cout << "\n";
+        }
+        FunctionASTNode::FunctionProtos[FnAST->getName()] = std::move(FnAST);
+    }
+}
+
 void Parser::HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = parseTopLevelExpr()) {
-    if (auto* FnIR = FnAST->codegen()) {
+  std::unique_ptr<FunctionASTNode> FnAST;
+  {
+    std::string Line = "line " + std::to_string(lex.getCurrentLineNumber());
+    TimeScope Scope(Phase::Parse, Line);
+    FnAST = parseTopLevelExpr();
+  }
+  if (FnAST) {
+    if (Record) {
+      Record->add(ItemKind::TopLevel, FnAST->serialize(Record->W));
+    }
+    defineTopLevel(std::move(FnAST));
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
 
+void Parser::defineTopLevel(std::unique_ptr<FunctionASTNode> FnAST) {
+    if (MemReport::Enabled) {
+      MemReport::countAST(*FnAST);
+    }
+    const std::string Name = FnAST->getName();
+    {
+      TimeScope Scope(Phase::Fold, Name);
+      NodesFolded += FnAST->foldConstants();
+    }
+    llvm::Function* FnIR;
+    {
+      TimeScope Scope(Phase::Codegen, Name);
+      FnIR = FnAST->codegen();
+    }
+    if (FnIR && PrintIR) {
+        std::lock_guard<std::mutex> Lock(OutputLock);
         std::cout << "Parsed a top-level expr" << std::endl;
         FnIR->print(llvm::errs());
         std::cout << "\n";
     }
-    
+}
+
+void Parser::HandleConst() {
+  std::string Line = "line " + std::to_string(lex.getCurrentLineNumber());
+  TimeScope Scope(Phase::Parse, Line);
+  if (getNextToken().is_not(Token::Kind::Identifier)) {
+    logError("Expected a name after const", lex.getCurrentLineNumber());
+    return;
+  }
+  std::string Name(curTok.lexeme());
+  if (getNextToken().is_not(Token::Kind::Equal)) {
+    logError("Expected '=' after the name of the const", lex.getCurrentLineNumber());
+    return;
+  }
+  getNextToken();
+
+  if (auto Expr = parseExpression()) {
+    std::vector<std::unique_ptr<ASTNode>> Body;
+    Body.push_back(std::move(Expr));
+    ComptimeValue Value;
+    if (ComptimeEvaluator::evaluate(std::move(Body), Value) && defineConst(Name, Value)) {
+      if (Record) {
+        Record->addValue(ItemKind::Const, Name, Value);
+      }
+    } else if (Record) {
+      Record->Failed = true;
+    }
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
-}
\ No newline at end of file
+}
+
+// import "name" reads name.rdlgi, written by --emit-interface when the other
+// file was compiled. Its functions are declared when they are first called.
+void Parser::HandleImport() {
+  std::string Line = "line " + std::to_string(lex.getCurrentLineNumber());
+  TimeScope Scope(Phase::Load, Line);
+  if (getNextToken().is_not(Token::Kind::String)) {
+    logError("Expected a file name in quotes after import", lex.getCurrentLineNumber());
+    return;
+  }
+  std::string Name(curTok.lexeme());
+  getNextToken();
+
+  std::string Path = importInterface(Name);
+  if (Record && !Path.empty()) {
+    Record->addImport(Name, Path);
+  }
+}
+
+bool Parser::defineConst(const std::string& Name, const ComptimeValue& Value) {
+  if (!ComptimeEvaluator::define(Name, Value)) {
+    return false;
+  }
+  std::cout << "Evaluated const " << Name << "." << std::endl;
+  return true;
+}
+
+// Returns the interface file, "" if it couldn't be read.
+std::string Parser::importInterface(const std::string& Name) {
+  std::string Path = findInterface(Name);
+  if (Path.empty()) {
+    logError(("Could not find the interface " + Name + ".rdlgi").c_str(), lex.getCurrentLineNumber());
+    return "";
+  }
+  if (!Imported.insert(Path).second) {
+    return Path;
+  }
+  std::vector<ImportedSymbol> Symbols;
+  std::string Error;
+  if (!InterfaceFile::read(Path, Symbols, Error)) {
+    logError(("Could not import " + Path + ": " + Error).c_str(), lex.getCurrentLineNumber());
+    return "";
+  }
+
+  unsigned Declared = 0;
+  for (auto &Symbol : Symbols) {
+    const std::string& SymbolName = Symbol.Proto->getName();
+    // Definitions of this file and earlier imports come first.
+    if (FunctionASTNode::FunctionProtos.count(SymbolName)) {
+      continue;
+    }
+    if (Symbol.Proto->isBinaryOP()) {
+      BinopPrecedence[Symbol.Proto->getOperatorName()] = Symbol.Proto->getBinaryPrecedence();
+    }
+    FunctionASTNode::FunctionProtos[SymbolName] = std::move(Symbol.Proto);
+    Declared++;
+    if (!Symbol.Body) {
+      continue;
+    }
+    // The bodies fold constant operands here, and from -O2 on they are
+    // inlined. The definition itself stays in the other file's object.
+    if (OptLevel >= 2) {
+      if (llvm::Function* F = Symbol.Body->codegen()) {
+        F->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        // Its lines are those of the other file, the debug info there has them.
+        llvm::stripDebugInfo(*F);
+      }
+    }
+    FunctionASTNode::OperatorBodies[SymbolName] = std::move(Symbol.Body);
+  }
+  std::lock_guard<std::mutex> Lock(OutputLock);
+  std::cout << "Imported " << Declared << " functions from " << Path << "." << std::endl;
+  return Path;
+}
+
+std::string Parser::findInterface(const std::string& Name) {
+  std::string File = llvm::StringRef(Name).ends_with(".rdlgi") ? Name : Name + ".rdlgi";
+  if (llvm::sys::path::is_absolute(File)) {
+    return llvm::sys::fs::exists(File) ? File : "";
+  }
+  std::vector<std::string> Directories = ImportPaths;
+  Directories.push_back(SourceDirectory.empty() ? "." : SourceDirectory);
+  for (auto &Directory : Directories) {
+    llvm::SmallString<128> Path(Directory);
+    llvm::sys::path::append(Path, File);
+    if (llvm::sys::fs::exists(Path)) {
+      return std::string(Path);
+    }
+  }
+  return "";
+}
+
+// Does with the items of an AST cache entry what parse() did with them when
+// the entry was stored. Nothing is done if an imported interface changed since.
+bool Parser::replay(std::vector<CachedItem>& Items) {
+  for (auto &Item : Items) {
+    if (Item.Kind == ItemKind::Import && (findInterface(Item.Name) != Item.Path || ASTCache::hashFile(Item.Path) != Item.Hash)) {
+      return false;
+    }
+  }
+  for (auto &Item : Items) {
+    switch (Item.Kind) {
+      case ItemKind::Definition:
+        defineFunction(std::move(Item.Function));
+        break;
+      case ItemKind::Extern:
+        declareExtern(std::move(Item.Proto));
+        break;
+      case ItemKind::TopLevel:
+        defineTopLevel(std::move(Item.Function));
+        break;
+      case ItemKind::Const:
+        defineConst(Item.Name, Item.Value);
+        break;
+      case ItemKind::Embed:
+        ComptimeEvaluator::embed(Item.Value, Item.Name);
+        break;
+      case ItemKind::Import:
+        importInterface(Item.Name);
+        break;
+    }
+  }
+  reportFolding();
+  return true;
+}
@@ -0,0 +1,151 @@
+// Purity analysis, see Purity.h. Also holds the collectEffects methods of the AST nodes.
+#include "../include/Purity.h"
+#include "../include/ASTNodes.h"
+#include "llvm/Support/ModRef.h"
+
+void Effects::add(unsigned More, const std::string& Why) {
+    if (Reason.empty() && (More & ~Flags & ImpureEffects))
+    {
+        Reason = Why;
+    }
+    Flags |= More;
+}
+
+void Effects::call(const std::string& Callee) {
+    if (Callee == Self)
+    {
+        add(EffectMayNotReturn, "");
+        return;
+    }
+    // Callees are generated first, their attributes are already final.
+    llvm::Function* F = FunctionASTNode::getFunction(Callee);
+    add(F ? effectsOf(*F) : EffectAll, "calls " + Callee + ", which has side effects");
+}
+
+unsigned effectsOf(const llvm::Function& F) {
+    unsigned Flags = F.doesNotAccessMemory() ? 0 : F.onlyReadsMemory() ? EffectReads : EffectOther;
+    if (!F.doesNotThrow())
+    {
+        Flags |= EffectMayUnwind;
+    }
+    if (!F.willReturn())
+    {
+        Flags |= EffectMayNotReturn;
+    }
+    return Flags;
+}
+
+void applyEffects(llvm::Function& F, unsigned Flags) {
+    // A definition replaces what an earlier extern promised.
+    F.removeFnAttr(llvm::Attribute::Memory);
+    F.removeFnAttr(llvm::Attribute::NoUnwind);
+    F.removeFnAttr(llvm::Attribute::WillReturn);
+    // Arrays are passed as {ptr, i64} values, so reads of them can't be narrowed to argmem.
+    if (!(Flags & (EffectReads | ImpureEffects)))
+    {
+        F.setDoesNotAccessMemory();
+    } else if (!(Flags & ImpureEffects))
+    {
+        F.setOnlyReadsMemory();
+    }
+    if (!(Flags & EffectMayUnwind))
+    {
+        F.setDoesNotThrow();
+    }
+    if (!(Flags & EffectMayNotReturn))
+    {
+        F.setWillReturn();
+    }
+}
+
+void applyMemoEffects(llvm::Function& F, unsigned Flags) {
+    applyEffects(F, Flags);
+    llvm::MemoryEffects Memory = llvm::MemoryEffects::inaccessibleMemOnly() | llvm::MemoryEffects::argMemOnly(llvm::ModRefInfo::Ref);
+    if (Flags & EffectReads)
+    {
+        Memory |= llvm::MemoryEffects::readOnly();
+    }
+    F.setMemoryEffects(Memory);
+}
+
+void ASTNode::collectEffects(Effects& E) {
+    forEachChild([&](std::unique_ptr<ASTNode>& Child) { Child->collectEffects(E); });
+}
+
+void BinaryASTNode::collectEffects(Effects& E) {
+    ASTNode::collectEffects(E);
+    if (op == '=')
+    {
+        auto* Element = dynamic_cast<IndexExprAST*>(LHS.get());
+        if (Element && Element->isArrayElement())
+        {
+            E.add(EffectWrites, "writes to an array");
+        }
+    } else if (!isBuiltinOperator())
+    {
+        E.call(std::string("binary") + op);
+    }
+}
+
+bool IndexExprAST::isArrayElement() const {
+    return Base->exprType.isArray() && !SliceEnd;
+}
+
+void IndexExprAST::collectEffects(Effects& E) {
+    ASTNode::collectEffects(E);
+    if (isArrayElement())
+    {
+        E.add(EffectReads, "");
+    } else if (SliceEnd)
+    {
+        // A slice out of bounds traps.
+        E.add(EffectMayNotReturn, "");
+    }
+}
+
+void CallASTNode::collectEffects(Effects& E) {
+    ASTNode::collectEffects(E);
+    if (!isBuiltin())
+    {
+        E.call(callee);
+    } else if (callee == "putc" || callee == "putn" || callee == "newline" || callee == "flush")
+    {
+        E.add(EffectOther, "writes output");
+    } else if (callee == "array")
+    {
+        E.add(EffectOther, "allocates an array");
+    }
+}
+
+void ForExprAST::collectEffects(Effects& E) {
+    // The end condition is an arbitrary expression.
+    ASTNode::collectEffects(E);
+    E.add(EffectMayNotReturn, "");
+}
+
+void UnaryExprAst::collectEffects(Effects& E) {
+    ASTNode::collectEffects(E);
+    E.call(std::string("unary") + Opcode);
+}
+
+void RegionExprAST::collectEffects(Effects& E) {
+    ASTNode::collectEffects(E);
+    E.add(EffectOther, "enters a region");
+}
+
+void ReduceExprAST::collectEffects(Effects& E) {
+    ASTNode::collectEffects(E);
+    if (Parallel)
+    {
+        E.add(EffectOther, "runs a parallel reduce");
+    }
+    if (isUserOperator())
+    {
+        E.call("binary" + Op);
+    }
+    // Only an i64 counter is sure to reach the end of the range.
+    if (VarType.type != ValueType::I64)
+    {
+        E.add(EffectMayNotReturn, "");
+    }
+}
@@ -0,0 +1,126 @@
+// Optimization remarks, see Remarks.h.
+#include "../include/Remarks.h"
+#include "../include/Parser.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/Regex.h"
+#include <mutex>
+#include <optional>
+
+namespace {
+
+// The function a remark is about as it is called in the source. Functions
+// the compiler generates are named after the function they were made for,
+// <name>.reduce.chunk, <name>.cold.1 and so on.
+std::string sourceFunction(llvm::StringRef Name) {
+    if (Name.starts_with("reduce.combine."))
+    {
+        return "the combine function of a parallel reduce";
+    }
+    llvm::StringRef Base = Name.split('.').first;
+    return Base.empty() ? "a top-level expression" : "'" + Base.str() + "'";
+}
+
+class RemarkPrinter : public llvm::DiagnosticHandler {
+    private:
+        std::optional<llvm::Regex> Passed, Missed, Analysis;
+        std::string Source;
+
+        static bool matches(const std::optional<llvm::Regex>& Filter, llvm::StringRef PassName) {
+            return Filter && Filter->match(PassName);
+        }
+
+    public:
+        RemarkPrinter(const RemarkOptions& Options, std::string Source) : Source(std::move(Source)) {
+            if (!Options.Passed.empty())
+            {
+                Passed.emplace(Options.Passed);
+            }
+            if (!Options.Missed.empty())
+            {
+                Missed.emplace(Options.Missed);
+            }
+            if (!Options.Analysis.empty())
+            {
+                Analysis.emplace(Options.Analysis);
+            }
+        }
+
+        bool isPassedOptRemarkEnabled(llvm::StringRef PassName) const override { return matches(Passed, PassName); }
+        bool isMissedOptRemarkEnabled(llvm::StringRef PassName) const override { return matches(Missed, PassName); }
+        bool isAnalysisRemarkEnabled(llvm::StringRef PassName) const override { return matches(Analysis, PassName); }
+        bool isAnyRemarkEnabled() const override { return Passed || Missed || Analysis; }
+
+        bool handleDiagnostics(const llvm::DiagnosticInfo& DI) override {
+            auto* Remark = llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&DI);
+            if (!Remark)
+            {
+                return false; // errors and warnings are printed as usual
+            }
+            if (!Remark->isEnabled())
+            {
+                return true;
+            }
+
+            std::string Where = Source;
+            std::string Function;
+            if (auto* Located = llvm::dyn_cast<llvm::DiagnosticInfoWithLocationBase>(Remark))
+            {
+                if (Located->isLocationAvailable())
+                {
+                    Where += ":" + std::to_string(Located->getLocation().getLine()) + ":" + std::to_string(Located->getLocation().getColumn());
+                }
+                Function = sourceFunction(Located->getFunction().getName());
+            }
+            const char* Flag = Remark->isPassed() ? "-Rpass" : Remark->isMissed() ? "-Rpass-missed" : "-Rpass-analysis";
+
+            std::lock_guard<std::mutex> Lock(Parser::OutputLock);
+            llvm::errs() << Where << ": remark: ";
+            if (!Function.empty())
+            {
+                llvm::errs() << "in " << Function << ": ";
+            }
+            llvm::errs() << Remark->getMsg() << " [" << Flag << "=" << Remark->getPassName() << "]\n";
+            return true;
+        }
+};
+
+} // namespace
+
+bool isValidRemarkFilter(const std::string& Regex, std::string& Error) {
+    return llvm::Regex(Regex).isValid(Error);
+}
+
+bool FileRemarks::begin(llvm::LLVMContext& Ctx, const RemarkOptions& Options, const std::string& Source, const std::string& Output) {
+    Context = &Ctx;
+    if (Options.printing())
+    {
+        Ctx.setDiagnosticHandler(std::make_unique<RemarkPrinter>(Options, Source));
+    }
+    if (!Options.Record)
+    {
+        return true;
+    }
+    std::string File = Options.RecordFile.empty() ? Output + ".opt.yaml" : Options.RecordFile;
+    auto Opened = llvm::setupLLVMOptimizationRemarks(Ctx, File, /*RemarksPasses*/ "", "yaml", /*RemarksWithHotness*/ false);
+    if (!Opened)
+    {
+        llvm::errs() << "could not write " << File << ": " << llvm::toString(Opened.takeError()) << "\n";
+        return false;
+    }
+    Record = std::move(*Opened);
+    return true;
+}
+
+FileRemarks::~FileRemarks() {
+    if (Record)
+    {
+        // The streamers refer to the file, they go first.
+        Context->setLLVMRemarkStreamer(nullptr);
+        Context->setMainRemarkStreamer(nullptr);
+        Record->keep();
+    }
+}
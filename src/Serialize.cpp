@@ -0,0 +1,553 @@
+// Binary AST format, see Serialize.h. Also holds the serialize methods of
+// the AST nodes.
+#include "../include/Serialize.h"
+#include "llvm/Support/Endian.h"
+#include <cstring>
+
+namespace {
+
+uint32_t encodeType(ValueType Type) {
+    return (uint32_t)Type.scalar | Type.lanes << 8 | (uint32_t)Type.array << 16;
+}
+
+bool decodeType(uint32_t Word, ValueType& Type) {
+    unsigned Scalar = Word & 0xff, Lanes = (Word >> 8) & 0xff;
+    if (Scalar > (unsigned)ScalarType::F64 || (Lanes != 0 && Lanes != 2 && Lanes != 4 && Lanes != 8) || (Word >> 16) > 1)
+    {
+        return false;
+    }
+    Type = ValueType{(ScalarType)Scalar, Lanes, (Word >> 16) != 0};
+    return true;
+}
+
+// Writes the children in order and returns their offsets, nullptr children are written as 0.
+std::vector<uint32_t> serializeAll(std::vector<std::unique_ptr<ASTNode>>& Exprs, ASTWriter& W) {
+    std::vector<uint32_t> Offsets;
+    for (auto &expr : Exprs)
+    {
+        Offsets.push_back(expr ? expr->serialize(W) : 0);
+    }
+    return Offsets;
+}
+
+uint32_t serializeOptional(std::unique_ptr<ASTNode>& Node, ASTWriter& W) {
+    return Node ? Node->serialize(W) : 0;
+}
+
+} // namespace
+
+ASTWriter::ASTWriter() {
+    word(0);
+}
+
+void ASTWriter::begin(NodeKind Kind, const std::vector<uint32_t>& Children, SourceLocation Loc) {
+    Start = Buffer.size();
+    word((uint32_t)Kind | (uint32_t)Children.size() << 8);
+    word(0); // payload size, filled in by end()
+    word(Loc.Line);
+    word(Loc.Col);
+    for (uint32_t Child : Children)
+    {
+        word(Child);
+    }
+}
+
+void ASTWriter::word(uint32_t Value) {
+    char Bytes[4];
+    llvm::support::endian::write32le(Bytes, Value);
+    Buffer.append(Bytes, 4);
+}
+
+void ASTWriter::word64(uint64_t Value) {
+    word((uint32_t)Value);
+    word((uint32_t)(Value >> 32));
+}
+
+void ASTWriter::number(double Value) {
+    uint64_t Bits;
+    std::memcpy(&Bits, &Value, sizeof(Bits));
+    word64(Bits);
+}
+
+void ASTWriter::type(ValueType Type) {
+    word(encodeType(Type));
+}
+
+void ASTWriter::slot(const TypeSlot& Slot) {
+    // Inferred types are found again when the function is generated.
+    word(Slot.annotated ? encodeType(Slot.type) | 1u << 24 : 0);
+}
+
+void ASTWriter::name(const std::string& Name) {
+    word(Name.size());
+    Buffer += Name;
+    Buffer.append((4 - Name.size() % 4) % 4, '\0');
+}
+
+uint32_t ASTWriter::end() {
+    uint32_t Header = llvm::support::endian::read32le(Buffer.data() + Start);
+    size_t Payload = Buffer.size() - Start - 16 - 4 * (Header >> 8);
+    llvm::support::endian::write32le(&Buffer[Start + 4], Payload / 4);
+    return Start;
+}
+
+uint32_t ASTReader::wordAt(uint32_t Offset) const {
+    return llvm::support::endian::read32le(Data.data() + Offset);
+}
+
+bool ASTReader::node(uint32_t Offset, Node& N) const {
+    if (Offset == 0 || Offset % 4 || (uint64_t)Offset + 16 > Data.size())
+    {
+        return false;
+    }
+    uint32_t Header = wordAt(Offset);
+    uint64_t ChildCount = Header >> 8, PayloadWords = wordAt(Offset + 4);
+    uint64_t End = Offset + 16 + 4 * (ChildCount + PayloadWords);
+    if ((Header & 0xff) > (uint32_t)NodeKind::Import || End > Data.size())
+    {
+        return false;
+    }
+    N.Kind = (NodeKind)(Header & 0xff);
+    N.Offset = Offset;
+    N.Loc = SourceLocation{wordAt(Offset + 8), wordAt(Offset + 12)};
+    N.Children.clear();
+    for (uint32_t i = 0; i < ChildCount; i++)
+    {
+        // Children come before their parent, which rules out cycles.
+        uint32_t Child = wordAt(Offset + 16 + 4 * i);
+        if (Child >= Offset)
+        {
+            return false;
+        }
+        N.Children.push_back(Child);
+    }
+    N.Payload = Offset + 16 + 4 * ChildCount;
+    N.PayloadEnd = End;
+    return true;
+}
+
+uint32_t ASTReader::Cursor::word() {
+    if (Pos + 4 > End)
+    {
+        Ok = false;
+        return 0;
+    }
+    uint32_t Value = R.wordAt(Pos);
+    Pos += 4;
+    return Value;
+}
+
+uint64_t ASTReader::Cursor::word64() {
+    uint64_t Value = word();
+    return Value | (uint64_t)word() << 32;
+}
+
+double ASTReader::Cursor::number() {
+    uint64_t Bits = word64();
+    double Value;
+    std::memcpy(&Value, &Bits, sizeof(Value));
+    return Value;
+}
+
+ValueType ASTReader::Cursor::type() {
+    ValueType Type = ValueType::F64;
+    if (!decodeType(word(), Type))
+    {
+        Ok = false;
+    }
+    return Type;
+}
+
+TypeSlot ASTReader::Cursor::slot() {
+    uint32_t Word = word();
+    TypeSlot Slot;
+    if (Word >> 24)
+    {
+        Slot.annotated = true;
+        Ok &= decodeType(Word & 0xffffff, Slot.type);
+    }
+    return Slot;
+}
+
+std::string ASTReader::Cursor::name() {
+    uint32_t Size = word();
+    if (!Ok || Size > End - Pos)
+    {
+        Ok = false;
+        return "";
+    }
+    std::string Name(R.Data.data() + Pos, Size);
+    Pos += (Size + 3) / 4 * 4;
+    return Name;
+}
+
+std::unique_ptr<ASTNode> ASTReader::read(uint32_t Offset) const {
+    Node N;
+    if (!node(Offset, N))
+    {
+        return nullptr;
+    }
+    Cursor C(*this, N);
+    // Reads the children, Required of them must be present.
+    std::vector<std::unique_ptr<ASTNode>> Children;
+    auto readChildren = [&](size_t Required) {
+        for (size_t i = 0; i < N.Children.size(); i++)
+        {
+            Children.push_back(N.Children[i] ? read(N.Children[i]) : nullptr);
+            if (!Children.back() && (i < Required || N.Children[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto take = [&](size_t From, size_t To) {
+        std::vector<std::unique_ptr<ASTNode>> Range;
+        for (size_t i = From; i < To; i++)
+        {
+            Range.push_back(std::move(Children[i]));
+        }
+        return Range;
+    };
+
+    std::unique_ptr<ASTNode> Result;
+    switch (N.Kind)
+    {
+        case NodeKind::Number:
+        {
+            ValueType Type = C.type();
+            double Value = C.number();
+            Result = std::make_unique<NumberASTNode>(Value, Type);
+            break;
+        }
+        case NodeKind::Variable:
+            Result = std::make_unique<VariableASTNode>(C.name());
+            break;
+        case NodeKind::Binary:
+        {
+            char Op = (char)C.word();
+            bool SingleChar = C.word() != 0;
+            auto Kind = (Token::Kind)C.word();
+            if (N.Children.size() == 2 && readChildren(2))
+            {
+                Result = std::make_unique<BinaryASTNode>(Op, std::move(Children[0]), std::move(Children[1]), SingleChar, Kind);
+            }
+            break;
+        }
+        case NodeKind::Index:
+            if (N.Children.size() == 3 && readChildren(2))
+            {
+                Result = std::make_unique<IndexExprAST>(std::move(Children[0]), std::move(Children[1]), std::move(Children[2]));
+            }
+            break;
+        case NodeKind::Call:
+        {
+            std::string Callee = C.name();
+            if (readChildren(N.Children.size()))
+            {
+                Result = std::make_unique<CallASTNode>(Callee, take(0, Children.size()));
+            }
+            break;
+        }
+        case NodeKind::Prototype:
+            return readPrototype(Offset);
+        case NodeKind::Function:
+            return readFunction(Offset);
+        case NodeKind::If:
+        {
+            uint32_t ThenCount = C.word();
+            if (!N.Children.empty() && ThenCount < N.Children.size() && readChildren(N.Children.size()))
+            {
+                Result = std::make_unique<IfExprAST>(std::move(Children[0]), take(1, 1 + ThenCount), take(1 + ThenCount, Children.size()));
+            }
+            break;
+        }
+        case NodeKind::For:
+        {
+            std::string VarName = C.name();
+            if (N.Children.size() >= 3 && readChildren(2))
+            {
+                for (size_t i = 3; i < Children.size(); i++)
+                {
+                    if (!Children[i])
+                    {
+                        return nullptr;
+                    }
+                }
+                Result = std::make_unique<ForExprAST>(VarName, std::move(Children[0]), std::move(Children[1]), std::move(Children[2]), take(3, Children.size()));
+            }
+            break;
+        }
+        case NodeKind::Unary:
+        {
+            char Opcode = (char)C.word();
+            if (N.Children.size() == 1 && readChildren(1))
+            {
+                Result = std::make_unique<UnaryExprAst>(Opcode, std::move(Children[0]));
+            }
+            break;
+        }
+        case NodeKind::Var:
+        {
+            uint32_t Count = C.word();
+            std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> VarNames;
+            std::vector<TypeSlot> VarTypes;
+            for (uint32_t i = 0; i < Count && C.ok(); i++)
+            {
+                VarNames.push_back(std::make_pair(C.name(), nullptr));
+                VarTypes.push_back(C.slot());
+            }
+            // The initializers are optional, the body is not.
+            if (C.ok() && N.Children.size() == Count + 1 && N.Children.back() && readChildren(0))
+            {
+                for (uint32_t i = 0; i < Count; i++)
+                {
+                    VarNames[i].second = std::move(Children[i]);
+                }
+                Result = std::make_unique<VarAstNode>(std::move(VarNames), std::move(VarTypes), std::move(Children.back()));
+            }
+            break;
+        }
+        case NodeKind::Region:
+            if (readChildren(N.Children.size()))
+            {
+                Result = std::make_unique<RegionExprAST>(take(0, Children.size()));
+            }
+            break;
+        case NodeKind::Reduce:
+        {
+            std::string Op = C.name();
+            std::string VarName = C.name();
+            bool Parallel = C.word() != 0;
+            if (N.Children.size() == 4 && N.Children[1] && readChildren(0) && Children[1] && Children[2] && Children[3])
+            {
+                Result = std::make_unique<ReduceExprAST>(Op, std::move(Children[0]), VarName, std::move(Children[1]), std::move(Children[2]),
+                    std::move(Children[3]), Parallel);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    if (Result)
+    {
+        Result->Loc = N.Loc;
+    }
+    return C.ok() ? std::move(Result) : nullptr;
+}
+
+std::unique_ptr<PrototypeASTNode> ASTReader::readPrototype(uint32_t Offset) const {
+    Node N;
+    if (!node(Offset, N) || N.Kind != NodeKind::Prototype || !N.Children.empty())
+    {
+        return nullptr;
+    }
+    Cursor C(*this, N);
+    std::string Name = C.name();
+    bool IsOperator = C.word() != 0;
+    unsigned Precedence = C.word();
+    uint32_t ArgCount = C.word();
+    std::vector<std::string> Args;
+    std::vector<ValueType> ArgTypes;
+    for (uint32_t i = 0; i < ArgCount && C.ok(); i++)
+    {
+        Args.push_back(C.name());
+        ArgTypes.push_back(C.type());
+    }
+    ValueType ReturnType = C.type();
+    bool HasFastMath = C.word() != 0;
+    unsigned FastMath = C.word();
+    bool Pure = C.word() != 0;
+    unsigned Effects = C.word();
+    bool HasMemo = C.word() != 0;
+    MemoOptions Memo;
+    Memo.Capacity = C.word64();
+    Memo.Policy = C.word();
+    Memo.Shards = C.word();
+    if (!C.ok() || FastMath & ~FMAll || Effects & ~EffectAll || Memo.Policy > RDLG_MEMO_KEEP)
+    {
+        return nullptr;
+    }
+    auto Proto = std::make_unique<PrototypeASTNode>(Name, std::move(Args), IsOperator, Precedence, std::move(ArgTypes), ReturnType);
+    Proto->Loc = N.Loc;
+    if (HasFastMath)
+    {
+        Proto->setFastMath(FastMath);
+    }
+    Proto->setPure(Pure);
+    Proto->setEffects(Effects);
+    if (HasMemo)
+    {
+        Proto->setMemo(Memo);
+    }
+    return Proto;
+}
+
+std::unique_ptr<FunctionASTNode> ASTReader::readFunction(uint32_t Offset) const {
+    Node N;
+    if (!node(Offset, N) || N.Kind != NodeKind::Function || N.Children.empty())
+    {
+        return nullptr;
+    }
+    auto Proto = readPrototype(N.Children[0]);
+    if (!Proto)
+    {
+        return nullptr;
+    }
+    std::vector<std::unique_ptr<ASTNode>> Body;
+    for (size_t i = 1; i < N.Children.size(); i++)
+    {
+        Body.push_back(read(N.Children[i]));
+        if (!Body.back())
+        {
+            return nullptr;
+        }
+    }
+    auto Function = std::make_unique<FunctionASTNode>(std::move(Proto), std::move(Body));
+    Function->Loc = N.Loc;
+    return Function;
+}
+
+uint32_t ASTNode::serialize(ASTWriter& W) {
+    W.fail();
+    return 0;
+}
+
+uint32_t NumberASTNode::serialize(ASTWriter& W) {
+    W.begin(NodeKind::Number, {}, Loc);
+    W.type(literalType);
+    W.number(val);
+    return W.end();
+}
+
+uint32_t VariableASTNode::serialize(ASTWriter& W) {
+    W.begin(NodeKind::Variable, {}, Loc);
+    W.name(varName);
+    return W.end();
+}
+
+uint32_t BinaryASTNode::serialize(ASTWriter& W) {
+    uint32_t L = LHS->serialize(W), R = RHS->serialize(W);
+    W.begin(NodeKind::Binary, {L, R}, Loc);
+    W.word((uint8_t)op);
+    W.word(isSinglecharOperator);
+    W.word((uint32_t)tokenkind);
+    return W.end();
+}
+
+uint32_t IndexExprAST::serialize(ASTWriter& W) {
+    uint32_t B = Base->serialize(W), I = Index->serialize(W), E = serializeOptional(SliceEnd, W);
+    W.begin(NodeKind::Index, {B, I, E}, Loc);
+    return W.end();
+}
+
+uint32_t CallASTNode::serialize(ASTWriter& W) {
+    W.begin(NodeKind::Call, serializeAll(args, W), Loc);
+    W.name(callee);
+    return W.end();
+}
+
+uint32_t PrototypeASTNode::serialize(ASTWriter& W) {
+    W.begin(NodeKind::Prototype, {}, Loc);
+    W.name(name);
+    W.word(isOperator);
+    W.word(Precedence);
+    W.word(args.size());
+    for (unsigned i = 0, e = args.size(); i != e; i++)
+    {
+        W.name(args[i]);
+        W.type(getArgType(i));
+    }
+    W.type(returnType);
+    W.word(fastMath.has_value());
+    W.word(fastMath.value_or(0));
+    W.word(pure);
+    W.word(effects);
+    W.word(memo.has_value());
+    MemoOptions Memo = memo.value_or(MemoOptions{});
+    W.word64(Memo.Capacity);
+    W.word(Memo.Policy);
+    W.word(Memo.Shards);
+    return W.end();
+}
+
+uint32_t FunctionASTNode::serialize(ASTWriter& W) {
+    // After codegen the prototype has moved to FunctionProtos.
+    auto Stored = FunctionProtos.find(name);
+    PrototypeASTNode* P = proto ? proto.get() : Stored != FunctionProtos.end() ? Stored->second.get() : nullptr;
+    if (!P)
+    {
+        W.fail();
+        return 0;
+    }
+    std::vector<uint32_t> Children = {P->serialize(W)};
+    for (uint32_t Offset : serializeAll(body, W))
+    {
+        Children.push_back(Offset);
+    }
+    W.begin(NodeKind::Function, Children, Loc);
+    return W.end();
+}
+
+uint32_t IfExprAST::serialize(ASTWriter& W) {
+    std::vector<uint32_t> Children = {Cond->serialize(W)};
+    for (auto *Branch : {&Then, &Else})
+    {
+        for (uint32_t Offset : serializeAll(*Branch, W))
+        {
+            Children.push_back(Offset);
+        }
+    }
+    W.begin(NodeKind::If, Children, Loc);
+    W.word(Then.size());
+    return W.end();
+}
+
+uint32_t ForExprAST::serialize(ASTWriter& W) {
+    std::vector<uint32_t> Children = {Start->serialize(W), End->serialize(W), serializeOptional(Step, W)};
+    for (uint32_t Offset : serializeAll(Body, W))
+    {
+        Children.push_back(Offset);
+    }
+    W.begin(NodeKind::For, Children, Loc);
+    W.name(VarName);
+    return W.end();
+}
+
+uint32_t UnaryExprAst::serialize(ASTWriter& W) {
+    uint32_t O = Operand->serialize(W);
+    W.begin(NodeKind::Unary, {O}, Loc);
+    W.word((uint8_t)Opcode);
+    return W.end();
+}
+
+uint32_t VarAstNode::serialize(ASTWriter& W) {
+    std::vector<uint32_t> Children;
+    for (auto &Var : VarNames)
+    {
+        Children.push_back(serializeOptional(Var.second, W));
+    }
+    Children.push_back(Body->serialize(W));
+    W.begin(NodeKind::Var, Children, Loc);
+    W.word(VarNames.size());
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        W.name(VarNames[i].first);
+        W.slot(VarTypes[i]);
+    }
+    return W.end();
+}
+
+uint32_t RegionExprAST::serialize(ASTWriter& W) {
+    W.begin(NodeKind::Region, serializeAll(Body, W), Loc);
+    return W.end();
+}
+
+uint32_t ReduceExprAST::serialize(ASTWriter& W) {
+    std::vector<uint32_t> Children = {serializeOptional(Identity, W), Start->serialize(W), End->serialize(W), Body->serialize(W)};
+    W.begin(NodeKind::Reduce, Children, Loc);
+    W.name(Op);
+    W.name(VarName);
+    W.word(Parallel);
+    return W.end();
+}
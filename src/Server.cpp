@@ -0,0 +1,320 @@
+// Compile server and client, see Server.h.
+//
+// A request is one connection. The client sends the length of the payload
+// together with its stdout and stderr (SCM_RIGHTS), then the payload: its
+// working directory and arguments, each terminated by a NUL byte. The server
+// answers with the exit status as an int32_t once the compilation is done.
+// A connection that is closed without a status means the compilation crashed.
+#include "../include/Server.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+char ListeningPath[sizeof(sockaddr_un::sun_path)];
+
+bool makeAddress(const std::string& Path, sockaddr_un& Addr) {
+    if (Path.size() >= sizeof(Addr.sun_path))
+    {
+        std::cerr << "socket path too long: " << Path << std::endl;
+        return false;
+    }
+    std::memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    std::memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+    return true;
+}
+
+bool writeAll(int FD, const void* Data, size_t Size) {
+    const char* P = (const char*)Data;
+    while (Size)
+    {
+        ssize_t N = send(FD, P, Size, MSG_NOSIGNAL);
+        if (N < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (N <= 0)
+        {
+            return false;
+        }
+        P += N;
+        Size -= N;
+    }
+    return true;
+}
+
+bool readAll(int FD, void* Data, size_t Size) {
+    char* P = (char*)Data;
+    while (Size)
+    {
+        ssize_t N = read(FD, P, Size);
+        if (N < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (N <= 0)
+        {
+            return false;
+        }
+        P += N;
+        Size -= N;
+    }
+    return true;
+}
+
+// The socket of the default path lives in a directory only the user can get
+// into, so no one else can put a socket there first. Created by the server.
+bool privateDirectory(const std::string& SocketPath, bool Create) {
+    if (SocketPath != defaultSocketPath())
+    {
+        return true;
+    }
+    std::string Directory = SocketPath.substr(0, SocketPath.rfind('/'));
+    if (Create && mkdir(Directory.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        std::cerr << "could not create " << Directory << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat St;
+    if (lstat(Directory.c_str(), &St) != 0)
+    {
+        return false; // no server has run yet
+    }
+    if (!S_ISDIR(St.st_mode) || St.st_uid != getuid() || (St.st_mode & 0077))
+    {
+        std::cerr << Directory << " isn't a directory of only this user, not using the compile server there" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Nobody but the user may send the server work or receive the client's
+// output streams.
+bool samePeerUser(int Connection) {
+    ucred Peer;
+    socklen_t Size = sizeof(Peer);
+    return getsockopt(Connection, SOL_SOCKET, SO_PEERCRED, &Peer, &Size) == 0 && Peer.uid == getuid();
+}
+
+void stopServer(int Signal) {
+    unlink(ListeningPath);
+    _exit(0);
+}
+
+// Runs in the forked child, never returns.
+[[noreturn]] void serve(int Connection, const CompileFunction& Compile) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    uint32_t Length;
+    int Streams[2];
+    iovec IO{&Length, sizeof(Length)};
+    alignas(cmsghdr) char Control[CMSG_SPACE(sizeof(Streams))];
+    msghdr Msg{};
+    Msg.msg_iov = &IO;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = Control;
+    Msg.msg_controllen = sizeof(Control);
+    if (recvmsg(Connection, &Msg, MSG_WAITALL) != sizeof(Length))
+    {
+        _exit(1);
+    }
+    cmsghdr* C = CMSG_FIRSTHDR(&Msg);
+    if (!C || C->cmsg_type != SCM_RIGHTS || C->cmsg_len != CMSG_LEN(sizeof(Streams)))
+    {
+        _exit(1);
+    }
+    std::memcpy(Streams, CMSG_DATA(C), sizeof(Streams));
+
+    std::string Payload(Length, '\0');
+    if (!readAll(Connection, Payload.data(), Length))
+    {
+        _exit(1);
+    }
+    std::vector<std::string> Args;
+    for (size_t Begin = 0, End; (End = Payload.find('\0', Begin)) != std::string::npos; Begin = End + 1)
+    {
+        Args.push_back(Payload.substr(Begin, End - Begin));
+    }
+    if (Args.empty())
+    {
+        _exit(1);
+    }
+
+    dup2(Streams[0], STDOUT_FILENO);
+    dup2(Streams[1], STDERR_FILENO);
+    close(Streams[0]);
+    close(Streams[1]);
+    int32_t Status = -1;
+    if (chdir(Args[0].c_str()) == 0)
+    {
+        Args.erase(Args.begin());
+        Status = Compile(Args);
+    } else
+    {
+        std::cerr << "could not change to " << Args[0] << ": " << std::strerror(errno);
+    }
+
+    std::cout.flush();
+    std::cerr.flush();
+    llvm::outs().flush();
+    llvm::errs().flush();
+    std::fflush(nullptr);
+    writeAll(Connection, &Status, sizeof(Status));
+    _exit(0);
+}
+
+} // namespace
+
+std::string defaultSocketPath() {
+    const char* RuntimeDir = std::getenv("XDG_RUNTIME_DIR");
+    if (RuntimeDir && RuntimeDir[0] == '/')
+    {
+        return std::string(RuntimeDir) + "/randlang.sock";
+    }
+    return "/tmp/randlang-" + std::to_string(getuid()) + "/server.sock";
+}
+
+int runServer(const std::string& SocketPath, const CompileFunction& Compile) {
+    sockaddr_un Addr;
+    if (!makeAddress(SocketPath, Addr) || !privateDirectory(SocketPath, true))
+    {
+        return 1;
+    }
+
+    int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener < 0)
+    {
+        std::cerr << "could not create socket: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    // A socket file nobody listens on is left over from a server that was killed.
+    if (connect(Listener, (sockaddr*)&Addr, sizeof(Addr)) == 0)
+    {
+        std::cerr << "a server is already listening on " << SocketPath << std::endl;
+        return 1;
+    }
+    close(Listener);
+    unlink(SocketPath.c_str());
+
+    Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener < 0 || bind(Listener, (sockaddr*)&Addr, sizeof(Addr)) != 0 || listen(Listener, SOMAXCONN) != 0)
+    {
+        std::cerr << "could not listen on " << SocketPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::memcpy(ListeningPath, Addr.sun_path, sizeof(ListeningPath));
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGCHLD, SIG_IGN); // children are reaped automatically
+
+    std::cout << "randlang server listening on " << SocketPath << std::endl;
+    while (true)
+    {
+        int Connection = accept(Listener, nullptr, nullptr);
+        if (Connection < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (!samePeerUser(Connection))
+        {
+            std::cerr << "refused a connection from another user" << std::endl;
+            close(Connection);
+            continue;
+        }
+
+        pid_t Child = fork();
+        if (Child == 0)
+        {
+            close(Listener);
+            serve(Connection, Compile);
+        }
+        if (Child < 0)
+        {
+            std::cerr << "fork failed: " << std::strerror(errno) << std::endl;
+        }
+        close(Connection);
+    }
+    unlink(ListeningPath);
+    return 1;
+}
+
+bool runClient(const std::string& SocketPath, const std::vector<std::string>& Args, int& ExitCode) {
+    sockaddr_un Addr;
+    if (!makeAddress(SocketPath, Addr) || !privateDirectory(SocketPath, false))
+    {
+        return false;
+    }
+    int Connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Connection < 0)
+    {
+        return false;
+    }
+    if (connect(Connection, (sockaddr*)&Addr, sizeof(Addr)) != 0)
+    {
+        close(Connection);
+        return false;
+    }
+    if (!samePeerUser(Connection))
+    {
+        std::cerr << "the compile server at " << SocketPath << " runs as another user, compiling locally" << std::endl;
+        close(Connection);
+        return false;
+    }
+
+    llvm::SmallString<256> Directory;
+    llvm::sys::fs::current_path(Directory);
+    std::string Payload(Directory.str());
+    Payload += '\0';
+    for (auto &Arg : Args)
+    {
+        Payload += Arg;
+        Payload += '\0';
+    }
+
+    uint32_t Length = Payload.size();
+    int Streams[2] = {STDOUT_FILENO, STDERR_FILENO};
+    iovec IO{&Length, sizeof(Length)};
+    alignas(cmsghdr) char Control[CMSG_SPACE(sizeof(Streams))];
+    msghdr Msg{};
+    Msg.msg_iov = &IO;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = Control;
+    Msg.msg_controllen = sizeof(Control);
+    cmsghdr* C = CMSG_FIRSTHDR(&Msg);
+    C->cmsg_level = SOL_SOCKET;
+    C->cmsg_type = SCM_RIGHTS;
+    C->cmsg_len = CMSG_LEN(sizeof(Streams));
+    std::memcpy(CMSG_DATA(C), Streams, sizeof(Streams));
+
+    std::cout.flush();
+    int32_t Status;
+    if (sendmsg(Connection, &Msg, MSG_NOSIGNAL) != sizeof(Length) || !writeAll(Connection, Payload.data(), Payload.size()) ||
+        !readAll(Connection, &Status, sizeof(Status)))
+    {
+        std::cerr << "the compile server failed to compile the file" << std::endl;
+        Status = 1;
+    }
+    close(Connection);
+    ExitCode = Status;
+    return true;
+}
@@ -0,0 +1,633 @@
+// AST level constant folding. Runs on every function right after it has been
+// parsed, before types are inferred and IR is generated:
+//   - builtin operators on literals are evaluated
+//   - user defined operators are evaluated on literal operands if their body
+//     only needs values known at compile time (no calls, loops or arrays)
+//   - if expressions with a literal condition and literal arms are replaced
+//     by the taken value, converted to the type of the if
+//   - var bindings to literals that are never assigned are substituted
+//   - const definitions are substituted like var bindings
+// The folded values are computed exactly like the generated code would,
+// anything that can't be reproduced (f32, vectors, i64 overflow) is left alone.
+#include "../include/ASTNodes.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace {
+
+// i64 literals are stored as doubles, so folded integers have to stay exact.
+constexpr double kMaxExactInteger = 9007199254740992.0; // 2^53
+// Limits for evaluating (possibly recursive) user operators.
+constexpr unsigned kMaxEvaluationDepth = 64;
+constexpr unsigned kMaxEvaluationSteps = 100000;
+
+bool isFoldable(ValueType type) {
+    return type == ValueType::Bool || type == ValueType::I64 || type == ValueType::F64;
+}
+
+// Mirrors ASTNode::convertTo.
+bool convertConstant(Constant& C, ValueType To) {
+    if (C.type == To)
+    {
+        return true;
+    }
+    if (!isFoldable(C.type) || !isFoldable(To))
+    {
+        return false;
+    }
+
+    if (To == ValueType::Bool)
+    {
+        C.value = (!std::isnan(C.value) && C.value != 0) ? 1 : 0;
+    } else if (To == ValueType::I64 && C.type == ValueType::F64)
+    {
+        // fptosi is poison for NaN and out of range values.
+        if (std::isnan(C.value) || std::fabs(std::trunc(C.value)) > kMaxExactInteger)
+        {
+            return false;
+        }
+        C.value = std::trunc(C.value);
+    }
+    C.type = To;
+    return true;
+}
+
+// Mirrors the builtin operators in BinaryASTNode::codegen.
+bool applyBuiltin(char op, bool isSinglecharOperator, Token::Kind tokenkind, Constant L, Constant R, Constant& Result) {
+    ValueType operandType = arithmeticType(L.type, R.type);
+    if (!convertConstant(L, operandType) || !convertConstant(R, operandType))
+    {
+        return false;
+    }
+
+    if (operandType == ValueType::I64)
+    {
+        int64_t A = (int64_t)L.value, B = (int64_t)R.value, V = 0;
+        bool Overflow = false;
+        Result.type = ValueType::Bool;
+        if (!isSinglecharOperator)
+        {
+            switch (tokenkind)
+            {
+            case Token::Kind::DoubleEqual: V = A == B; break;
+            case Token::Kind::GreaterOrEqual: V = A >= B; break;
+            case Token::Kind::LessOrEqual: V = A <= B; break;
+            case Token::Kind::NotEqual: V = A != B; break;
+            default: return false;
+            }
+        } else if (op == '<' || op == '>')
+        {
+            V = op == '<' ? A < B : A > B;
+        } else
+        {
+            Result.type = ValueType::I64;
+            switch (op)
+            {
+            case '+': Overflow = __builtin_add_overflow(A, B, &V); break;
+            case '-': Overflow = __builtin_sub_overflow(A, B, &V); break;
+            case '*': Overflow = __builtin_mul_overflow(A, B, &V); break;
+            default: return false;
+            }
+        }
+        if (Overflow || std::fabs((double)V) > kMaxExactInteger)
+        {
+            return false;
+        }
+        Result.value = (double)V;
+        return true;
+    }
+
+    // Floating point comparisons are unordered, NaN compares true.
+    double A = L.value, B = R.value;
+    bool Unordered = std::isnan(A) || std::isnan(B);
+    Result.type = ValueType::Bool;
+    if (!isSinglecharOperator)
+    {
+        switch (tokenkind)
+        {
+        case Token::Kind::DoubleEqual: Result.value = Unordered || A == B; break;
+        case Token::Kind::GreaterOrEqual: Result.value = Unordered || A >= B; break;
+        case Token::Kind::LessOrEqual: Result.value = Unordered || A <= B; break;
+        case Token::Kind::NotEqual: Result.value = Unordered || A != B; break;
+        default: return false;
+        }
+        return true;
+    }
+
+    switch (op)
+    {
+    case '<': Result.value = Unordered || A < B; return true;
+    case '>': Result.value = Unordered || A > B; return true;
+    default: break;
+    }
+    Result.type = operandType;
+    switch (op)
+    {
+    case '+': Result.value = A + B; return true;
+    case '-': Result.value = A - B; return true;
+    case '*': Result.value = A * B; return true;
+    default: return false;
+    }
+}
+
+bool evaluateAll(std::vector<std::unique_ptr<ASTNode>>& Exprs, ConstantEnv& Env, Constant& Result) {
+    if (Exprs.empty())
+    {
+        return false;
+    }
+    for (auto &expr : Exprs)
+    {
+        if (!expr->evaluate(Env, Result))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool literalValue(ASTNode* Node, Constant& Result) {
+    ConstantEnv Env;
+    auto* Lit = dynamic_cast<NumberASTNode*>(Node);
+    return Lit && Lit->evaluate(Env, Result);
+}
+
+void substituteIn(std::unique_ptr<ASTNode>& Node, const std::string& Name, Constant Value) {
+    if (!Node)
+    {
+        return;
+    }
+    auto* Var = dynamic_cast<VariableASTNode*>(Node.get());
+    if (Var && Var->getName() == Name)
+    {
+        SourceLocation Loc = Node->Loc;
+        Node = std::make_unique<NumberASTNode>(Value.value, Value.type);
+        Node->Loc = Loc;
+    } else
+    {
+        Node->substitute(Name, Value);
+    }
+}
+
+} // namespace
+
+void ASTNode::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {}
+
+std::unique_ptr<ASTNode> ASTNode::simplify() {
+    forEachChild(fold);
+    return nullptr;
+}
+
+bool ASTNode::evaluate(ConstantEnv& Env, Constant& Result) {
+    return false;
+}
+
+void ASTNode::substitute(const std::string& Name, Constant Value) {
+    forEachChild([&](std::unique_ptr<ASTNode>& Child) { substituteIn(Child, Name, Value); });
+}
+
+bool ASTNode::assigns(const std::string& Name) {
+    bool Found = false;
+    forEachChild([&](std::unique_ptr<ASTNode>& Child) { Found = Found || Child->assigns(Name); });
+    return Found;
+}
+
+void ASTNode::fold(std::unique_ptr<ASTNode>& Node) {
+    if (!Node)
+    {
+        return;
+    }
+    if (auto Replacement = Node->simplify())
+    {
+        // Folded nodes keep the place of what they replace in the debug info.
+        if (!Replacement->Loc.Line)
+        {
+            Replacement->Loc = Node->Loc;
+        }
+        Node = std::move(Replacement);
+    }
+}
+
+unsigned ASTNode::countNodes(ASTNode& Node) {
+    unsigned Count = 1;
+    Node.forEachChild([&](std::unique_ptr<ASTNode>& Child) { Count += countNodes(*Child); });
+    return Count;
+}
+
+bool NumberASTNode::evaluate(ConstantEnv& Env, Constant& Result) {
+    Result = Constant{literalType, val};
+    return isFoldable(literalType);
+}
+
+bool VariableASTNode::evaluate(ConstantEnv& Env, Constant& Result) {
+    auto Value = Env.find(varName);
+    if (Value == Env.end())
+    {
+        return false;
+    }
+    Result = Value->second;
+    return true;
+}
+
+void BinaryASTNode::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    F(LHS);
+    F(RHS);
+}
+
+std::unique_ptr<ASTNode> BinaryASTNode::simplify() {
+    forEachChild(fold);
+    Constant L, R, Result;
+    if (op == '=' || !literalValue(LHS.get(), L) || !literalValue(RHS.get(), R))
+    {
+        return nullptr;
+    }
+
+    bool Folded = isBuiltinOperator() ? applyBuiltin(op, isSinglecharOperator, tokenkind, L, R, Result)
+                                      : FunctionASTNode::evaluateOperator(std::string("binary") + op, {L, R}, Result);
+    if (!Folded)
+    {
+        return nullptr;
+    }
+    return std::make_unique<NumberASTNode>(Result.value, Result.type);
+}
+
+bool BinaryASTNode::evaluate(ConstantEnv& Env, Constant& Result) {
+    if (op == '=')
+    {
+        VariableASTNode* LHSE = dynamic_cast<VariableASTNode*>(LHS.get());
+        auto Variable = LHSE ? Env.find(LHSE->getName()) : Env.end();
+        if (Variable == Env.end() || !RHS->evaluate(Env, Result) || !convertConstant(Result, Variable->second.type))
+        {
+            return false;
+        }
+        Variable->second = Result;
+        return true;
+    }
+
+    Constant L, R;
+    if (!LHS->evaluate(Env, L) || !RHS->evaluate(Env, R))
+    {
+        return false;
+    }
+    if (isBuiltinOperator())
+    {
+        return applyBuiltin(op, isSinglecharOperator, tokenkind, L, R, Result);
+    }
+    return FunctionASTNode::evaluateOperator(std::string("binary") + op, {L, R}, Result);
+}
+
+bool BinaryASTNode::assigns(const std::string& Name) {
+    VariableASTNode* LHSE = dynamic_cast<VariableASTNode*>(LHS.get());
+    if (op == '=' && LHSE && LHSE->getName() == Name)
+    {
+        return true;
+    }
+    return ASTNode::assigns(Name);
+}
+
+void IndexExprAST::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    F(Base);
+    F(Index);
+    if (SliceEnd)
+    {
+        F(SliceEnd);
+    }
+}
+
+void CallASTNode::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    for (auto &arg : args)
+    {
+        F(arg);
+    }
+}
+
+void FunctionASTNode::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    for (auto &expr : body)
+    {
+        F(expr);
+    }
+}
+
+unsigned FunctionASTNode::foldConstants() {
+    unsigned Before = countNodes(*this);
+    const std::vector<std::string>& Params = proto->getArgs();
+    for (auto &Const : ConstValues)
+    {
+        if (std::find(Params.begin(), Params.end(), Const.first) != Params.end())
+        {
+            continue;
+        }
+        for (auto &expr : body)
+        {
+            substituteIn(expr, Const.first, Const.second);
+        }
+    }
+    forEachChild(fold);
+    return Before - countNodes(*this);
+}
+
+bool FunctionASTNode::evaluateOperator(const std::string& Name, std::vector<Constant> Args, Constant& Result) {
+    static thread_local unsigned Depth = 0, Steps = 0;
+    auto Def = OperatorBodies.find(Name);
+    auto Proto = FunctionProtos.find(Name);
+    if (Def == OperatorBodies.end() || Proto == FunctionProtos.end() || Proto->second->getArgs().size() != Args.size())
+    {
+        return false;
+    }
+    if (Depth == 0)
+    {
+        Steps = 0;
+    }
+    if (Depth >= kMaxEvaluationDepth || ++Steps > kMaxEvaluationSteps)
+    {
+        return false;
+    }
+
+    // The body has been through inferTypes, so the cached types match codegen.
+    ConstantEnv Env;
+    for (unsigned i = 0, e = Args.size(); i != e; i++)
+    {
+        if (!convertConstant(Args[i], Proto->second->getArgType(i)))
+        {
+            return false;
+        }
+        Env[Proto->second->getArgs()[i]] = Args[i];
+    }
+
+    Depth++;
+    bool Evaluated = evaluateAll(Def->second->body, Env, Result);
+    Depth--;
+    return Evaluated && convertConstant(Result, Proto->second->getReturnType());
+}
+
+void IfExprAST::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    F(Cond);
+    for (auto &expr : Then)
+    {
+        F(expr);
+    }
+    for (auto &expr : Else)
+    {
+        F(expr);
+    }
+}
+
+std::unique_ptr<ASTNode> IfExprAST::simplify() {
+    forEachChild(fold);
+    Constant C;
+    if (!literalValue(Cond.get(), C) || !convertConstant(C, ValueType::Bool))
+    {
+        return nullptr;
+    }
+
+    // The if has the joined type of both arms, which is only known here when
+    // both are literals. Otherwise the if stays and codegen skips the dead arm.
+    Constant T, E;
+    if (Then.size() != 1 || Else.size() != 1 || !literalValue(Then[0].get(), T) || !literalValue(Else[0].get(), E))
+    {
+        return nullptr;
+    }
+    Constant Taken = C.value != 0 ? T : E;
+    if (!convertConstant(Taken, joinTypes(T.type, E.type)))
+    {
+        return nullptr;
+    }
+    return std::make_unique<NumberASTNode>(Taken.value, Taken.type);
+}
+
+bool IfExprAST::evaluate(ConstantEnv& Env, Constant& Result) {
+    if (!Cond->evaluate(Env, Result) || !convertConstant(Result, ValueType::Bool))
+    {
+        return false;
+    }
+    if (!evaluateAll(Result.value != 0 ? Then : Else, Env, Result))
+    {
+        return false;
+    }
+    return convertConstant(Result, exprType);
+}
+
+void ForExprAST::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    F(Start);
+    F(End);
+    if (Step)
+    {
+        F(Step);
+    }
+    for (auto &expr : Body)
+    {
+        F(expr);
+    }
+}
+
+void ForExprAST::substitute(const std::string& Name, Constant Value) {
+    substituteIn(Start, Name, Value);
+    if (VarName == Name)
+    {
+        return;
+    }
+    substituteIn(End, Name, Value);
+    substituteIn(Step, Name, Value);
+    for (auto &expr : Body)
+    {
+        substituteIn(expr, Name, Value);
+    }
+}
+
+bool ForExprAST::assigns(const std::string& Name) {
+    if (Start->assigns(Name))
+    {
+        return true;
+    }
+    if (VarName == Name)
+    {
+        return false;
+    }
+    bool Found = End->assigns(Name) || (Step && Step->assigns(Name));
+    for (auto &expr : Body)
+    {
+        Found = Found || expr->assigns(Name);
+    }
+    return Found;
+}
+
+void UnaryExprAst::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    F(Operand);
+}
+
+std::unique_ptr<ASTNode> UnaryExprAst::simplify() {
+    forEachChild(fold);
+    Constant V, Result;
+    if (!literalValue(Operand.get(), V) || !FunctionASTNode::evaluateOperator(std::string("unary") + Opcode, {V}, Result))
+    {
+        return nullptr;
+    }
+    return std::make_unique<NumberASTNode>(Result.value, Result.type);
+}
+
+bool UnaryExprAst::evaluate(ConstantEnv& Env, Constant& Result) {
+    Constant V;
+    return Operand->evaluate(Env, V) && FunctionASTNode::evaluateOperator(std::string("unary") + Opcode, {V}, Result);
+}
+
+void VarAstNode::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    for (auto &Var : VarNames)
+    {
+        if (Var.second)
+        {
+            F(Var.second);
+        }
+    }
+    F(Body);
+}
+
+std::unique_ptr<ASTNode> VarAstNode::simplify() {
+    std::vector<bool> Collapsed(VarNames.size(), false);
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        const std::string& Name = VarNames[i].first;
+        fold(VarNames[i].second);
+
+        Constant C;
+        if (!literalValue(VarNames[i].second.get(), C) || !convertConstant(C, VarTypes[i].annotated ? VarTypes[i].type : C.type))
+        {
+            continue;
+        }
+        bool Assigned = Body->assigns(Name);
+        for (unsigned j = i + 1; j != e && !Assigned; j++)
+        {
+            Assigned = VarNames[j].second && VarNames[j].second->assigns(Name);
+        }
+        if (Assigned)
+        {
+            continue;
+        }
+
+        // Later initializers still see this binding, up to one that shadows it.
+        bool Shadowed = false;
+        for (unsigned j = i + 1; j != e && !Shadowed; j++)
+        {
+            substituteIn(VarNames[j].second, Name, C);
+            Shadowed = VarNames[j].first == Name;
+        }
+        if (!Shadowed)
+        {
+            substituteIn(Body, Name, C);
+        }
+        Collapsed[i] = true;
+    }
+    fold(Body);
+
+    std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> KeptNames;
+    std::vector<TypeSlot> KeptTypes;
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        if (!Collapsed[i])
+        {
+            KeptNames.push_back(std::move(VarNames[i]));
+            KeptTypes.push_back(VarTypes[i]);
+        }
+    }
+    if (KeptNames.empty())
+    {
+        return std::move(Body);
+    }
+    VarNames = std::move(KeptNames);
+    VarTypes = std::move(KeptTypes);
+    return nullptr;
+}
+
+bool VarAstNode::evaluate(ConstantEnv& Env, Constant& Result) {
+    std::vector<std::pair<std::string, Constant>> OldBindings;
+    for (unsigned i = 0, e = VarNames.size(); i != e; i++)
+    {
+        Constant V{VarTypes[i].type, 0};
+        if (VarNames[i].second && !VarNames[i].second->evaluate(Env, V))
+        {
+            return false;
+        }
+        if (!convertConstant(V, VarTypes[i].type))
+        {
+            return false;
+        }
+        auto Old = Env.find(VarNames[i].first);
+        if (Old != Env.end())
+        {
+            OldBindings.push_back(*Old);
+        }
+        Env[VarNames[i].first] = V;
+    }
+
+    bool Evaluated = Body->evaluate(Env, Result);
+    for (auto &Var : VarNames)
+    {
+        Env.erase(Var.first);
+    }
+    for (auto Old = OldBindings.rbegin(); Old != OldBindings.rend(); ++Old)
+    {
+        Env[Old->first] = Old->second;
+    }
+    return Evaluated;
+}
+
+void VarAstNode::substitute(const std::string& Name, Constant Value) {
+    for (auto &Var : VarNames)
+    {
+        substituteIn(Var.second, Name, Value);
+        if (Var.first == Name)
+        {
+            return;
+        }
+    }
+    substituteIn(Body, Name, Value);
+}
+
+bool VarAstNode::assigns(const std::string& Name) {
+    for (auto &Var : VarNames)
+    {
+        if (Var.second && Var.second->assigns(Name))
+        {
+            return true;
+        }
+        if (Var.first == Name)
+        {
+            return false;
+        }
+    }
+    return Body && Body->assigns(Name);
+}
+
+void RegionExprAST::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    for (auto &expr : Body)
+    {
+        F(expr);
+    }
+}
+
+void ReduceExprAST::forEachChild(const std::function<void(std::unique_ptr<ASTNode>&)>& F) {
+    if (Identity)
+    {
+        F(Identity);
+    }
+    F(Start);
+    F(End);
+    F(Body);
+}
+
+void ReduceExprAST::substitute(const std::string& Name, Constant Value) {
+    substituteIn(Identity, Name, Value);
+    substituteIn(Start, Name, Value);
+    substituteIn(End, Name, Value);
+    if (VarName != Name)
+    {
+        substituteIn(Body, Name, Value);
+    }
+}
+
+bool ReduceExprAST::assigns(const std::string& Name) {
+    if ((Identity && Identity->assigns(Name)) || Start->assigns(Name) || End->assigns(Name))
+    {
+        return true;
+    }
+    return VarName != Name && Body->assigns(Name);
+}
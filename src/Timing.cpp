@@ -0,0 +1,139 @@
+// Compile time trace and report, see Timing.h.
+#include "../include/Timing.h"
+#include "../include/MemReport.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TimeProfiler.h"
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char* const PhaseNames[] = {"Load", "Lex", "Parse", "Fold", "Comptime", "Codegen", "Optimize", "Backend"};
+static_assert(sizeof(PhaseNames) / sizeof(PhaseNames[0]) == (size_t)Phase::Count, "a name for every phase");
+
+// What one thread measured. Threads only touch their own, the report reads
+// all of them once the threads are done.
+struct ThreadTimes {
+    Clock::duration Self[(size_t)Phase::Count] = {};
+    unsigned Calls[(size_t)Phase::Count] = {};
+    std::vector<std::pair<Clock::duration, std::string>> Functions; // codegen time including optimization
+};
+
+std::mutex AllThreadsLock;
+std::list<ThreadTimes> AllThreads;
+
+ThreadTimes& threadTimes() {
+    thread_local ThreadTimes* Times = [] {
+        std::lock_guard<std::mutex> Lock(AllThreadsLock);
+        AllThreads.emplace_back();
+        return &AllThreads.back();
+    }();
+    return *Times;
+}
+
+thread_local TimeScope* Innermost = nullptr;
+
+double milliseconds(Clock::duration D) {
+    return std::chrono::duration<double, std::milli>(D).count();
+}
+
+} // namespace
+
+bool TimeReport::Enabled = false;
+
+const char* phaseName(Phase P) {
+    return P == Phase::Count ? "Other" : PhaseNames[(size_t)P];
+}
+
+Phase TimeScope::current() {
+    return Innermost ? Innermost->P : Phase::Count;
+}
+
+TimeScope::TimeScope(Phase P, llvm::StringRef Detail)
+    : P(P), Detail(Detail), Tracing(llvm::timeTraceProfilerEnabled()), Reporting(TimeReport::Enabled || MemReport::Enabled) {
+    if (Tracing)
+    {
+        llvm::timeTraceProfilerBegin(PhaseNames[(size_t)P], Detail);
+    }
+    if (Reporting)
+    {
+        Parent = Innermost;
+        Innermost = this;
+        Start = Clock::now();
+    }
+}
+
+TimeScope::~TimeScope() {
+    if (Reporting)
+    {
+        Clock::duration Total = Clock::now() - Start;
+        ThreadTimes& Times = threadTimes();
+        Times.Self[(size_t)P] += Total - Nested;
+        Times.Calls[(size_t)P]++;
+        if (P == Phase::Codegen)
+        {
+            Times.Functions.emplace_back(Total, Detail.str());
+        }
+        if (Parent)
+        {
+            Parent->Nested += Total;
+        }
+        Innermost = Parent;
+        // Lexing only allocates its first batch and happens too often to look at the RSS after every batch.
+        if (MemReport::Enabled && P != Phase::Lex)
+        {
+            MemReport::phaseEnded(P);
+        }
+    }
+    if (Tracing)
+    {
+        llvm::timeTraceProfilerEnd();
+    }
+}
+
+void TimeReport::print(llvm::raw_ostream& OS, Clock::duration Wall) {
+    std::lock_guard<std::mutex> Lock(AllThreadsLock);
+    ThreadTimes Sum;
+    for (auto &Times : AllThreads)
+    {
+        for (size_t i = 0; i < (size_t)Phase::Count; i++)
+        {
+            Sum.Self[i] += Times.Self[i];
+            Sum.Calls[i] += Times.Calls[i];
+        }
+        Sum.Functions.insert(Sum.Functions.end(), Times.Functions.begin(), Times.Functions.end());
+    }
+    Clock::duration Measured{0};
+    for (auto D : Sum.Self)
+    {
+        Measured += D;
+    }
+
+    OS << "===== Time report =====\n";
+    OS << "  Phase         Time (ms)       %      Count\n";
+    for (size_t i = 0; i < (size_t)Phase::Count; i++)
+    {
+        double Percent = Measured.count() ? 100.0 * Sum.Self[i].count() / Measured.count() : 0.0;
+        OS << llvm::format("  %-10s %12.3f %6.1f%% %10u\n", PhaseNames[i], milliseconds(Sum.Self[i]), Percent, Sum.Calls[i]);
+    }
+    OS << llvm::format("  Total      %12.3f\n", milliseconds(Measured));
+    OS << llvm::format("  Wall       %12.3f\n", milliseconds(Wall));
+
+    const size_t Slowest = std::min<size_t>(10, Sum.Functions.size());
+    std::partial_sort(Sum.Functions.begin(), Sum.Functions.begin() + Slowest, Sum.Functions.end(),
+                      [](const auto& A, const auto& B) { return A.first > B.first; });
+    if (Slowest)
+    {
+        OS << "Slowest functions (codegen and optimization):\n";
+    }
+    for (size_t i = 0; i < Slowest; i++)
+    {
+        OS << llvm::format("  %12.3f ms  ", milliseconds(Sum.Functions[i].first)) << Sum.Functions[i].second << "\n";
+    }
+}
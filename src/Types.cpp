@@ -0,0 +1,117 @@
+#include "../include/Types.h"
+#include "llvm/IR/DerivedTypes.h"
+#include <algorithm>
+#include <utility>
+
+ValueType joinTypes(ValueType a, ValueType b) {
+    return ValueType{std::max(a.scalar, b.scalar), std::max(a.lanes, b.lanes), a.array || b.array};
+}
+
+ValueType arithmeticType(ValueType a, ValueType b) {
+    ValueType joined = joinTypes(a, b);
+    joined.scalar = std::max(joined.scalar, ScalarType::I64);
+    return joined;
+}
+
+ValueType fromLLVMType(llvm::Type* type) {
+    ValueType result = ValueType::F64;
+    if (type->isStructTy())
+    {
+        return ValueType::Array;
+    } else if (auto* vecType = llvm::dyn_cast<llvm::FixedVectorType>(type))
+    {
+        result.lanes = vecType->getNumElements();
+        type = vecType->getElementType();
+    }
+
+    if (type->isIntegerTy(1))
+    {
+        result.scalar = ScalarType::Bool;
+    } else if (type->isIntegerTy())
+    {
+        result.scalar = ScalarType::I64;
+    } else if (type->isFloatTy())
+    {
+        result.scalar = ScalarType::F32;
+    }
+    return result;
+}
+
+llvm::Type* toLLVMType(ValueType type, llvm::LLVMContext& context) {
+    if (type.isArray())
+    {
+        return llvm::StructType::get(llvm::PointerType::getUnqual(context), llvm::Type::getInt64Ty(context));
+    }
+
+    llvm::Type* element = llvm::Type::getDoubleTy(context);
+    switch (type.scalar)
+    {
+    case ScalarType::Bool:
+        element = llvm::Type::getInt1Ty(context);
+        break;
+    case ScalarType::I64:
+        element = llvm::Type::getInt64Ty(context);
+        break;
+    case ScalarType::F32:
+        element = llvm::Type::getFloatTy(context);
+        break;
+    case ScalarType::F64:
+        break;
+    }
+
+    if (type.isVector())
+    {
+        return llvm::FixedVectorType::get(element, type.lanes);
+    }
+    return element;
+}
+
+bool parseTypeName(std::string_view name, ValueType& type) {
+    if (name == "bool")
+    {
+        type = ValueType::Bool;
+    } else if (name == "i64")
+    {
+        type = ValueType::I64;
+    } else if (name == "f32")
+    {
+        type = ValueType::F32;
+    } else if (name == "f64")
+    {
+        type = ValueType::F64;
+    } else if (name == "vec2" || name == "vec4" || name == "vec8")
+    {
+        type = ValueType{ScalarType::F64, (unsigned)(name[3] - '0')};
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseFastMathFlag(std::string_view name, unsigned& flag) {
+    static const std::pair<std::string_view, FastMathFlag> Names[] = {
+        {"reassoc", FMReassoc}, {"contract", FMContract}, {"nnan", FMNoNaNs}, {"ninf", FMNoInfs},
+        {"nsz", FMNoSignedZeros}, {"arcp", FMAllowReciprocal}, {"afn", FMApproxFunc},
+    };
+    for (auto &[Name, Flag] : Names)
+    {
+        if (name == Name)
+        {
+            flag = Flag;
+            return true;
+        }
+    }
+    return false;
+}
+
+llvm::FastMathFlags toFastMathFlags(unsigned flags) {
+    llvm::FastMathFlags FMF;
+    FMF.setAllowReassoc(flags & FMReassoc);
+    FMF.setAllowContract(flags & FMContract);
+    FMF.setNoNaNs(flags & FMNoNaNs);
+    FMF.setNoInfs(flags & FMNoInfs);
+    FMF.setNoSignedZeros(flags & FMNoSignedZeros);
+    FMF.setAllowReciprocal(flags & FMAllowReciprocal);
+    FMF.setApproxFunc(flags & FMApproxFunc);
+    return FMF;
+}
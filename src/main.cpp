@@ -1,9 +1,31 @@
 #include "../include/Parser.h"
+#include "../include/Comptime.h"
+#include "../include/DebugInfo.h"
+#include "../include/Interface.h"
+#include "../include/MemReport.h"
+#include "../include/Output.h"
+#include "../include/Remarks.h"
+#include "../include/Server.h"
+#include "../include/Timing.h"
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Frontend/Driver/CodeGenOptions.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -16,39 +38,486 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/VirtualFileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/TargetParser/Host.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
 
-int main(int argc, char** argv) {
-  // auto code =
-  //     "x = 2\n"
-  //     "// This is a comment.\n"
-  //     "var x\n"
-  //     "var y\n"
-  //     "var f = function(x, y) { sin(x) * sin(y) + x * y; }\n"
-  //     "der(f, x)\n"
-  //     "var g = function(x, y) { 2 * (x + der(f, y)); } // der(f, y) is a "
-  //     "matrix\n"
-  //     "var r{3}; // Vector of three elements\n"
-  //     "var J{12, 12}; // Matrix of 12x12 elements\n"
-  //     "var dot = function(u{:}, v{:}) -> scalar {\n"
-  //     "          return u[i] * v[i]; // Einstein notation\n"
-  //     "}\n"
-  //     "var norm = function(u{:}) -> scalar { return sqrt(dot(u, u)); }\n"
-  //     "<end>";
-    if (argc != 3) // max is argv[2]
+namespace {
+
+// What --emit writes for each input.
+enum class EmitKind { Object, Assembly, Bitcode, IR };
+
+struct Options {
+  std::vector<std::string> Inputs;
+  std::string Output; // the object file, or with -o the directory for all of them
+  bool OutputDirectory = false;
+  unsigned Jobs = 0; // 0: one per hardware thread
+  unsigned OptLevel = 1;
+  bool PrintIR = false;
+  EmitKind Emit = EmitKind::Object;
+  bool ThinLTO = false; // bitcode with a ThinLTO summary, for clang -flto=thin and lld
+  bool ProfileGenerate = false; // count edges, the profile runtime writes a .profraw at exit
+  std::string ProfileRaw; // name of that .profraw, default_%m.profraw if empty
+  std::string ProfileUse; // .profdata merged from .profraw files, none if empty
+  llvm::driver::VectorLibrary VectorLibrary = llvm::driver::VectorLibrary::NoLibrary;
+  unsigned FastMath = 0; // FastMathFlag bits for functions without @fastmath
+  RemarkOptions Remarks;
+  DebugLevel Debug = DebugLevel::None;
+  bool PerfJIT = false; // tell perf about the comptime code the JIT runs
+  bool EmitInterface = false; // also write <output>.rdlgi for import
+  std::vector<std::string> ImportPaths;
+  std::string CacheDir;
+  std::string ASTCacheDir;
+  uint64_t CacheSize = 256; // MiB
+  bool CacheStats = false;
+  bool Server = false;
+  bool Connect = false;
+  std::string Socket;
+  std::string TimeTrace; // file for the Chrome trace, none if empty
+  unsigned TimeTraceGranularity = 500; // microseconds, shorter spans are left out of the trace
+  bool TimeReport = false;
+  bool MemReport = false;
+  std::string MemReportJSON; // also write the memory report here if not empty
+};
+
+const char* Argv0;
+
+const char* const Usage =
+    "USAGE: randlang [options] <inputFile> <outputFile>\n"
+    "       randlang [options] [-j <N>] <inputFile>... -o <outputDirectory>\n"
+    "  -O<0-3>             optimization level, -O1 by default: -O0 doesn't optimize,\n"
+    "                      -O2 and -O3 add LLVM's module pipeline to the function passes\n"
+    "  --emit=<kind>       write obj (the default), asm, bc (LLVM bitcode) or ll (LLVM IR)\n"
+    "  --print-ir          print the IR of every function as it is generated, before optimization\n"
+    "  --thinlto           write bitcode with a ThinLTO summary, to be linked with clang -flto=thin\n"
+    "  --profile-generate[=<file>] instrument the functions to write a profile to <file> at exit\n"
+    "  --profile-use=<file> optimize with a profile merged by llvm-profdata\n"
+    "  --vector-library=<lib> let vectorized loops call libmvec, sleef, svml, armpl, amdlibm or accelerate\n"
+    "  -ffast-math         allow all fast-math optimizations, -fno-fast-math turns them off again\n"
+    "  -ffp-contract=<fast|off> fuse multiplies and adds into FMA instructions, off by default\n"
+    "  -fno-honor-nans, -fno-honor-infinities, -fno-signed-zeros, -fassociative-math, -freciprocal-math,\n"
+    "  -fapprox-func       single fast-math flags, each can be turned off with its opposite\n"
+    "  -Rpass=<regex>      print optimization remarks of the passes matching <regex>, e.g. inline or loop-vectorize\n"
+    "  -Rpass-missed=<regex> print the optimizations these passes couldn't do\n"
+    "  -Rpass-analysis=<regex> print why they couldn't\n"
+    "  --opt-record[=<file>] write all optimization remarks to <file>, <output>.opt.yaml by default\n"
+    "  -g                  emit DWARF debug info with line tables, types and variables, -g0 turns it off\n"
+    "  -gline-tables-only  emit only the functions and line tables, enough for profilers like perf\n"
+    "  --perf-jit          write a jitdump and /tmp/perf-<pid>.map for the comptime code run by the JIT\n"
+    "  --emit-interface    also write an interface file <output>.rdlgi that other files can import\n"
+    "  -I <dir>            look for imported interface files in <dir>, then next to the source file\n"
+    "  -j <N>              compile up to N files at once, one per hardware thread by default\n"
+    "  --cache-dir=<dir>   reuse optimized functions from earlier runs\n"
+    "  --ast-cache=<dir>   reuse the parsed AST of unchanged files from earlier runs\n"
+    "  --cache-size=<MiB>  size limit of each cache directory, 256 by default\n"
+    "  --cache-stats       print what the caches did\n"
+    "  --server[=<socket>] stay resident and compile the files of clients\n"
+    "  --connect[=<socket>] let the server compile the files, like RANDLANG_SERVER=<socket> does\n"
+    "  --time-trace=<file> write a Chrome trace of the compiler's phases and LLVM's passes\n"
+    "  --time-trace-granularity=<us> leave spans shorter than this out of the trace, 500 by default\n"
+    "  --time-report       print the time spent in each phase and the slowest functions\n"
+    "  --mem-report[=<file>] print where the memory goes, and write it to <file> as JSON";
+
+// The -f options for single fast-math flags, also in their negated form.
+bool fastMathOption(llvm::StringRef Arg, unsigned& Flags) {
+  static const struct {
+    const char* Set;
+    const char* Clear;
+    unsigned Flag;
+  } FlagOptions[] = {
+      {"-ffast-math", "-fno-fast-math", FMAll},
+      {"-ffp-contract=fast", "-ffp-contract=off", FMContract},
+      {"-fno-honor-nans", "-fhonor-nans", FMNoNaNs},
+      {"-fno-honor-infinities", "-fhonor-infinities", FMNoInfs},
+      {"-fno-signed-zeros", "-fsigned-zeros", FMNoSignedZeros},
+      {"-fassociative-math", "-fno-associative-math", FMReassoc},
+      {"-freciprocal-math", "-fno-reciprocal-math", FMAllowReciprocal},
+      {"-fapprox-func", "-fno-approx-func", FMApproxFunc},
+  };
+  for (auto &Option : FlagOptions)
+  {
+    if (Arg == Option.Set)
     {
-      std::cerr << "USAGE: randlang <inputFile> <outputFile>";
-      return -1;
+      Flags |= Option.Flag;
+      return true;
+    } else if (Arg == Option.Clear)
+    {
+      Flags &= ~Option.Flag;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseOptions(const std::vector<std::string>& Args, Options& Opts) {
+  std::vector<std::string> Files;
+  for (size_t i = 0; i < Args.size(); i++)
+  {
+    llvm::StringRef Arg(Args[i]);
+    if (Arg.starts_with("-j") || Arg.starts_with("-o") || Arg.starts_with("-I"))
+    {
+      // -j 8, -o out/ and -I lib/ may also be written as -j8, -oout/ and -Ilib/
+      std::string Value = Arg.drop_front(2).str();
+      if (Value.empty())
+      {
+        if (++i == Args.size())
+        {
+          std::cerr << Arg.str() << " needs an argument";
+          return false;
+        }
+        Value = Args[i];
+      }
+      if (Arg.starts_with("-o"))
+      {
+        Opts.Output = Value;
+        Opts.OutputDirectory = true;
+      } else if (Arg.starts_with("-I"))
+      {
+        Opts.ImportPaths.push_back(Value);
+      } else if (llvm::StringRef(Value).getAsInteger(10, Opts.Jobs) || Opts.Jobs == 0)
+      {
+        std::cerr << "-j expects a number of files";
+        return false;
+      }
+    } else if (Arg.size() == 3 && Arg.starts_with("-O") && Arg[2] >= '0' && Arg[2] <= '3')
+    {
+      Opts.OptLevel = Arg[2] - '0';
+    } else if (Arg.consume_front("--emit="))
+    {
+      if (Arg == "obj")
+      {
+        Opts.Emit = EmitKind::Object;
+      } else if (Arg == "asm")
+      {
+        Opts.Emit = EmitKind::Assembly;
+      } else if (Arg == "bc")
+      {
+        Opts.Emit = EmitKind::Bitcode;
+      } else if (Arg == "ll")
+      {
+        Opts.Emit = EmitKind::IR;
+      } else
+      {
+        std::cerr << "--emit expects obj, asm, bc or ll";
+        return false;
+      }
+    } else if (Arg == "--thinlto")
+    {
+      Opts.ThinLTO = true;
+    } else if (Arg == "--profile-generate" || Arg.consume_front("--profile-generate="))
+    {
+      Opts.ProfileGenerate = true;
+      Opts.ProfileRaw = Arg.starts_with("-") ? "" : Arg.str();
+    } else if (Arg.consume_front("--profile-use="))
+    {
+      Opts.ProfileUse = Arg.str();
+    } else if (Arg.consume_front("--vector-library="))
+    {
+      std::optional<llvm::driver::VectorLibrary> Lib = llvm::StringSwitch<std::optional<llvm::driver::VectorLibrary>>(Arg)
+          .Case("none", llvm::driver::VectorLibrary::NoLibrary)
+          .Case("libmvec", llvm::driver::VectorLibrary::LIBMVEC)
+          .Case("sleef", llvm::driver::VectorLibrary::SLEEF)
+          .Case("svml", llvm::driver::VectorLibrary::SVML)
+          .Case("armpl", llvm::driver::VectorLibrary::ArmPL)
+          .Case("amdlibm", llvm::driver::VectorLibrary::AMDLIBM)
+          .Case("accelerate", llvm::driver::VectorLibrary::Accelerate)
+          .Default(std::nullopt);
+      if (!Lib)
+      {
+        std::cerr << "--vector-library expects none, libmvec, sleef, svml, armpl, amdlibm or accelerate";
+        return false;
+      }
+      Opts.VectorLibrary = *Lib;
+    } else if (fastMathOption(Arg, Opts.FastMath))
+    {
+      // -ffast-math and the single flags, applied in order
+    } else if (Arg.starts_with("-ffp-contract="))
+    {
+      std::cerr << "-ffp-contract expects fast or off";
+      return false;
+    } else if (Arg.starts_with("-Rpass"))
+    {
+      std::string* Filter = Arg.consume_front("-Rpass=") ? &Opts.Remarks.Passed
+          : Arg.consume_front("-Rpass-missed=") ? &Opts.Remarks.Missed
+          : Arg.consume_front("-Rpass-analysis=") ? &Opts.Remarks.Analysis : nullptr;
+      std::string Error;
+      if (!Filter)
+      {
+        std::cerr << "unknown option " << Args[i];
+        return false;
+      } else if (Arg.empty() || !isValidRemarkFilter(Arg.str(), Error))
+      {
+        std::cerr << Args[i] << ": invalid regular expression " << Error;
+        return false;
+      }
+      *Filter = Arg.str();
+    } else if (Arg == "--opt-record" || Arg.consume_front("--opt-record="))
+    {
+      Opts.Remarks.Record = true;
+      Opts.Remarks.RecordFile = Arg.starts_with("-") ? "" : Arg.str();
+    } else if (Arg == "-g" || Arg == "-gline-tables-only" || Arg == "-g0")
+    {
+      Opts.Debug = Arg == "-g" ? DebugLevel::Full : Arg == "-g0" ? DebugLevel::None : DebugLevel::LineTablesOnly;
+    } else if (Arg == "--perf-jit")
+    {
+      Opts.PerfJIT = true;
+    } else if (Arg == "--emit-interface")
+    {
+      Opts.EmitInterface = true;
+    } else if (Arg.consume_front("--cache-dir="))
+    {
+      Opts.CacheDir = Arg.str();
+    } else if (Arg.consume_front("--ast-cache="))
+    {
+      Opts.ASTCacheDir = Arg.str();
+    } else if (Arg.consume_front("--cache-size="))
+    {
+      if (Arg.getAsInteger(10, Opts.CacheSize))
+      {
+        std::cerr << "--cache-size expects a number of MiB";
+        return false;
+      }
+    } else if (Arg == "--cache-stats")
+    {
+      Opts.CacheStats = true;
+    } else if (Arg.consume_front("--time-trace="))
+    {
+      Opts.TimeTrace = Arg.str();
+    } else if (Arg.consume_front("--time-trace-granularity="))
+    {
+      if (Arg.getAsInteger(10, Opts.TimeTraceGranularity))
+      {
+        std::cerr << "--time-trace-granularity expects a number of microseconds";
+        return false;
+      }
+    } else if (Arg == "--print-ir")
+    {
+      Opts.PrintIR = true;
+    } else if (Arg == "--time-report")
+    {
+      Opts.TimeReport = true;
+    } else if (Arg == "--mem-report" || Arg.consume_front("--mem-report="))
+    {
+      Opts.MemReport = true;
+      Opts.MemReportJSON = Arg.starts_with("-") ? "" : Arg.str();
+    } else if (Arg == "--server" || Arg.consume_front("--server="))
+    {
+      Opts.Server = true;
+      Opts.Socket = Arg.starts_with("-") ? "" : Arg.str();
+    } else if (Arg == "--connect" || Arg.consume_front("--connect="))
+    {
+      Opts.Connect = true;
+      Opts.Socket = Arg.starts_with("-") ? "" : Arg.str();
+    } else if (Arg.starts_with("-"))
+    {
+      std::cerr << "unknown option " << Args[i];
+      return false;
+    } else
+    {
+      Files.push_back(Args[i]);
+    }
+  }
+
+  if (Opts.Server)
+  {
+    if (!Files.empty() || Opts.OutputDirectory)
+    {
+      std::cerr << Usage;
+      return false;
+    }
+  } else if (Opts.OutputDirectory)
+  {
+    if (Files.empty())
+    {
+      std::cerr << Usage;
+      return false;
+    }
+    Opts.Inputs = Files;
+  } else
+  {
+    if (Files.size() != 2)
+    {
+      std::cerr << Usage;
+      return false;
+    }
+    Opts.Inputs = {Files[0]};
+    Opts.Output = Files[1];
+  }
+  if (Opts.ThinLTO && Opts.Emit == EmitKind::Assembly)
+  {
+    std::cerr << "--thinlto writes bitcode or LLVM IR, not assembly";
+    return false;
+  }
+  if (Opts.Inputs.size() > 1 && !Opts.Remarks.RecordFile.empty())
+  {
+    std::cerr << "--opt-record=<file> takes one input, without a file name each gets <output>.opt.yaml";
+    return false;
+  }
+  if (Opts.ProfileGenerate && !Opts.ProfileUse.empty())
+  {
+    std::cerr << "--profile-generate and --profile-use can't be combined";
+    return false;
+  }
+  if (Opts.Socket.empty())
+  {
+    Opts.Socket = defaultSocketPath();
+  }
+  return true;
+}
+
+// Targets are set up once per process, a server keeps them for all requests.
+// TargetMachines can't be shared between threads, every thread creates its own.
+llvm::TargetMachine* getTargetMachine() {
+  static const std::string TargetTriple = llvm::sys::getDefaultTargetTriple();
+  static const llvm::Target* Target = [] {
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmParsers();
+    llvm::InitializeAllAsmPrinters();
+
+    std::string Error;
+    auto Target = llvm::TargetRegistry::lookupTarget(llvm::Triple(TargetTriple), Error);
+
+    // Print an error and exit if we couldn't find the requested target.
+    // This generally occurs if we've forgotten to initialise the
+    // TargetRegistry or we have a bogus target triple.
+    if (!Target) {
+      llvm::errs() << Error;
+    }
+    return Target;
+  }();
+
+  thread_local std::unique_ptr<llvm::TargetMachine> TheTargetMachine;
+  if (!TheTargetMachine && Target)
+  {
+    // ValueType::MaxParameterVectorBits depends on this: no wider vector registers.
+    auto CPU = "generic";
+    auto Features = "";
+
+    llvm::TargetOptions opt;
+    TheTargetMachine.reset(Target->createTargetMachine(
+        llvm::Triple(TargetTriple), CPU, Features, opt, llvm::Reloc::PIC_));
+  }
+  return TheTargetMachine.get();
+}
+
+// Backend optimization level that goes with -O<n>.
+llvm::CodeGenOptLevel codeGenOptLevel(unsigned OptLevel) {
+  switch (OptLevel)
+  {
+    case 0:
+      return llvm::CodeGenOptLevel::None;
+    case 3:
+      return llvm::CodeGenOptLevel::Aggressive;
+    default:
+      return llvm::CodeGenOptLevel::Default;
+  }
+}
+
+// File extension of the outputs written to an -o directory. Like clang -c
+// -flto=thin, --thinlto still names its bitcode .o unless --emit=bc is given.
+const char* outputExtension(const Options& Opts) {
+  switch (Opts.Emit)
+  {
+    case EmitKind::Assembly:
+      return ".s";
+    case EmitKind::Bitcode:
+      return ".bc";
+    case EmitKind::IR:
+      return ".ll";
+    default:
+      return ".o";
+  }
+}
+
+// Instrumentation or profile use for the module pipeline. The profile is
+// matched to functions by a hash of their CFG after the function passes, so
+// it has to come from a build at the same -O level.
+std::optional<llvm::PGOOptions> pgoOptions(const Options& Opts) {
+  if (Opts.ProfileGenerate)
+  {
+    // parallel reduce runs rdlg code on several threads.
+    return llvm::PGOOptions(Opts.ProfileRaw, "", "", "", llvm::vfs::getRealFileSystem(), llvm::PGOOptions::IRInstr,
+        llvm::PGOOptions::NoCSAction, llvm::PGOOptions::ColdFuncOpt::Default, /*DebugInfoForProfiling*/ false,
+        /*PseudoProbeForProfiling*/ false, /*AtomicCounterUpdate*/ true);
+  }
+  if (!Opts.ProfileUse.empty())
+  {
+    return llvm::PGOOptions(Opts.ProfileUse, "", "", "", llvm::vfs::getRealFileSystem(), llvm::PGOOptions::IRUse);
+  }
+  return std::nullopt;
+}
+
+// -O2 and -O3 run LLVM's default module pipeline over the whole file, after
+// the function passes that already ran on each function. For ThinLTO it is the
+// pre-link pipeline, which leaves inlining across modules and the loop
+// optimizations that depend on it to the link. With a PGO option the pipeline
+// of the level also runs at -O0 and -O1, it adds the counters or reads the
+// branch weights and entry counts. The vector library tells the loop and SLP
+// vectorizers which vector variants of sin, exp, ... they may call.
+void optimizeModule(llvm::TargetMachine* TM, unsigned OptLevel, bool ThinLTO, std::optional<llvm::PGOOptions> PGO,
+    llvm::driver::VectorLibrary VectorLibrary) {
+  TimeScope Scope(Phase::Optimize, "module");
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassInstrumentationCallbacks PIC;
+  llvm::StandardInstrumentations SI(*ASTNode::TheContext, /*DebugLogging*/ false);
+  SI.registerCallbacks(PIC, &MAM);
+
+  llvm::PassBuilder PB(TM, llvm::PipelineTuningOptions(), PGO, &PIC);
+  std::unique_ptr<llvm::TargetLibraryInfoImpl> TLII(llvm::driver::createTLII(TM->getTargetTriple(), VectorLibrary));
+  FAM.registerPass([&] { return llvm::TargetLibraryAnalysis(*TLII); });
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  const llvm::OptimizationLevel Levels[] = {llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1, llvm::OptimizationLevel::O2,
+      llvm::OptimizationLevel::O3};
+  llvm::OptimizationLevel Level = Levels[OptLevel];
+  llvm::ModulePassManager MPM = ThinLTO ? PB.buildThinLTOPreLinkDefaultPipeline(Level) : PB.buildPerModuleDefaultPipeline(Level);
+  if (PGO && PGO->Action == llvm::PGOOptions::IRUse && Level != llvm::OptimizationLevel::O0)
+  {
+    // Cold blocks found by the profile are moved out of their functions.
+    MPM.addPass(llvm::HotColdSplittingPass());
+  }
+  if (PGO && PGO->Action == llvm::PGOOptions::IRInstr)
+  {
+    // Top-level expressions have no name a profile could refer to.
+    for (auto &F : *ASTNode::TheModule)
+    {
+      if (!F.hasName() && !F.isDeclaration())
+      {
+        F.addFnAttr(llvm::Attribute::NoProfile);
+      }
     }
+  }
+  MPM.run(*ASTNode::TheModule, MAM);
+}
 
+// Reads Input when a thread picks it up and writes Output as soon as it is
+// done, so file I/O overlaps with the other files being compiled.
+int compileFile(const Options& Opts, const std::string& Input, const std::string& Output, FunctionCache* Cache, ASTCache* ASTs) {
+    llvm::TimeTraceScope FileScope("File", Input);
     std::string code;
     std::string snipped;
-    std::ifstream filestr(argv[1]);
+    std::optional<TimeScope> Load;
+    Load.emplace(Phase::Load, Input);
+    std::ifstream filestr(Input);
 
     if (filestr.is_open())
     {
@@ -62,14 +531,34 @@ int main(int argc, char** argv) {
       
       
     } else {
-      std::cerr << "could not open file";
+      std::cerr << "could not open file " << Input << std::endl;
       return -1;
     }
+    Load.reset();
 
     //std::cout << code.c_str() << std::endl;
 
-    Parser cparse(code.c_str());
-    cparse.parse();
+    auto TheTargetMachine = getTargetMachine();
+    if (!TheTargetMachine)
+    {
+      return 1;
+    }
+    std::string TargetTriple = TheTargetMachine->getTargetTriple().str();
+
+    Parser cparse(code.c_str(), Cache, llvm::sys::path::parent_path(Input).str());
+    DebugInfo::beginFile(*ASTNode::TheModule, Input, TargetTriple, Parser::OptLevel > 0);
+    FileRemarks Remarks;
+    if (!Remarks.begin(*ASTNode::TheContext, Opts.Remarks, Input, Output))
+    {
+      return 1;
+    }
+    if (ASTs)
+    {
+      ASTs->parse(cparse, code);
+    } else
+    {
+      cparse.parse();
+    }
   //   Lexer lex(code.c_str());
   //   for (auto token = lex.next();
   //      not token.is_one_of(Token::Kind::End, Token::Kind::Unexpected);
@@ -78,38 +567,35 @@ int main(int argc, char** argv) {
   //             << "|\n";
   // }
 
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
-
-    auto TargetTriple = llvm::sys::getDefaultTargetTriple();
-    ASTNode::TheModule->setTargetTriple(llvm::Triple(TargetTriple));
-
-    std::string Error;
-    auto Target = llvm::TargetRegistry::lookupTarget(ASTNode::TheModule->getTargetTriple(), Error);
-
-    // Print an error and exit if we couldn't find the requested target.
-    // This generally occurs if we've forgotten to initialise the
-    // TargetRegistry or we have a bogus target triple.
-    if (!Target) {
-      llvm::errs() << Error;
+    if (MemReport::Enabled)
+    {
+      MemReport::countFile(Input);
+    }
+    if (Opts.EmitInterface && !InterfaceFile::write(InterfaceFile::pathFor(Output)))
+    {
       return 1;
     }
 
-    auto CPU = "generic";
-    auto Features = "";
-
-    llvm::TargetOptions opt;
-    auto TheTargetMachine = Target->createTargetMachine(
-        llvm::Triple(TargetTriple), CPU, Features, opt, llvm::Reloc::PIC_);
-
+    DebugInfo::endFile();
+    ASTNode::TheModule->setTargetTriple(llvm::Triple(TargetTriple));
     ASTNode::TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    std::optional<llvm::PGOOptions> PGO = pgoOptions(Opts);
+    if (Parser::OptLevel >= 2 || PGO)
+    {
+      optimizeModule(TheTargetMachine, Parser::OptLevel, Opts.ThinLTO, PGO, Opts.VectorLibrary);
+    }
+    if (Parser::OptLevel >= 1)
+    {
+      TimeScope Scope(Phase::Optimize, "output");
+      lowerOutputCalls(*ASTNode::TheModule);
+    }
+    // A server reuses its TargetMachine for requests with different levels.
+    TheTargetMachine->setOptLevel(codeGenOptLevel(Parser::OptLevel));
 
-    auto Filename = argv[2];
+    auto Filename = Output;
     std::error_code EC;
-    llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::OF_None);
+    const bool Text = Opts.Emit == EmitKind::Assembly || Opts.Emit == EmitKind::IR;
+    llvm::raw_fd_ostream dest(Filename, EC, Text ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None);
     // llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::CD_OpenAlways, llvm::sys::fs::FA_Write, llvm::sys::fs::OF_None); //A different option
     
 
@@ -118,18 +604,259 @@ int main(int argc, char** argv) {
       return 1;
     }
 
-    llvm::legacy::PassManager pass;
-    auto FileType = llvm::CodeGenFileType::ObjectFile;
+    if (Opts.Emit == EmitKind::IR)
+    {
+      ASTNode::TheModule->print(dest, nullptr);
+      dest.flush();
+    } else if (Opts.Emit == EmitKind::Bitcode || Opts.ThinLTO)
+    {
+      // The summary lets the thin link import functions between rdlg and
+      // C++ modules without loading them, the hash keys its incremental cache.
+      TimeScope Scope(Phase::Backend, Filename);
+      if (Opts.ThinLTO)
+      {
+        llvm::ProfileSummaryInfo PSI(*ASTNode::TheModule);
+        llvm::ModuleSummaryIndex Index = llvm::buildModuleSummaryIndex(*ASTNode::TheModule, nullptr, &PSI);
+        llvm::WriteBitcodeToFile(*ASTNode::TheModule, dest, /*ShouldPreserveUseListOrder*/ false, &Index, /*GenerateHash*/ true);
+      } else
+      {
+        llvm::WriteBitcodeToFile(*ASTNode::TheModule, dest);
+      }
+      dest.flush();
+    } else
+    {
+      llvm::legacy::PassManager pass;
+      auto FileType = Opts.Emit == EmitKind::Assembly ? llvm::CodeGenFileType::AssemblyFile : llvm::CodeGenFileType::ObjectFile;
+
+      if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
+        llvm::errs() << "TheTargetMachine can't emit a file of this type";
+        return 1;
+      }
 
-    if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-      llvm::errs() << "TheTargetMachine can't emit a file of this type";
-      return 1;
+      TimeScope Scope(Phase::Backend, Filename);
+      pass.run(*ASTNode::TheModule);
+      dest.flush();
     }
 
-    pass.run(*ASTNode::TheModule);
-    dest.flush();
-
+    std::lock_guard<std::mutex> Lock(Parser::OutputLock);
     llvm::outs() << "Wrote " << Filename << "\n";
+    llvm::outs().flush();
 
   return 0;
-}
\ No newline at end of file
+}
+
+int compile(const Options& Opts) {
+  // The targets are set up before any thread needs them.
+  auto TheTargetMachine = getTargetMachine();
+  if (!TheTargetMachine)
+  {
+    return 1;
+  }
+
+  // A profile LLVM can't read is a fatal error inside the pass pipeline.
+  if (!Opts.ProfileUse.empty() && !llvm::sys::fs::exists(Opts.ProfileUse))
+  {
+    std::cerr << "could not find the profile " << Opts.ProfileUse << std::endl;
+    return 1;
+  }
+  Parser::OptLevel = Opts.OptLevel;
+  Parser::PrintIR = Opts.PrintIR;
+  ASTNode::DefaultFastMath = Opts.FastMath;
+  Parser::ImportPaths = Opts.ImportPaths;
+  DebugInfo::Level = Opts.Debug;
+  if (Opts.PerfJIT && !ComptimeEvaluator::enablePerfSupport())
+  {
+    std::cerr << "warning: LLVM was built without perf support, --perf-jit only writes /tmp/perf-<pid>.map" << std::endl;
+  }
+  std::unique_ptr<FunctionCache> Cache;
+  if (!Opts.CacheDir.empty())
+  {
+    std::string Configuration = FunctionCache::compilerVersion(Argv0) + "\n" + TheTargetMachine->getTargetTriple().str() + " " +
+        TheTargetMachine->getTargetCPU().str() + " " + TheTargetMachine->getTargetFeatureString().str() + "\n" + Parser::functionPasses() +
+        "\ndebug " + std::to_string((int)Opts.Debug);
+    Cache = std::make_unique<FunctionCache>(Opts.CacheDir, Configuration, Opts.CacheSize * 1024 * 1024);
+  }
+  // The AST doesn't depend on the target or the optimization level, but the
+  // comptime values stored with it are computed under the fast-math flags.
+  std::unique_ptr<ASTCache> ASTs;
+  if (!Opts.ASTCacheDir.empty())
+  {
+    std::string Configuration = FunctionCache::compilerVersion(Argv0) + "\nfast-math " + std::to_string(Opts.FastMath);
+    ASTs = std::make_unique<ASTCache>(Opts.ASTCacheDir, Configuration, Opts.CacheSize * 1024 * 1024);
+  }
+
+  std::vector<std::string> Outputs;
+  if (Opts.OutputDirectory)
+  {
+    if (std::error_code EC = llvm::sys::fs::create_directories(Opts.Output))
+    {
+      std::cerr << "could not create " << Opts.Output << ": " << EC.message() << std::endl;
+      return 1;
+    }
+    std::set<std::string> Seen;
+    for (auto &Input : Opts.Inputs)
+    {
+      llvm::SmallString<128> Path(Opts.Output);
+      llvm::sys::path::append(Path, llvm::sys::path::stem(Input) + outputExtension(Opts));
+      if (!Seen.insert(std::string(Path)).second)
+      {
+        std::cerr << "more than one input would be written to " << Path.str().str() << std::endl;
+        return 1;
+      }
+      Outputs.push_back(std::string(Path));
+    }
+  } else
+  {
+    Outputs.push_back(Opts.Output);
+  }
+
+  TimeReport::Enabled = Opts.TimeReport;
+  if (Opts.MemReport)
+  {
+    MemReport::start();
+  }
+  const bool Tracing = !Opts.TimeTrace.empty();
+  if (Tracing)
+  {
+    llvm::timeTraceProfilerInitialize(Opts.TimeTraceGranularity, Argv0);
+  }
+  auto Started = std::chrono::steady_clock::now();
+
+  std::atomic<int> Status{0};
+  auto Run = [&](size_t i) {
+    // Pool threads keep a trace of their own and hand it over once the file is done.
+    const bool ThreadTrace = Tracing && !llvm::timeTraceProfilerEnabled();
+    if (ThreadTrace)
+    {
+      llvm::timeTraceProfilerInitialize(Opts.TimeTraceGranularity, Argv0);
+    }
+    int FileStatus = compileFile(Opts, Opts.Inputs[i], Outputs[i], Cache.get(), ASTs.get());
+    int Expected = 0;
+    Status.compare_exchange_strong(Expected, FileStatus);
+    if (ThreadTrace)
+    {
+      llvm::timeTraceProfilerFinishThread();
+    }
+  };
+  if (Opts.Inputs.size() == 1 || Opts.Jobs == 1)
+  {
+    for (size_t i = 0; i < Opts.Inputs.size(); i++)
+    {
+      Run(i);
+    }
+  } else
+  {
+    llvm::DefaultThreadPool Pool(llvm::hardware_concurrency(Opts.Jobs));
+    for (size_t i = 0; i < Opts.Inputs.size(); i++)
+    {
+      Pool.async(Run, i);
+    }
+    Pool.wait();
+  }
+
+  if (Cache)
+  {
+    Cache->prune();
+    if (Opts.CacheStats)
+    {
+      Cache->printStats(llvm::outs());
+    }
+  }
+  if (ASTs)
+  {
+    ASTs->prune();
+    if (Opts.CacheStats)
+    {
+      ASTs->printStats(llvm::outs());
+    }
+  }
+
+  if (Opts.TimeReport)
+  {
+    TimeReport::print(llvm::outs(), std::chrono::steady_clock::now() - Started);
+  }
+  if (Opts.MemReport)
+  {
+    MemReport::print(llvm::outs());
+    if (!Opts.MemReportJSON.empty() && !MemReport::writeJSON(Opts.MemReportJSON))
+    {
+      int Expected = 0;
+      Status.compare_exchange_strong(Expected, 1);
+    }
+  }
+  if (Tracing)
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream TraceFile(Opts.TimeTrace, EC, llvm::sys::fs::OF_Text);
+    if (EC)
+    {
+      llvm::errs() << "Could not open file: " << EC.message() << "\n";
+      int Expected = 0;
+      Status.compare_exchange_strong(Expected, 1);
+    } else
+    {
+      llvm::timeTraceProfilerWrite(TraceFile);
+    }
+    llvm::timeTraceProfilerCleanup();
+  }
+  return Status;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  // auto code =
+  //     "x = 2\n"
+  //     "// This is a comment.\n"
+  //     "var x\n"
+  //     "var y\n"
+  //     "var f = function(x, y) { sin(x) * sin(y) + x * y; }\n"
+  //     "der(f, x)\n"
+  //     "var g = function(x, y) { 2 * (x + der(f, y)); } // der(f, y) is a "
+  //     "matrix\n"
+  //     "var r{3}; // Vector of three elements\n"
+  //     "var J{12, 12}; // Matrix of 12x12 elements\n"
+  //     "var dot = function(u{:}, v{:}) -> scalar {\n"
+  //     "          return u[i] * v[i]; // Einstein notation\n"
+  //     "}\n"
+  //     "var norm = function(u{:}) -> scalar { return sqrt(dot(u, u)); }\n"
+  //     "<end>";
+    Argv0 = argv[0];
+    std::vector<std::string> Args(argv + 1, argv + argc);
+    Options Opts;
+    if (!parseOptions(Args, Opts))
+    {
+      return -1;
+    }
+
+    if (Opts.Server)
+    {
+      if (!getTargetMachine())
+      {
+        return 1;
+      }
+      return runServer(Opts.Socket, [](const std::vector<std::string>& RequestArgs) {
+        Options RequestOpts;
+        if (!parseOptions(RequestArgs, RequestOpts) || RequestOpts.Server)
+        {
+          return -1;
+        }
+        return compile(RequestOpts);
+      });
+    }
+
+    // Without a server the file is compiled here.
+    const char* ServerSocket = std::getenv("RANDLANG_SERVER");
+    if (Opts.Connect || ServerSocket)
+    {
+      std::string Socket = !Opts.Connect && *ServerSocket ? ServerSocket : Opts.Socket;
+      Args.erase(std::remove_if(Args.begin(), Args.end(), [](const std::string& A) { return llvm::StringRef(A).starts_with("--connect"); }), Args.end());
+      int ExitCode;
+      if (runClient(Socket, Args, ExitCode))
+      {
+        return ExitCode;
+      }
+    }
+
+  return compile(Opts);
+}